@@ -184,6 +184,8 @@ ${CLI} mkmeta $DEV               || fail "mkmeta repeat should fail"
 # Replay the log, recovering the files that existed befure the umount
 ${CLI} logplay -vr $MPT             || fail "logplay 3 should work but be nop"
 ${CLI} logplay -m $MPT             || fail "logplay 3 should work but be nop"
+${CLI} logplay -fv $MPT            || fail "logplay --full should work but be nop"
+${CLI} logplay -f -j 4 $MPT        || fail "logplay --full --threads 4 should work but be nop"
 
 # Re-verify the files from prior to the umount
 ${CLI} verify -S 1 -f $MPT/test1 || fail "verify test1 after replay"
@@ -244,6 +246,14 @@ ${CLI} flush             && fail "flush with no args should fail"
 ${CLI} flush /bogus/file && "flush of a bogus file should fail"
 ${CLI} flush $(sudo find $MPT -type f -print) || fail "flush all files should work"
 ${CLI} flush -vv $(sudo find $MPT -print)     && fail "this flush should report errors"
+${CLI} flush -j 4 $(sudo find $MPT -type f -print) || fail "flush all files with 4 threads should work"
+${CLI} flush -r -j 4 $MPT   || fail "recursive flush with 4 threads should work"
+${CLI} flush -j 0 $MPT      && fail "flush with 0 threads should fail"
+${CLI} flush -o 4096 -l 1 -m writeback $MPT/.meta/.log   || fail "flush range writeback should work"
+${CLI} flush --offset 0 --mode invalidate $MPT/.meta/.log || fail "flush range to EOF should work"
+${CLI} flush -o 1G $MPT/.meta/.log          && fail "flush range beyond EOF should fail"
+${CLI} flush -o 0 -r $MPT                   && fail "flush range of a dir should fail"
+${CLI} flush -m bogus $MPT/.meta/.log       && fail "flush with a bad mode should fail"
 
 ${CLI} fsck      && fail "fsck with no args should fail"
 ${CLI} fsck -?   || fail "fsck -h should succeed"x
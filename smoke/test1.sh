@@ -154,6 +154,23 @@ ${CLI} cp $MPT/$F $MPT/subdir/${F}_cp6      || fail "cp6 $F"
 ${CLI} cp $MPT/$F $MPT/subdir/${F}_cp7      || fail "cp7 $F"
 ${CLI} cp -v $MPT/$F $MPT/subdir/${F}_cp8      || fail "cp8 $F"
 ${CLI} cp -v $MPT/$F $MPT/subdir/${F}_cp9      || fail "cp9 $F"
+${CLI} cp -j 4 --chunk 1M $MPT/$F $MPT/subdir/${F}_cpj0 || fail "cp -j 4 --chunk 1M $F"
+${CLI} cp -vj 2 $MPT/$F $MPT/subdir/${F}_cpj1  || fail "cp -j 2 $F"
+${CLI} cp -v --direct $MPT/$F $MPT/subdir/${F}_cpd0 || fail "cp --direct $F"
+${CLI} cp -v --nt $MPT/$F $MPT/subdir/${F}_cpnt0  || fail "cp --nt $F"
+${CLI} cp -v -j 4 --chunk 1M --nt $MPT/$F $MPT/subdir/${F}_cpnt1 || fail "cp -j 4 --nt $F"
+${CLI} cp -j 0 $MPT/$F $MPT/subdir/${F}_cpj2   && fail "cp -j 0 should fail"
+
+# A sparse source: only the data is read, and the holes are zeroed in the destination
+sudo rm -f /tmp/sparsefile
+sudo truncate -s 8M /tmp/sparsefile
+sudo dd if=/dev/urandom of=/tmp/sparsefile bs=4096 count=1 seek=1000 conv=notrunc
+${CLI} cp -v /tmp/sparsefile $MPT/sparse0       || fail "cp sparse file"
+${CLI} cp -v -j 4 --chunk 1M /tmp/sparsefile $MPT/sparse1 || fail "cp -j 4 sparse file"
+sudo cmp /tmp/sparsefile $MPT/sparse0 || fail "cmp sparse0"
+sudo cmp /tmp/sparsefile $MPT/sparse1 || fail "cmp sparse1"
+sudo rm -f /tmp/sparsefile
+${CLI} cp -j 2 --chunk 0 $MPT/$F $MPT/subdir/${F}_cpj3 && fail "cp --chunk 0 should fail"
 
 #
 # Copy stuff that is invalid
@@ -171,6 +188,11 @@ ${CLI} verify -S 42 -f $MPT/dirtarg/${F} || fail "verify dirtarg/${F}"
 
 ${CLI} logplay -n $MPT
 
+${CLI} verify -S 42 -f $MPT/subdir/${F}_cpj0 || fail "verify ${F}_cpj0"
+${CLI} verify -S 42 -f $MPT/subdir/${F}_cpj1 || fail "verify ${F}_cpj1"
+${CLI} verify -S 42 -f $MPT/subdir/${F}_cpd0 || fail "verify ${F}_cpd0"
+${CLI} verify -S 42 -f $MPT/subdir/${F}_cpnt0 || fail "verify ${F}_cpnt0"
+${CLI} verify -S 42 -f $MPT/subdir/${F}_cpnt1 || fail "verify ${F}_cpnt1"
 ${CLI} verify -S 42 -f $MPT/subdir/${F}_cp0 || fail "verify ${F}_cp0"
 ${CLI} verify -S 42 -f $MPT/subdir/${F}_cp1 || fail "verify ${F}_cp1"
 ${CLI} verify -S 42 -f $MPT/subdir/${F}_cp2 || fail "verify ${F}_cp2"
@@ -325,6 +347,18 @@ sudo diff -r $MPT/smalldir $MPT/smalldir2 || fail "diff -r smalldir smalldir2"
 
 ${CLI} cp -r $MPT/A $MPT/A-prime || fail "cp -r A A-prime"
 sudo diff -r $MPT/A $MPT/A-prime || fail "diff -r A A-prime"
+${CLI} cp -r -j 4 --chunk 64K $MPT/A $MPT/A-parallel || fail "cp -r -j 4 A A-parallel"
+sudo diff -r $MPT/A $MPT/A-parallel || fail "diff -r A A-parallel"
+${CLI} cp -r -j 4 --direct $MPT/A $MPT/A-direct || fail "cp -r -j 4 --direct A A-direct"
+sudo diff -r $MPT/A $MPT/A-direct || fail "diff -r A A-direct"
+
+# Concurrent copies (each releases the log lock while its data is copied)
+${CLI} cp -r $MPT/A $MPT/A-conc0 &
+CONC0=$!
+${CLI} cp -r $MPT/A $MPT/A-conc1 || fail "concurrent cp -r A A-conc1"
+wait $CONC0                      || fail "concurrent cp -r A A-conc0"
+sudo diff -r $MPT/A $MPT/A-conc0 || fail "diff -r A A-conc0"
+sudo diff -r $MPT/A $MPT/A-conc1 || fail "diff -r A A-conc1"
 #
 # cp -r with relative paths
 #
@@ -77,11 +77,19 @@ ${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 && fail "should fail with mis
 ${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 && fail "Create should fail with no file"
 
 # Create some queues
-${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 $MPT/q0 || fail "basic pcq create 0"
+${PCQ} --create -D -v --bsize 1024 --nbuckets 1024 --csum crc32 $MPT/q0 || fail "basic pcq create 0"
 ${PCQ} --create -v --bsize 64   --nbuckets 1K   $MPT/q1 || fail "basic pcq create 1"
 ${PCQ} --create -v --bsize 64K  --nbuckets 512  $MPT/q2 || fail "basic pcq create 2"
 ${PCQ} --create -v --bsize 512K --nbuckets 1k   $MPT/q3 || fail "basic pcq create 3"
 ${PCQ} --create -v --bsize 256K --nbuckets 256  $MPT/q4 || fail "basic pcq create 4"
+${PCQ} --create -v --mpmc --bsize 1K --nbuckets 64 $MPT/mq0 || fail "mpmc pcq create"
+${PCQ} --create -v --framed --bsize 256 --nbuckets 64 $MPT/fq0 || fail "framed pcq create"
+${PCQ} --create -v --framed --mpmc --bsize 256 --nbuckets 64 $MPT/fqx && fail "framed mpmc should fail"
+${PCQ} --create -v --framed --bsize 16 --nbuckets 64 $MPT/fqx && fail "framed 16 byte buckets should fail"
+${PCQ} --create -v --csum bogus --bsize 1K --nbuckets 64 $MPT/qx && fail "bad csum should fail"
+${PCQ} --create -v --subscribers 3 --bsize 1K --nbuckets 64 $MPT/bq0 || fail "broadcast pcq create"
+${PCQ} --create -v --subscribers 2 --mpmc --bsize 1K --nbuckets 64 $MPT/bqx \
+       && fail "broadcast mpmc should fail"
 
 # Set ownership to the non-privileged caller of this script, so tests run a non-root
 # This is important because root can write even without write permissions and we
@@ -93,11 +101,19 @@ sudo chown $id:$grp $MPT/q1
 sudo chown $id:$grp $MPT/q2
 sudo chown $id:$grp $MPT/q3
 sudo chown $id:$grp $MPT/q4
+sudo chown $id:$grp $MPT/mq0
+sudo chown $id:$grp $MPT/fq0
+sudo chown $id:$grp $MPT/bq0
 sudo chown $id:$grp $MPT/q0.consumer
 sudo chown $id:$grp $MPT/q1.consumer
 sudo chown $id:$grp $MPT/q2.consumer
 sudo chown $id:$grp $MPT/q3.consumer
 sudo chown $id:$grp $MPT/q4.consumer
+sudo chown $id:$grp $MPT/mq0.consumer
+sudo chown $id:$grp $MPT/fq0.consumer
+sudo chown $id:$grp $MPT/bq0.consumer
+sudo chown $id:$grp $MPT/bq0.consumer.1
+sudo chown $id:$grp $MPT/bq0.consumer.2
 
 # From here on we run the non-sudo ${pcq} rather than the sudo ${PCQ}
 
@@ -195,6 +211,115 @@ assert_equal $(cat $STATUSFILE) 2000 "produce/consume 1m with q3"
 ${pcq} -pc --seed 43 -N 1000 --statusfile $STATUSFILE $MPT/q4 || fail "p/c 1m in q4"
 assert_equal $(cat $STATUSFILE) 2000 "produce/consume 1m with q4"
 
+# Batched producer/consumer with seed verification (batches wrap the bucket array)
+${pcq} -pc --seed 43 -N 1000 -B 7 --statusfile $STATUSFILE $MPT/q0 || fail "batched p/c in q0"
+assert_equal $(cat $STATUSFILE) 2000 "batched produce/consume with q0"
+${pcq} -pc --seed 43 -N 1000 --batch 64 --statusfile $STATUSFILE $MPT/q1 || fail "batched p/c in q1"
+assert_equal $(cat $STATUSFILE) 2000 "batched produce/consume with q1"
+${pcq} --producer -N 100 -B 16 $MPT/q2 || fail "batched put 100 in q2"
+${pcq} --drain -B 8 --statusfile $STATUSFILE $MPT/q2 || fail "batched drain q2"
+assert_equal $(cat $STATUSFILE) 100 "batched drain 100 from q2"
+${pcq} -pc -N 10 -B 0 $MPT/q0 && fail "batch 0 should fail"
+
+# Zero-copy producer/consumer (reserve/commit, peek/release), mixed with copying peers
+${pcq} -pc --seed 43 -N 1000 -Z --statusfile $STATUSFILE $MPT/q2 || fail "zero-copy p/c in q2"
+assert_equal $(cat $STATUSFILE) 2000 "zero-copy produce/consume with q2"
+${pcq} --producer -Z --seed 44 -N 100 $MPT/q3 || fail "zero-copy put 100 in q3"
+${pcq} --drain --seed 44 --statusfile $STATUSFILE $MPT/q3 || fail "drain zero-copy puts from q3"
+assert_equal $(cat $STATUSFILE) 100 "drain 100 zero-copy puts from q3"
+${pcq} --producer --seed 45 -N 100 $MPT/q3 || fail "put 100 in q3"
+${pcq} --drain -Z --seed 45 --statusfile $STATUSFILE $MPT/q3 || fail "zero-copy drain q3"
+assert_equal $(cat $STATUSFILE) 100 "zero-copy drain 100 from q3"
+${pcq} -pc -N 10 -Z -B 4 $MPT/q0 && fail "zerocopy with batch should fail"
+
+# Multi-producer/multi-consumer
+${pcq} --producers 4 --consumers 3 --seed 46 -N 10000 --statusfile $STATUSFILE $MPT/mq0 || fail "mpmc 4p/3c"
+assert_equal $(cat $STATUSFILE) 20000 "mpmc 4 producers / 3 consumers"
+${pcq} --producers 3 -N 100 $MPT/mq0 || fail "mpmc put 100 with 3 producers"
+${pcq} --info -v $MPT/mq0            || fail "mpmc info"
+${pcq} --drain --statusfile $STATUSFILE $MPT/mq0 || fail "mpmc drain"
+assert_equal $(cat $STATUSFILE) 100 "mpmc drain 100"
+${pcq} --producers 2 -N 10 $MPT/q0   && fail "multiple producers on an spsc queue should fail"
+${pcq} --consumers 2 -N 10 $MPT/q0   && fail "multiple consumers on an spsc queue should fail"
+${pcq} --producers 2 -B 4 -N 10 $MPT/mq0 && fail "batch on an mpmc queue should fail"
+${pcq} --producers 0 -N 10 $MPT/mq0  && fail "0 producers should fail"
+
+# Wait policies
+for policy in yield spin backoff sleep; do
+    ${pcq} -pc --seed 47 -N 1000 --wait $policy --statusfile $STATUSFILE $MPT/q1 \
+	|| fail "p/c in q1 with wait policy $policy"
+    assert_equal $(cat $STATUSFILE) 2000 "produce/consume with wait policy $policy"
+done
+${pcq} --producers 2 --consumers 2 -N 1000 -W sleep --sleep-max 50 --statusfile $STATUSFILE \
+       $MPT/mq0 || fail "mpmc p/c with capped sleep"
+assert_equal $(cat $STATUSFILE) 2000 "mpmc produce/consume with capped sleep"
+${pcq} -pc -N 10 --wait bogus $MPT/q0  && fail "bogus wait policy should fail"
+${pcq} -pc -N 10 --sleep-max 0 $MPT/q0 && fail "--sleep-max 0 should fail"
+
+# Latency instrumentation (timestamps in payloads, seed still verified around them)
+${pcq} -pc --seed 48 -N 1000 -L -B 8 --statusfile $STATUSFILE $MPT/q1 || fail "latency p/c in q1"
+assert_equal $(cat $STATUSFILE) 2000 "produce/consume with latency"
+${pcq} -pc --seed 48 -N 1000 -Z --latency-json /tmp/pcq_latency.json --statusfile $STATUSFILE \
+       $MPT/q2 || fail "zero-copy latency p/c in q2"
+assert_equal $(cat $STATUSFILE) 2000 "zero-copy produce/consume with latency"
+grep -q '"latency_ns": {"count": 1000,' /tmp/pcq_latency.json || fail "latency json"
+
+# Framed (variable length) messages, including messages that span buckets
+${pcq} -pc --seed 49 -N 1000 --statusfile $STATUSFILE $MPT/fq0 || fail "framed p/c in fq0"
+assert_equal $(cat $STATUSFILE) 2000 "framed produce/consume"
+${pcq} -pc --seed 49 -N 1000 --max-msg 8K -L --statusfile $STATUSFILE $MPT/fq0 \
+       || fail "framed p/c of large messages in fq0"
+assert_equal $(cat $STATUSFILE) 2000 "framed produce/consume of large messages"
+${pcq} --producer --seed 50 -N 10 --max-msg 1K $MPT/fq0 || fail "framed put 10 in fq0"
+${pcq} --drain --seed 50 --statusfile $STATUSFILE $MPT/fq0 || fail "framed drain fq0"
+assert_equal $(cat $STATUSFILE) 10 "framed drain 10 from fq0"
+${pcq} -pc -N 10 -B 4 $MPT/fq0 && fail "batch on a framed queue should fail"
+${pcq} -pc -N 10 -Z $MPT/fq0   && fail "zerocopy on a framed queue should fail"
+
+# Broadcast queue: every subscriber receives every message
+${pcq} --producer --consumers 3 --subscriber 0 --seed 51 -N 1000 --statusfile $STATUSFILE \
+       $MPT/bq0 || fail "broadcast p/c to 3 subscribers"
+assert_equal $(cat $STATUSFILE) 4000 "broadcast produce/consume to 3 subscribers"
+${pcq} --producer --seed 52 -N 20 $MPT/bq0 || fail "broadcast put 20"
+${pcq} --drain --subscriber 1 --seed 52 --statusfile $STATUSFILE $MPT/bq0 \
+       || fail "broadcast drain subscriber 1"
+assert_equal $(cat $STATUSFILE) 20 "broadcast drain 20 for subscriber 1"
+${pcq} --info --statusfile $STATUSFILE $MPT/bq0 || fail "broadcast info"
+assert_equal $(cat $STATUSFILE) 20 "broadcast info reports the slowest subscriber's lag"
+${pcq} --drain --subscriber 3 $MPT/bq0 && fail "drain of nonexistent subscriber should fail"
+${pcq} --drain --subscriber 1 $MPT/q0  && fail "subscriber of a non-broadcast queue should fail"
+${pcq} --setperm p $MPT/bq0            || fail "setperm p on broadcast queue"
+test -w $MPT/bq0.consumer.2            && fail "setperm p should cover every subscriber"
+${pcq} --setperm b $MPT/bq0            || fail "setperm b on broadcast queue"
+${pcq} --drain --subscriber 0 --seed 52 $MPT/bq0 || fail "broadcast drain subscriber 0"
+${pcq} --drain --subscriber 2 --seed 52 $MPT/bq0 || fail "broadcast drain subscriber 2"
+
+# A producer that opens while subscriber 0 is ahead of the others must still be limited
+# by the slowest subscriber: with 40 unread by subscribers 1 and 2, 40 more can't fit
+${pcq} --producer --seed 55 -N 40 $MPT/bq0 || fail "broadcast put 40"
+${pcq} --drain --subscriber 0 --seed 55 $MPT/bq0 || fail "broadcast drain 40 subscriber 0"
+timeout 10 ${pcq} --producer --seed 56 -N 40 $MPT/bq0 \
+	&& fail "broadcast producer should block on the slowest subscriber"
+${pcq} --info --statusfile $STATUSFILE $MPT/bq0 || fail "broadcast info after blocked put"
+assert_equal $(cat $STATUSFILE) 63 "broadcast queue is full for the slowest subscriber"
+${pcq} --drain --subscriber 1 --statusfile $STATUSFILE $MPT/bq0 \
+       || fail "broadcast drain subscriber 1 (no overwrites)"
+assert_equal $(cat $STATUSFILE) 63 "broadcast drain 63 for subscriber 1"
+${pcq} --drain --subscriber 0 $MPT/bq0 || fail "broadcast drain subscriber 0 (blocked put)"
+${pcq} --drain --subscriber 2 $MPT/bq0 || fail "broadcast drain subscriber 2 (no overwrites)"
+
+# Doorbell: same-host consumers block in poll() on a local FIFO rather than polling
+DOORBELL=/tmp/pcq_doorbell.$$
+${pcq} -pc --seed 53 -N 1000 --doorbell $DOORBELL --statusfile $STATUSFILE $MPT/q0 \
+       || fail "p/c with doorbell in q0"
+assert_equal $(cat $STATUSFILE) 2000 "produce/consume with doorbell"
+test -p $DOORBELL || fail "doorbell FIFO should have been created"
+${pcq} --producer --consumers 3 --subscriber 0 --seed 54 -N 1000 --doorbell $DOORBELL \
+       --statusfile $STATUSFILE $MPT/bq0 || fail "broadcast p/c with doorbells"
+assert_equal $(cat $STATUSFILE) 4000 "broadcast produce/consume with doorbells"
+${pcq} -pc -N 10 --doorbell $DOORBELL $MPT/mq0 && fail "doorbell on an mpmc queue should fail"
+rm -f $DOORBELL $DOORBELL.1 $DOORBELL.2
+
 # Run simultaneous producer/consumer for 10K messages on each queue
 ${pcq} -pc -s 1 -N 10000 --statusfile $STATUSFILE $MPT/q0 || fail "p/c 1m in q0"
 assert_equal $(cat $STATUSFILE) 20000 "produce/consume 1m with q0"
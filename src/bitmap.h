@@ -5,6 +5,12 @@
 #ifndef _H_MSE_PLATFORM_BITMAP
 #define _H_MSE_PLATFORM_BITMAP
 
+#include <string.h>
+#include <sys/param.h> /* MIN() */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #define BYTE_SHIFT 3
 
 static inline int
@@ -184,4 +190,301 @@ mse_bitmap_test_and_clear32(
 	return 1;
 }
 
+/*
+ * Range operations
+ *
+ * These process the bitmap 64 bits at a time (and 256 bits at a time with AVX2, if the
+ * cpu has it, when skipping over long runs of set or clear bits). Bit n of the bitmap is
+ * bit (n % 8) of byte (n / 8), so on a little-endian cpu it is also bit (n % 64) of the
+ * 64-bit word at byte offset 8 * (n / 64). Word loads never touch bytes at or beyond
+ * mu_bitmap_size(nbits), so bitmaps need no padding.
+ */
+
+/**
+ * mu_bitmap_word()
+ *
+ * Load 64-bit word @w of the bitmap. Bits at or beyond @nbits are returned as zero
+ * (though bits beyond @nbits in the last byte are returned as-is).
+ */
+static inline u64
+mu_bitmap_word(const u8 *bitmap, u64 nbits, u64 w)
+{
+	u64 first = w * 64;
+	u64 val = 0;
+
+	if (first + 64 <= nbits)
+		memcpy(&val, &bitmap[w * 8], sizeof(val));
+	else if (first < nbits)
+		memcpy(&val, &bitmap[w * 8], (nbits - first + 7) / 8);
+
+	return val;
+}
+
+#if defined(__x86_64__)
+/**
+ * mu_bitmap_skip_avx2()
+ *
+ * Starting at word @w, skip 256-bit blocks that are all ones (@want_zero) or all zeros
+ * (!@want_zero). Returns the first word of the block that stopped the scan (or the
+ * first word that is not part of a full 256-bit block).
+ */
+__attribute__((target("avx2")))
+static inline u64
+mu_bitmap_skip_avx2(const u8 *bitmap, u64 nbits, u64 w, int want_zero)
+{
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	u64 full_words = nbits / 64;
+
+	while (w + 4 <= full_words) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&bitmap[w * 8]);
+
+		if (want_zero ? !_mm256_testc_si256(v, ones) : !_mm256_testz_si256(v, v))
+			break;
+		w += 4;
+	}
+	return w;
+}
+
+static inline int
+mu_bitmap_have_avx2(void)
+{
+	static int have_avx2 = -1;
+
+	if (have_avx2 < 0)
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return have_avx2;
+}
+#else
+static inline u64
+mu_bitmap_skip_avx2(const u8 *bitmap, u64 nbits, u64 w, int want_zero)
+{
+	return w;
+}
+
+static inline int
+mu_bitmap_have_avx2(void)
+{
+	return 0;
+}
+#endif
+
+/**
+ * __mu_bitmap_find_next()
+ *
+ * Find the first bit at or after @start that is clear (@want_zero) or set (!@want_zero)
+ *
+ * @use_simd - allow the AVX2 path (callers normally pass mu_bitmap_have_avx2())
+ *
+ * Return value: the bit index, or @nbits if there is no such bit
+ */
+static inline u64
+__mu_bitmap_find_next(
+	const u8 *bitmap,
+	u64       nbits,
+	u64       start,
+	int       want_zero,
+	int       use_simd)
+{
+	u64 w = start / 64;
+	u64 val;
+
+	if (start >= nbits)
+		return nbits;
+
+	val = mu_bitmap_word(bitmap, nbits, w);
+	if (want_zero)
+		val = ~val;
+	val &= ~0ULL << (start % 64);
+
+	while (!val) {
+		w++;
+		if (w * 64 >= nbits)
+			return nbits;
+		if (use_simd && !(w % 4))
+			w = mu_bitmap_skip_avx2(bitmap, nbits, w, want_zero);
+
+		val = mu_bitmap_word(bitmap, nbits, w);
+		if (want_zero)
+			val = ~val;
+	}
+	return MIN(w * 64 + __builtin_ctzll(val), nbits);
+}
+
+/**
+ * mu_bitmap_find_next_zero()
+ *
+ * Return value: index of the first clear bit at or after @start, or @nbits if none
+ */
+static inline u64
+mu_bitmap_find_next_zero(const u8 *bitmap, u64 nbits, u64 start)
+{
+	return __mu_bitmap_find_next(bitmap, nbits, start, 1, mu_bitmap_have_avx2());
+}
+
+/**
+ * mu_bitmap_find_first_zero()
+ *
+ * Return value: index of the first clear bit, or @nbits if none
+ */
+static inline u64
+mu_bitmap_find_first_zero(const u8 *bitmap, u64 nbits)
+{
+	return mu_bitmap_find_next_zero(bitmap, nbits, 0);
+}
+
+/**
+ * mu_bitmap_find_next_set()
+ *
+ * Return value: index of the first set bit at or after @start, or @nbits if none
+ */
+static inline u64
+mu_bitmap_find_next_set(const u8 *bitmap, u64 nbits, u64 start)
+{
+	return __mu_bitmap_find_next(bitmap, nbits, start, 0, mu_bitmap_have_avx2());
+}
+
+/**
+ * __mu_bitmap_find_zero_run()
+ *
+ * Find the first run of at least @len clear bits that starts at or after @start.
+ * Runs that span words are tracked by carrying the length of the clear run at the top of
+ * each word into the next; runs of up to 64 bits within a word are found with a
+ * shift-and reduction (bit b survives iff bits b..b+@len-1 are all clear).
+ *
+ * @use_simd - allow the AVX2 path (callers normally pass mu_bitmap_have_avx2())
+ *
+ * Return value: index of the first bit of the run, or -1 if there is no such run
+ */
+static inline s64
+__mu_bitmap_find_zero_run(
+	const u8 *bitmap,
+	u64       nbits,
+	u64       start,
+	u64       len,
+	int       use_simd)
+{
+	u64 run = 0; /* clear bits at the top of the previous word */
+	u64 w;
+
+	if (!len || start >= nbits || (nbits - start) < len)
+		return -1;
+
+	for (w = start / 64; w * 64 < nbits; w++) {
+		u64 val;
+
+		if (use_simd && !run && !(w % 4)) {
+			w = mu_bitmap_skip_avx2(bitmap, nbits, w, 1);
+			if (w * 64 >= nbits)
+				break;
+		}
+
+		val = mu_bitmap_word(bitmap, nbits, w);
+		if (w == start / 64)
+			val |= (1ULL << (start % 64)) - 1; /* bits before @start don't count */
+		if (nbits - w * 64 < 64)
+			val |= ~0ULL << (nbits - w * 64);  /* nor do bits beyond @nbits */
+
+		if (run) {
+			u64 lead = (val) ? __builtin_ctzll(val) : 64;
+
+			if (run + lead >= len)
+				return w * 64 - run;
+			if (!val) {
+				run += 64;
+				continue;
+			}
+		}
+
+		if (len <= 64) {
+			u64 m = ~val;
+			u64 cur = 1;
+
+			while (cur < len) {
+				u64 sh = MIN(cur, len - cur);
+
+				m &= m >> sh;
+				cur += sh;
+			}
+			if (m)
+				return w * 64 + __builtin_ctzll(m);
+		}
+		run = (val) ? __builtin_clzll(val) : 64;
+	}
+	return -1;
+}
+
+/**
+ * mu_bitmap_find_zero_run()
+ *
+ * Return value: index of the first bit of the first run of at least @len clear bits
+ * at or after @start, or -1 if there is no such run
+ */
+static inline s64
+mu_bitmap_find_zero_run(const u8 *bitmap, u64 nbits, u64 start, u64 len)
+{
+	return __mu_bitmap_find_zero_run(bitmap, nbits, start, len, mu_bitmap_have_avx2());
+}
+
+/**
+ * mu_bitmap_set_range()
+ *
+ * Set bits [@start, @start + @len)
+ */
+static inline void
+mu_bitmap_set_range(u8 *bitmap, u64 start, u64 len)
+{
+	u64 end = start + len;
+	u64 first_byte, last_byte;
+
+	if (!len)
+		return;
+
+	first_byte = (start + 7) / 8;
+	last_byte = end / 8;
+	if (first_byte >= last_byte) {
+		/* Range doesn't cover a whole byte */
+		for (; start < end; start++)
+			mu_bitmap_set(bitmap, start);
+		return;
+	}
+
+	for (; start < first_byte * 8; start++)
+		mu_bitmap_set(bitmap, start);
+	memset(&bitmap[first_byte], 0xff, last_byte - first_byte);
+	for (start = last_byte * 8; start < end; start++)
+		mu_bitmap_set(bitmap, start);
+}
+
+/**
+ * mu_bitmap_test_and_set_range()
+ *
+ * Set bits [@start, @start + @len), counting the bits that were already set
+ *
+ * Return value: the number of bits in the range that were already set (collisions)
+ */
+static inline u64
+mu_bitmap_test_and_set_range(u8 *bitmap, u64 start, u64 len)
+{
+	u64 end = start + len;
+	u64 collisions = 0;
+	u64 val;
+
+	/* Leading bits up to a byte boundary */
+	for (; start < end && (start % 8); start++)
+		collisions += !mu_bitmap_test_and_set(bitmap, start);
+
+	/* 64 bits per step */
+	for (; start + 64 <= end; start += 64) {
+		memcpy(&val, &bitmap[start / 8], sizeof(val));
+		collisions += __builtin_popcountll(val);
+		memset(&bitmap[start / 8], 0xff, sizeof(val));
+	}
+
+	/* Trailing bits */
+	for (; start < end; start++)
+		collisions += !mu_bitmap_test_and_set(bitmap, start);
+
+	return collisions;
+}
+
 #endif
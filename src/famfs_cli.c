@@ -72,6 +72,11 @@ famfs_logplay_usage(int   argc,
 	       "    -m|--mmap   - Get the log via mmap\n"
 	       "    -c|--client - force \"client mode\" (all files read-only)\n"
 	       "    -n|--dryrun - Process the log but don't instantiate the files & directories\n"
+	       "    -f|--full   - Replay the whole log, ignoring this node's logplay cursor\n"
+	       "                  (by default only entries added since the last logplay on\n"
+	       "                  this mount are played)\n"
+	       "    -j|--threads <n> - Create directories first, then create files with\n"
+	       "                  <n> threads (sharded by parent directory)\n"
 	       "\n"
 	       "\n",
 	       progname);
@@ -87,6 +92,8 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	int use_mmap = 0;
 	int use_read = 0;
 	int client_mode = 0;
+	int use_cursor = 1;
+	int nthreads = 0;
 	int verbose = 0;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -96,6 +103,8 @@ do_famfs_cli_logplay(int argc, char *argv[])
 		{"mmap",      no_argument,             0,  'm'},
 		{"read",      no_argument,             0,  'r'},
 		{"client",    no_argument,             0,  'c'},
+		{"full",      no_argument,             0,  'f'},
+		{"threads",   required_argument,       0,  'j'},
 		{"verbose",    no_argument,            0,  'v'},
 		{0, 0, 0, 0}
 	};
@@ -104,7 +113,7 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+vrcmnh?",
+	while ((c = getopt_long(argc, argv, "+vrcmnfj:h?",
 				logplay_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -129,6 +138,17 @@ do_famfs_cli_logplay(int argc, char *argv[])
 		case 'c':
 			client_mode++;
 			break;
+		case 'f':
+			use_cursor = 0;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -152,7 +172,8 @@ do_famfs_cli_logplay(int argc, char *argv[])
 	}
 	fspath = argv[optind++];
 
-	return famfs_logplay(fspath, use_mmap, dry_run, client_mode, verbose);
+	return famfs_logplay(fspath, use_mmap, dry_run, client_mode, use_cursor, nthreads,
+			     verbose);
 }
 
 /********************************************************************/
@@ -289,7 +310,7 @@ do_famfs_cli_mount(int argc, char *argv[])
 		goto err_out;
 	}
 
-	rc = famfs_logplay(realmpt, use_mmap, 0, 0, verbose);
+	rc = famfs_logplay(realmpt, use_mmap, 0, 0, 1, 0, verbose);
 
 err_out:
 	free(realdaxdev);
@@ -477,6 +498,35 @@ do_famfs_cli_fsck(int argc, char *argv[])
 
 /********************************************************************/
 
+static s64 get_multiplier(const char *endptr)
+{
+	size_t multiplier = 1;
+
+	if (!endptr)
+		return 1;
+
+	switch (*endptr) {
+	case 'k':
+	case 'K':
+		multiplier = 1024;
+		break;
+	case 'm':
+	case 'M':
+		multiplier = 1024 * 1024;
+		break;
+	case 'g':
+	case 'G':
+		multiplier = 1024 * 1024 * 1024;
+		break;
+	case 0:
+		return 1;
+	}
+	++endptr;
+	if (*endptr) /* If the unit was not the last char in string, it's an error */
+		return -1;
+	return multiplier;
+}
+
 void
 famfs_cp_usage(int   argc,
 	    char *argv[])
@@ -500,6 +550,14 @@ famfs_cp_usage(int   argc,
 	       "    -m|--mode=<mode> - Set mode (as in chmod) to octal value\n"
 	       "    -u|--uid=<uid>   - Specify uid (default is current user's uid)\n"
 	       "    -g|--gid=<gid>   - Specify uid (default is current user's gid)\n"
+	       "    -j|--threads <n> - Copy file data with <n> threads (default 1); large files\n"
+	       "                       are split into ranges, and many files are copied at once\n"
+	       "    --chunk <size>   - Size of the ranges that file data is copied in, with any\n"
+	       "                       number of threads (default 64M)\n"
+	       "    --direct         - Read source files with O_DIRECT (via io_uring where\n"
+	       "                       available), bypassing the page cache\n"
+	       "    --nt             - Write file data with non-temporal (streaming) stores,\n"
+	       "                       which bypass the cache and need no flush afterward\n"
 	       "    -v|verbose       - print debugging output while executing the command\n"
 	       "\n"
 	       "NOTE 1: 'famfs cp' will never overwrite an existing file, which is a side-effect\n"
@@ -509,6 +567,8 @@ famfs_cp_usage(int   argc,
 	       "        If you inadvertently copy files into famfs using the standard 'cp' (or\n"
 	       "        other non-famfs tools), the files created will be invalid. Any such files\n"
 	       "        can be found using 'famfs check'.\n"
+	       "NOTE 3: holes in sparse source files are not read; the destination is\n"
+	       "        zero-filled over them (the file is always fully allocated)\n"
 	       "\n",
 	       progname, progname, progname);
 }
@@ -525,6 +585,12 @@ do_famfs_cli_cp(int argc, char *argv[])
 	gid_t gid = getgid();
 	mode_t current_umask;
 	int recursive = 0;
+	int nthreads = 1;
+	u64 chunk = 0;
+	int direct = 0;
+	int nt = 0;
+	char *endptr;
+	s64 mult;
 	int rc;
 
 	/* XXX can't use any of the same strings as the global args! */
@@ -533,6 +599,10 @@ do_famfs_cli_cp(int argc, char *argv[])
 		{"mode",        required_argument,    0,  'm'},
 		{"uid",         required_argument,             0,  'u'},
 		{"gid",         required_argument,             0,  'g'},
+		{"threads",     required_argument,    0,  'j'},
+		{"chunk",       required_argument,    0,  'C'},
+		{"direct",      no_argument,          0,  'D'},
+		{"nt",          no_argument,          0,  'N'},
 		{"verbose",     no_argument,          0,  'v'},
 		{0, 0, 0, 0}
 	};
@@ -541,7 +611,7 @@ do_famfs_cli_cp(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+rm:u:g:vh?",
+	while ((c = getopt_long(argc, argv, "+rm:u:g:j:vh?",
 				cp_options, &optind)) != EOF) {
 
 		arg_ct++;
@@ -567,6 +637,35 @@ do_famfs_cli_cp(int argc, char *argv[])
 		case 'g':
 			gid = strtol(optarg, 0, 0);
 			break;
+
+		case 'j':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'C':
+			chunk = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult > 0)
+				chunk *= mult;
+			if (chunk == 0 || mult <= 0) {
+				fprintf(stderr, "%s: invalid chunk size (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'D':
+			direct = 1;
+			break;
+
+		case 'N':
+			nt = 1;
+			break;
 		}
 	}
 
@@ -583,7 +682,8 @@ do_famfs_cli_cp(int argc, char *argv[])
 	umask(current_umask);
 	mode &= ~(current_umask);
 
-	rc = famfs_cp_multi(argc - optind, &argv[optind], mode, uid, gid, recursive, verbose);
+	rc = famfs_cp_multi(argc - optind, &argv[optind], mode, uid, gid, recursive,
+			    nthreads, chunk, direct, nt, verbose);
 	return rc;
 }
 
@@ -972,35 +1072,6 @@ famfs_creat_usage(int   argc,
 	       progname, progname, progname);
 }
 
-static s64 get_multiplier(const char *endptr)
-{
-	size_t multiplier = 1;
-
-	if (!endptr)
-		return 1;
-
-	switch (*endptr) {
-	case 'k':
-	case 'K':
-		multiplier = 1024;
-		break;
-	case 'm':
-	case 'M':
-		multiplier = 1024 * 1024;
-		break;
-	case 'g':
-	case 'G':
-		multiplier = 1024 * 1024 * 1024;
-		break;
-	case 0:
-		return 1;
-	}
-	++endptr;
-	if (*endptr) /* If the unit was not the last char in string, it's an error */
-		return -1;
-	return multiplier;
-}
-
 int
 do_famfs_cli_creat(int argc, char *argv[])
 {
@@ -1366,7 +1437,7 @@ famfs_flush_usage(int   argc,
 	char *progname = argv[0];
 
 	printf("\n"
-	       "famfs flush: Flush or invalidate the processor cache for an entire file\n"
+	       "famfs flush: Flush or invalidate the processor cache for files or file ranges\n"
 	       "\n"
 	       "This command is useful for shared memory that is not cache coherent. It should\n"
 	       "be called after mutating a file whose mutations need to be visible on other hosts,\n"
@@ -1375,29 +1446,51 @@ famfs_flush_usage(int   argc,
 	       "was mutated, this operation may be needed.\n"
 	       "\n"
 	       "    %s flush [args] <file> [<file> ...]\n"
+	       "    %s flush [args] --offset <offset> [--length <len>] <file>\n"
 	       "\n"
 	       "Arguments:\n"
 	       "    -v           - Verbose output\n"
+	       "    -r|--recursive   - Flush all files in any directories that are specified\n"
+	       "    -j|--threads <n> - Flush with <n> threads; large files are split into\n"
+	       "                       chunks, and all files share one pool of threads\n"
+	       "    -o|--offset <offset> - Flush only the range starting at <offset> of a\n"
+	       "                       single file (only the pages covering the range are mapped)\n"
+	       "    -l|--length <len>    - Length of the range (default: through end of file)\n"
+	       "    -m|--mode <mode>     - writeback: after mutating the file/range on this host\n"
+	       "                           invalidate: before reading data mutated elsewhere\n"
+	       "                           (default: both)\n"
 	       "    -?           - Print this message\n"
 	       "\nNOTE: this creates a file system error and is for testing only!!\n"
-	       "\n", progname);
+	       "\n", progname, progname);
 }
 
 int
 do_famfs_cli_flush(int argc, char *argv[])
 {
+	enum famfs_flush_mode mode = FAMFS_FLUSH_HARD;
 	char fullpath[PATH_MAX];
-	char *file = NULL;
+	char **files = NULL;
+	int use_range = 0;
+	u64 offset = 0;
+	u64 len = 0;
+	int recursive = 0;
+	int nthreads = 1;
+	int nfiles = 0;
 	int verbose = 0;
 	int arg_ct = 0;
+	char *file;
 	int errs = 0;
-	int rc;
 	int c;
 
 
 	/* XXX can't use any of the same strings as the global args! */
 	struct option flush_options[] = {
 		/* These options set a */
+		{"recursive", no_argument,             0,  'r'},
+		{"threads",   required_argument,       0,  'j'},
+		{"offset",    required_argument,       0,  'o'},
+		{"length",    required_argument,       0,  'l'},
+		{"mode",      required_argument,       0,  'm'},
 		{0, 0, 0, 0}
 	};
 
@@ -1405,8 +1498,10 @@ do_famfs_cli_flush(int argc, char *argv[])
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+vh?",
+	while ((c = getopt_long(argc, argv, "+rj:o:l:m:vh?",
 				flush_options, &optind)) != EOF) {
+		char *endptr;
+		s64 mult;
 
 		arg_ct++;
 		switch (c) {
@@ -1414,6 +1509,41 @@ do_famfs_cli_flush(int argc, char *argv[])
 		case 'v':
 			verbose++;
 			break;
+		case 'r':
+			recursive = 1;
+			break;
+		case 'j':
+			nthreads = strtol(optarg, 0, 0);
+			if (nthreads < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+		case 'o':
+			offset = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult > 0)
+				offset *= mult;
+			use_range = 1;
+			break;
+		case 'l':
+			len = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult > 0)
+				len *= mult;
+			use_range = 1;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "writeback")) {
+				mode = FAMFS_FLUSH_WRITEBACK;
+			} else if (!strcmp(optarg, "invalidate")) {
+				mode = FAMFS_FLUSH_INVALIDATE;
+			} else {
+				fprintf(stderr, "%s: invalid mode (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
 		case 'h':
 		case '?':
 			famfs_flush_usage(argc, argv);
@@ -1422,8 +1552,22 @@ do_famfs_cli_flush(int argc, char *argv[])
 	}
 
 	if (optind > (argc - 1)) {
-		fprintf(stderr, "%s: source and destination filenames required\n", __func__);
-		famfs_clone_usage(argc, argv);
+		fprintf(stderr, "%s: at least one file is required\n", __func__);
+		famfs_flush_usage(argc, argv);
+		return -1;
+	}
+	if (use_range) {
+		if (recursive || optind != (argc - 1)) {
+			fprintf(stderr, "%s: --offset/--length apply to exactly one file\n",
+				__func__);
+			return -1;
+		}
+		return famfs_flush_range(argv[optind], offset, len, mode);
+	}
+
+	files = calloc(argc - optind, sizeof(*files));
+	if (!files) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
 		return -1;
 	}
 	while (optind < argc) {
@@ -1433,11 +1577,11 @@ do_famfs_cli_flush(int argc, char *argv[])
 			errs++;
 			continue;
 		}
-
-		rc = famfs_flush_file(file, verbose);
-		if (rc)
-			errs++;
+		files[nfiles++] = file;
 	}
+
+	errs += famfs_flush_files(nfiles, files, recursive, mode, nthreads, verbose);
+	free(files);
 	if (errs)
 		printf("%s: %d errors were detected\n", __func__, errs);
 	return -errs;
@@ -29,6 +29,9 @@
 #include <zlib.h>
 #include <sys/file.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <linux/famfs_ioctl.h>
 
 #include "famfs_meta.h"
@@ -36,9 +39,15 @@
 #include "famfs_lib_internal.h"
 #include "bitmap.h"
 #include "mu_mem.h"
+#include "mu_crc.h"
 
 int mock_kmod = 0; /* unit tests can set this to avoid ioctl calls and whatnot */
 int mock_flush = 0; /* for unit tests to avoid actual flushing */
+int count_flush = 0; /* for unit tests to count flushing in flushed_cache_lines */
+unsigned long long flushed_cache_lines = 0;
+int mu_flush_backend = MU_FLUSH_AUTO; /* cache flush backend; see mu_mem.h */
+int mu_crc32c_force_sw = 0; /* see mu_crc.h */
+int mu_memcpy_nt_force_sse2 = 0; /* see mu_mem.h */
 int mock_role = 0; /* for unit tests to specify role rather than testing for it */
 int mock_uuid = 0; /* for unit tests to simulate uuid related errors */
 int mock_path = 0; /* for unit tests to simulate path related errors */
@@ -1190,12 +1199,6 @@ famfs_print_log_stats(const char *msg,
 		       ls->f_errs, ls->d_errs);
 }
 
-static inline int
-famfs_log_full(const struct famfs_log *logp)
-{
-	return (logp->famfs_log_next_index > logp->famfs_log_last_index);
-}
-
 static inline int
 famfs_log_entry_fc_path_is_relative(const struct famfs_file_creation *fc)
 {
@@ -1248,249 +1251,731 @@ famfs_validate_log_entry(const struct famfs_log_entry *le, u64 index)
 	return errors;
 }
 
-/**
- * __famfs_logplay()
+/*
+ * Logplay cursor
  *
- * Inner function to play the log for a famfs file system
+ * Each node keeps a cursor (on local storage, not in the shared log) recording how far
+ * it has played the log for the current mount of a file system. An incremental logplay
+ * starts at the cursor rather than at index 0, which avoids a stat() and realpath()
+ * for every entry that has already been applied.
  *
- * @logp        - pointer to a read-only copy or mmap of the log
- * @mpt         - mount point path
- * @dry_run     - process the log but don't create the files & directories
- * @client_mode - for testing; play the log as if this is a client node, even on master
+ * The cursor is only trusted if the file system uuid, the mount instance (identified
+ * by the .meta directory), the log header crc, and the last applied entry (seqnum and
+ * crc) all still match. Otherwise we fall back to a full replay.
+ */
+
+static unsigned long
+famfs_gen_logplay_cursor_crc(const struct famfs_logplay_cursor *lc)
+{
+	unsigned long crc = crc32(0L, Z_NULL, 0);
+
+	crc = crc32(crc, (const unsigned char *)lc, offsetof(struct famfs_logplay_cursor, lc_crc));
+	return crc;
+}
+
+static void
+famfs_logplay_cursor_path(const uuid_le *fs_uuid, char *path_out)
+{
+	uuid_t local_uuid;
+	char uuid_str[37];
+
+	memcpy(&local_uuid, fs_uuid, sizeof(local_uuid));
+	uuid_unparse(local_uuid, uuid_str);
+	snprintf(path_out, PATH_MAX - 1, "%s/logplay-%s.cursor",
+		 FAMFS_LOCAL_STATE_DIR, uuid_str);
+}
+
+/**
+ * famfs_logplay_cursor_init()
  *
- * Returns value: Number of errors detected (0=complete success)
+ * Fill in the fields of a cursor that identify the file system and mount instance.
+ * The position fields are left for the caller.
  */
-int
-__famfs_logplay(
-	const struct famfs_log *logp,
-	const char             *mpt,
-	int                     dry_run,
-	int                     client_mode,
-	int                     verbose)
+static int
+famfs_logplay_cursor_init(
+	struct famfs_logplay_cursor   *lc,
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	const char                    *mpt)
 {
-	struct famfs_log_stats ls = { 0 };
-	enum famfs_system_role role;
-	struct famfs_superblock *sb;
-	u64 i, j;
-	int rc;
+	char metadir[PATH_MAX];
+	struct stat st;
 
-	sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
-	if (!sb)
+	snprintf(metadir, PATH_MAX - 1, "%s/.meta", mpt);
+	if (stat(metadir, &st))
 		return -1;
 
-	if (famfs_check_super(sb)) {
-		fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt);
-		return -1;
+	memset(lc, 0, sizeof(*lc));
+	lc->lc_magic           = FAMFS_LOGPLAY_CURSOR_MAGIC;
+	memcpy(&lc->lc_fs_uuid, &sb->ts_uuid, sizeof(lc->lc_fs_uuid));
+	lc->lc_meta_ino        = st.st_ino;
+	lc->lc_meta_ctime_sec  = st.st_ctim.tv_sec;
+	lc->lc_meta_ctime_nsec = st.st_ctim.tv_nsec;
+	lc->lc_log_hdr_crc     = famfs_gen_log_header_crc(logp);
+	return 0;
+}
+
+/**
+ * famfs_logplay_cursor_load()
+ *
+ * Returns the log index where an incremental logplay should start. Any mismatch
+ * between the saved cursor and the current file system, mount or log results in 0
+ * (full replay).
+ */
+static u64
+famfs_logplay_cursor_load(
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	const char                    *mpt,
+	int                            verbose)
+{
+	struct famfs_logplay_cursor expect;
+	struct famfs_logplay_cursor lc;
+	const struct famfs_log_entry *le;
+	char path[PATH_MAX];
+	ssize_t bytes;
+	int fd;
+
+	if (famfs_logplay_cursor_init(&expect, sb, logp, mpt))
+		return 0;
+
+	famfs_logplay_cursor_path(&sb->ts_uuid, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0; /* No cursor yet */
+
+	bytes = read(fd, &lc, sizeof(lc));
+	close(fd);
+	if (bytes != sizeof(lc)) {
+		fprintf(stderr, "%s: short cursor file %s; full replay\n", __func__, path);
+		return 0;
 	}
 
-	role = (client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
+	if (lc.lc_magic != FAMFS_LOGPLAY_CURSOR_MAGIC ||
+	    lc.lc_crc != famfs_gen_logplay_cursor_crc(&lc)) {
+		fprintf(stderr, "%s: invalid cursor file %s; full replay\n", __func__, path);
+		return 0;
+	}
 
-	if (famfs_validate_log_header(logp)) {
-		fprintf(stderr, "%s: invalid log header\n", __func__);
-		return -1;
+	if (memcmp(&lc.lc_fs_uuid, &expect.lc_fs_uuid, sizeof(lc.lc_fs_uuid)) ||
+	    lc.lc_meta_ino        != expect.lc_meta_ino ||
+	    lc.lc_meta_ctime_sec  != expect.lc_meta_ctime_sec ||
+	    lc.lc_meta_ctime_nsec != expect.lc_meta_ctime_nsec) {
+		if (verbose)
+			printf("%s: cursor is from a different mount; full replay\n", __func__);
+		return 0;
 	}
 
-	if (verbose)
-		printf("famfs logplay: log contains %lld entries\n", logp->famfs_log_next_index);
+	if (lc.lc_log_hdr_crc != expect.lc_log_hdr_crc) {
+		if (verbose)
+			printf("%s: log header changed; full replay\n", __func__);
+		return 0;
+	}
 
-	for (i = 0; i < logp->famfs_log_next_index; i++) {
-		struct famfs_log_entry le = logp->entries[i];
+	if (lc.lc_next_index == 0 || lc.lc_next_index > logp->famfs_log_next_index) {
+		if (verbose)
+			printf("%s: cursor index %lld beyond log (%lld); full replay\n",
+			       __func__, lc.lc_next_index, logp->famfs_log_next_index);
+		return 0;
+	}
 
-		if (famfs_validate_log_entry(&le, i)) {
-			fprintf(stderr, "%s: invalid log entry at index %lld\n", __func__, i);
-			return -1;
-		}
-		ls.n_entries++;
+	/* The last entry we applied must still be in the same place */
+	le = &logp->entries[lc.lc_next_index - 1];
+	if (le->famfs_log_entry_seqnum != lc.lc_last_seqnum ||
+	    le->famfs_log_entry_crc != lc.lc_last_crc) {
+		if (verbose)
+			printf("%s: seqnum chain mismatch at index %lld; full replay\n",
+			       __func__, lc.lc_next_index - 1);
+		return 0;
+	}
 
-		switch (le.famfs_log_entry_type) {
-		case FAMFS_LOG_FILE: {
-			const struct famfs_file_creation *fc = &le.famfs_fc;
-			struct famfs_simple_extent *el;
-			char fullpath[PATH_MAX];
-			char rpath[PATH_MAX];
-			struct stat st;
-			int skip_file = 0;
-			int fd;
-
-			ls.f_logged++;
-			if (verbose > 1)
-				printf("%s: %lld file=%s size=%lld\n", __func__, i,
-				       fc->famfs_relpath, fc->famfs_fc_size);
+	return lc.lc_next_index;
+}
 
-			if (!famfs_log_entry_fc_path_is_relative(fc) || mock_path) {
-				fprintf(stderr,
-					"%s: ignoring log entry; path is not relative\n",
-					__func__);
-				ls.f_errs++;
-				skip_file++;
-			}
+/**
+ * famfs_logplay_cursor_save()
+ *
+ * Record that entries [0, @next_index) have been played. The cursor file is replaced
+ * via rename, so a concurrent reader sees either the old or the new cursor.
+ */
+static int
+famfs_logplay_cursor_save(
+	const struct famfs_superblock *sb,
+	const struct famfs_log        *logp,
+	const char                    *mpt,
+	u64                            next_index)
+{
+	struct famfs_logplay_cursor lc;
+	char tmppath[PATH_MAX + 8];
+	char path[PATH_MAX];
+	ssize_t bytes;
+	int fd;
 
-			/* The only file that should have an extent with offset 0
-			 * is the superblock, which is not in the log. Check for files with
-			 * null offset...
-			 */
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
+	if (next_index == 0)
+		return 0;
 
-				if (se->famfs_extent_offset == 0 || mock_path) {
-					fprintf(stderr,
-						"%s: ERROR file %s has extent with 0 offset\n",
-						__func__, fc->famfs_relpath);
-					ls.f_errs++;
-					skip_file++;
-				}
-			}
+	if (famfs_logplay_cursor_init(&lc, sb, logp, mpt))
+		return -1;
 
-			if (skip_file)
-				continue;
+	lc.lc_next_index  = next_index;
+	lc.lc_last_seqnum = logp->entries[next_index - 1].famfs_log_entry_seqnum;
+	lc.lc_last_crc    = logp->entries[next_index - 1].famfs_log_entry_crc;
+	lc.lc_crc         = famfs_gen_logplay_cursor_crc(&lc);
 
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, fc->famfs_relpath);
-			realpath(fullpath, rpath);
-			if (dry_run)
-				continue;
+	mkdir(FAMFS_LOCAL_STATE_DIR, 0755);
+	famfs_logplay_cursor_path(&sb->ts_uuid, path);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
 
-			rc = stat(rpath, &st);
-			if (!rc) {
-				if (verbose > 1)
-					fprintf(stderr, "famfs logplay: File %s exists\n",
-						rpath);
-				ls.f_existed++;
-				continue;
-			}
-			if (verbose) {
-				printf("famfs logplay: creating file %s", fc->famfs_relpath);
-				if (verbose > 1)
-					printf(" mode %o", fc->fc_mode);
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: unable to create cursor file %s (errno %d)\n",
+			__func__, tmppath, errno);
+		return -1;
+	}
+	bytes = write(fd, &lc, sizeof(lc));
+	close(fd);
+	if (bytes != sizeof(lc)) {
+		fprintf(stderr, "%s: failed to write cursor file %s\n", __func__, tmppath);
+		unlink(tmppath);
+		return -1;
+	}
+	if (rename(tmppath, path)) {
+		fprintf(stderr, "%s: failed to rename cursor file %s\n", __func__, tmppath);
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
 
-				printf("\n");
-			}
+/**
+ * famfs_logplay_cursor_start()
+ *
+ * Exported for unit tests: the index where an incremental logplay would start
+ */
+s64
+famfs_logplay_cursor_start(
+	const struct famfs_log *logp,
+	const char             *mpt,
+	int                     verbose)
+{
+	struct famfs_superblock *sb;
+	u64 start;
 
-			fd = famfs_file_create(rpath, fc->fc_mode, fc->fc_uid, fc->fc_gid,
-					       (role == FAMFS_CLIENT) ? 1 : 0);
-			if (fd < 0) {
-				fprintf(stderr,
-					"%s: unable to create destfile (%s)\n",
-					__func__, fc->famfs_relpath);
+	sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
+	if (!sb)
+		return -1;
 
-				unlink(rpath);
-				ls.f_errs++;
-				continue;
-			}
+	start = famfs_logplay_cursor_load(sb, logp, mpt, verbose);
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	return start;
+}
 
-			/* Build extent list of famfs_simple_extent; the log entry has a
-			 * different kind of extent list...
-			 */
-			el = calloc(fc->famfs_nextents, sizeof(*el));
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				const struct famfs_log_extent *tle = &fc->famfs_ext_list[j];
+/**
+ * famfs_logplay_file()
+ *
+ * Play a single FAMFS_LOG_FILE entry. Stats are accumulated in @ls.
+ * This is called from logplay worker threads, so it must only touch @ls and the
+ * file system.
+ */
+static void
+famfs_logplay_file(
+	const struct famfs_log_entry *le,
+	u64                           i,
+	const char                   *mpt,
+	enum famfs_system_role        role,
+	int                           dry_run,
+	int                           verbose,
+	struct famfs_log_stats       *ls)
+{
+	const struct famfs_file_creation *fc = &le->famfs_fc;
+	struct famfs_simple_extent *el;
+	char fullpath[PATH_MAX];
+	char rpath[PATH_MAX];
+	struct stat st;
+	int skip_file = 0;
+	u64 j;
+	int rc;
+	int fd;
 
-				el[j].famfs_extent_offset = tle[j].se.famfs_extent_offset;
-				el[j].famfs_extent_len    = tle[j].se.famfs_extent_len;
-			}
-			famfs_file_map_create(rpath, fd, fc->famfs_fc_size,
-					      fc->famfs_nextents, el, FAMFS_REG);
-			close(fd);
-			free(el);
-			ls.f_created++;
-			break;
+	ls->f_logged++;
+	if (verbose > 1)
+		printf("%s: %lld file=%s size=%lld\n", __func__, i,
+		       fc->famfs_relpath, fc->famfs_fc_size);
+
+	if (!famfs_log_entry_fc_path_is_relative(fc) || mock_path) {
+		fprintf(stderr,
+			"%s: ignoring log entry; path is not relative\n",
+			__func__);
+		ls->f_errs++;
+		skip_file++;
+	}
+
+	/* The only file that should have an extent with offset 0
+	 * is the superblock, which is not in the log. Check for files with
+	 * null offset...
+	 */
+	for (j = 0; j < fc->famfs_nextents; j++) {
+		const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
+
+		if (se->famfs_extent_offset == 0 || mock_path) {
+			fprintf(stderr,
+				"%s: ERROR file %s has extent with 0 offset\n",
+				__func__, fc->famfs_relpath);
+			ls->f_errs++;
+			skip_file++;
 		}
-		case FAMFS_LOG_MKDIR: {
-			const struct famfs_mkdir *md = &le.famfs_md;
-			char fullpath[PATH_MAX];
-			char rpath[PATH_MAX];
-			int skip_dir = 0;
-			struct stat st;
+	}
 
-			ls.d_logged++;
+	if (skip_file)
+		return;
 
-			if (!famfs_log_entry_md_path_is_relative(md) || mock_path) {
-				fprintf(stderr,
-					"%s: ignoring log mkdir entry; path is not relative\n",
-					__func__);
-				ls.d_errs++;
-				skip_dir++;
-			}
+	snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, fc->famfs_relpath);
+	realpath(fullpath, rpath);
+	if (dry_run)
+		return;
 
-			if (skip_dir)
-				continue;
+	rc = stat(rpath, &st);
+	if (!rc) {
+		if (verbose > 1)
+			fprintf(stderr, "famfs logplay: File %s exists\n",
+				rpath);
+		ls->f_existed++;
+		return;
+	}
+	if (verbose) {
+		printf("famfs logplay: creating file %s", fc->famfs_relpath);
+		if (verbose > 1)
+			printf(" mode %o", fc->fc_mode);
 
-			if (verbose)
-				printf("%s mkdir: %o %d:%d: %s \n", __func__,
-				       md->fc_mode, md->fc_uid, md->fc_gid, md->famfs_relpath);
+		printf("\n");
+	}
 
-			snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, md->famfs_relpath);
-			realpath(fullpath, rpath);
-			if (dry_run)
-				continue;
+	fd = famfs_file_create(rpath, fc->fc_mode, fc->fc_uid, fc->fc_gid,
+			       (role == FAMFS_CLIENT) ? 1 : 0);
+	if (fd < 0) {
+		fprintf(stderr,
+			"%s: unable to create destfile (%s)\n",
+			__func__, fc->famfs_relpath);
 
-			rc = stat(rpath, &st);
-			if (!rc) {
-				switch (st.st_mode & S_IFMT) {
-				case S_IFDIR:
-					/* This is normal for log replay */
-					if (verbose > 1) {
-						fprintf(stderr,
-							"famfs logplay: directory %s exists\n",
-							rpath);
-						ls.d_existed++;
-					}
-					break;
+		unlink(rpath);
+		ls->f_errs++;
+		return;
+	}
 
-				case S_IFREG:
-					fprintf(stderr,
-						"%s: file (%s) exists where dir should be\n",
-						__func__, rpath);
-					ls.d_errs++;
-					break;
+	/* Build extent list of famfs_simple_extent; the log entry has a
+	 * different kind of extent list...
+	 */
+	el = calloc(fc->famfs_nextents, sizeof(*el));
+	for (j = 0; j < fc->famfs_nextents; j++) {
+		const struct famfs_log_extent *tle = &fc->famfs_ext_list[j];
 
-				default:
-					fprintf(stderr,
-						"%s: something (%s) exists where dir should be\n",
-						__func__, rpath);
-					ls.d_errs++;
-					break;
-				}
-				continue;
-			}
+		el[j].famfs_extent_offset = tle[j].se.famfs_extent_offset;
+		el[j].famfs_extent_len    = tle[j].se.famfs_extent_len;
+	}
+	famfs_file_map_create(rpath, fd, fc->famfs_fc_size,
+			      fc->famfs_nextents, el, FAMFS_REG);
+	close(fd);
+	free(el);
+	ls->f_created++;
+}
 
-			if (verbose)
-				printf("famfs logplay: creating directory %s\n", md->famfs_relpath);
+/**
+ * famfs_logplay_mkdir()
+ *
+ * Play a single FAMFS_LOG_MKDIR entry. Stats are accumulated in @ls.
+ */
+static void
+famfs_logplay_mkdir(
+	const struct famfs_log_entry *le,
+	const char                   *mpt,
+	int                           dry_run,
+	int                           verbose,
+	struct famfs_log_stats       *ls)
+{
+	const struct famfs_mkdir *md = &le->famfs_md;
+	char fullpath[PATH_MAX];
+	char rpath[PATH_MAX];
+	struct stat st;
+	int rc;
 
-			rc = famfs_dir_create(mpt, (char *)md->famfs_relpath, md->fc_mode,
-					      md->fc_uid, md->fc_gid);
-			if (rc) {
+	ls->d_logged++;
+
+	if (!famfs_log_entry_md_path_is_relative(md) || mock_path) {
+		fprintf(stderr,
+			"%s: ignoring log mkdir entry; path is not relative\n",
+			__func__);
+		ls->d_errs++;
+		return;
+	}
+
+	if (verbose)
+		printf("%s mkdir: %o %d:%d: %s \n", __func__,
+		       md->fc_mode, md->fc_uid, md->fc_gid, md->famfs_relpath);
+
+	snprintf(fullpath, PATH_MAX - 1, "%s/%s", mpt, md->famfs_relpath);
+	realpath(fullpath, rpath);
+	if (dry_run)
+		return;
+
+	rc = stat(rpath, &st);
+	if (!rc) {
+		switch (st.st_mode & S_IFMT) {
+		case S_IFDIR:
+			/* This is normal for log replay */
+			if (verbose > 1) {
 				fprintf(stderr,
-					"%s: error: unable to create directory (%s)\n",
-					__func__, md->famfs_relpath);
-				ls.d_errs++;
-				continue;
+					"famfs logplay: directory %s exists\n",
+					rpath);
+				ls->d_existed++;
 			}
+			break;
 
-			ls.d_created++;
+		case S_IFREG:
+			fprintf(stderr,
+				"%s: file (%s) exists where dir should be\n",
+				__func__, rpath);
+			ls->d_errs++;
 			break;
-		}
-		case FAMFS_LOG_ACCESS:
+
 		default:
-			if (verbose)
-				printf("%s: invalid log entry\n", __func__);
+			fprintf(stderr,
+				"%s: something (%s) exists where dir should be\n",
+				__func__, rpath);
+			ls->d_errs++;
 			break;
 		}
+		return;
 	}
-	famfs_print_log_stats("famfs_logplay", &ls, verbose);
 
-	return (ls.f_errs + ls.d_errs);
+	if (verbose)
+		printf("famfs logplay: creating directory %s\n", md->famfs_relpath);
+
+	rc = famfs_dir_create(mpt, (char *)md->famfs_relpath, md->fc_mode,
+			      md->fc_uid, md->fc_gid);
+	if (rc) {
+		fprintf(stderr,
+			"%s: error: unable to create directory (%s)\n",
+			__func__, md->famfs_relpath);
+		ls->d_errs++;
+		return;
+	}
+
+	ls->d_created++;
+}
+
+static void
+famfs_log_stats_add(struct famfs_log_stats *sum, const struct famfs_log_stats *ls)
+{
+	sum->n_entries += ls->n_entries;
+	sum->f_logged  += ls->f_logged;
+	sum->f_existed += ls->f_existed;
+	sum->f_created += ls->f_created;
+	sum->f_errs    += ls->f_errs;
+	sum->d_logged  += ls->d_logged;
+	sum->d_existed += ls->d_existed;
+	sum->d_created += ls->d_created;
+	sum->d_errs    += ls->d_errs;
 }
 
 /**
- * famfs_logplay()
- *
- * Outer function to play the log for a famfs file system
+ * famfs_logplay_parent_shard()
  *
- * @fspath      - mount point, or any path within the famfs file system
- * @use_mmap    - Use mmap rather than reading the log into a buffer
- * @dry_run     - process the log but don't create the files & directories
- * @client_mode - for testing; play the log as if this is a client node, even on master
- * @verbose
+ * Map a file's parent directory to a logplay shard. All files in the same directory
+ * land in the same shard, so workers don't contend on a directory's inode lock.
+ */
+static u32
+famfs_logplay_parent_shard(const struct famfs_file_creation *fc, int nshards)
+{
+	const char *relpath = (const char *)fc->famfs_relpath;
+	const char *slash;
+	u32 hash = 2166136261u; /* FNV-1a */
+	size_t len, k;
+
+	len = strnlen(relpath, FAMFS_MAX_PATHLEN);
+	slash = memrchr(relpath, '/', len);
+	len = (slash) ? (size_t)(slash - relpath) : 0;
+
+	for (k = 0; k < len; k++) {
+		hash ^= (u8)relpath[k];
+		hash *= 16777619u;
+	}
+	return hash % nshards;
+}
+
+struct famfs_logplay_shard {
+	pthread_t               thread;
+	int                     threaded;
+	const struct famfs_log *logp;
+	const char             *mpt;
+	enum famfs_system_role  role;
+	int                     dry_run;
+	int                     verbose;
+	const u64              *index;  /* log indices of the files in this shard */
+	u64                     nfiles;
+	struct famfs_log_stats  ls;
+};
+
+static void *
+famfs_logplay_shard_worker(void *arg)
+{
+	struct famfs_logplay_shard *shard = arg;
+	u64 k;
+
+	for (k = 0; k < shard->nfiles; k++) {
+		u64 i = shard->index[k];
+
+		famfs_logplay_file(&shard->logp->entries[i], i, shard->mpt, shard->role,
+				   shard->dry_run, shard->verbose, &shard->ls);
+	}
+	return NULL;
+}
+
+/**
+ * famfs_logplay_parallel()
+ *
+ * Play log entries [@start, @end) with @nthreads workers. All valid MKDIR entries are
+ * played first (in log order) by the calling thread, so the directory tree exists before
+ * any file is created; file creations are then sharded by parent directory and played
+ * (in log order within each shard) by the workers.
+ *
+ * Returns 0, or -1 if an invalid log entry is found (in which case no files are created)
+ */
+static int
+famfs_logplay_parallel(
+	const struct famfs_log *logp,
+	u64                     start,
+	u64                     end,
+	const char             *mpt,
+	enum famfs_system_role  role,
+	int                     dry_run,
+	int                     nthreads,
+	int                     verbose,
+	struct famfs_log_stats *ls)
+{
+	struct famfs_logplay_shard *shards = NULL;
+	u32 *file_shard = NULL;
+	u64 *shard_base = NULL;
+	u64 *index = NULL;
+	u64 nfiles = 0;
+	int rc = -1;
+	u64 i;
+	int t;
+
+	file_shard = calloc(end - start, sizeof(*file_shard));
+	shard_base = calloc(nthreads + 1, sizeof(*shard_base));
+	shards = calloc(nthreads, sizeof(*shards));
+	if (!file_shard || !shard_base || !shards) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		goto out;
+	}
+
+	/* Pass 1: validate everything, build the directory tree, and bin the files */
+	for (i = start; i < end; i++) {
+		const struct famfs_log_entry *le = &logp->entries[i];
+
+		file_shard[i - start] = UINT_MAX;
+		if (famfs_validate_log_entry(le, i)) {
+			fprintf(stderr, "%s: invalid log entry at index %lld\n", __func__, i);
+			goto out;
+		}
+		ls->n_entries++;
+
+		switch (le->famfs_log_entry_type) {
+		case FAMFS_LOG_FILE:
+			file_shard[i - start] = famfs_logplay_parent_shard(&le->famfs_fc,
+									   nthreads);
+			shard_base[file_shard[i - start] + 1]++;
+			nfiles++;
+			break;
+		case FAMFS_LOG_MKDIR:
+			famfs_logplay_mkdir(le, mpt, dry_run, verbose, ls);
+			break;
+		case FAMFS_LOG_ACCESS:
+		default:
+			if (verbose)
+				printf("%s: invalid log entry\n", __func__);
+			break;
+		}
+	}
+
+	if (nfiles == 0) {
+		rc = 0;
+		goto out;
+	}
+
+	/* Counting sort of the file entries by shard, preserving log order within a shard */
+	index = calloc(nfiles, sizeof(*index));
+	if (!index) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		goto out;
+	}
+	for (t = 0; t < nthreads; t++)
+		shard_base[t + 1] += shard_base[t];
+	for (t = 0; t < nthreads; t++) {
+		shards[t].index = &index[shard_base[t]];
+		shards[t].nfiles = 0;
+	}
+	for (i = start; i < end; i++) {
+		u32 s = file_shard[i - start];
+
+		if (s == UINT_MAX)
+			continue;
+		index[shard_base[s] + shards[s].nfiles++] = i;
+	}
+
+	/* Pass 2: file creations */
+	for (t = 0; t < nthreads; t++) {
+		shards[t].logp    = logp;
+		shards[t].mpt     = mpt;
+		shards[t].role    = role;
+		shards[t].dry_run = dry_run;
+		shards[t].verbose = verbose;
+		if (!shards[t].nfiles)
+			continue;
+
+		if (pthread_create(&shards[t].thread, NULL,
+				   famfs_logplay_shard_worker, &shards[t]) == 0)
+			shards[t].threaded = 1;
+		else
+			fprintf(stderr, "%s: pthread_create failed; playing shard %d inline\n",
+				__func__, t);
+	}
+	for (t = 0; t < nthreads; t++) {
+		if (shards[t].threaded)
+			pthread_join(shards[t].thread, NULL);
+		else if (shards[t].nfiles)
+			famfs_logplay_shard_worker(&shards[t]);
+
+		famfs_log_stats_add(ls, &shards[t].ls);
+	}
+	rc = 0;
+
+out:
+	free(index);
+	free(shards);
+	free(shard_base);
+	free(file_shard);
+	return rc;
+}
+
+/**
+ * __famfs_logplay()
+ *
+ * Inner function to play the log for a famfs file system
+ *
+ * @logp        - pointer to a read-only copy or mmap of the log
+ * @mpt         - mount point path
+ * @dry_run     - process the log but don't create the files & directories
+ * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @use_cursor  - start from this node's logplay cursor (if valid) rather than index 0,
+ *                and advance the cursor if the log is played without errors
+ * @nthreads    - if > 1, play directories first and then create files in parallel
+ *                (see famfs_logplay_parallel())
+ *
+ * Returns value: Number of errors detected (0=complete success)
+ */
+int
+__famfs_logplay(
+	const struct famfs_log *logp,
+	const char             *mpt,
+	int                     dry_run,
+	int                     client_mode,
+	int                     use_cursor,
+	int                     nthreads,
+	int                     verbose)
+{
+	struct famfs_log_stats ls = { 0 };
+	enum famfs_system_role role;
+	struct famfs_superblock *sb;
+	u64 start = 0;
+	u64 end;
+	u64 i;
+
+	sb = famfs_map_superblock_by_path(mpt, 1 /* read-only */);
+	if (!sb)
+		return -1;
+
+	if (famfs_check_super(sb)) {
+		fprintf(stderr, "%s: no valid superblock for mpt %s\n", __func__, mpt);
+		return -1;
+	}
+
+	role = (client_mode) ? FAMFS_CLIENT : famfs_get_role(sb);
+
+	if (famfs_validate_log_header(logp)) {
+		fprintf(stderr, "%s: invalid log header\n", __func__);
+		return -1;
+	}
+
+	if (use_cursor)
+		start = famfs_logplay_cursor_load(sb, logp, mpt, verbose);
+
+	/* The log may be growing under us; play the entries that were there when we started */
+	end = logp->famfs_log_next_index;
+
+	if (verbose) {
+		printf("famfs logplay: log contains %lld entries\n", end);
+		if (start)
+			printf("famfs logplay: cursor skips %lld entries already played\n",
+			       start);
+	}
+
+	if (nthreads > 1) {
+		if (famfs_logplay_parallel(logp, start, end, mpt, role, dry_run,
+					   nthreads, verbose, &ls)) {
+			munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+			return -1;
+		}
+		goto done;
+	}
+
+	for (i = start; i < end; i++) {
+		const struct famfs_log_entry *le = &logp->entries[i];
+
+		if (famfs_validate_log_entry(le, i)) {
+			fprintf(stderr, "%s: invalid log entry at index %lld\n", __func__, i);
+			return -1;
+		}
+		ls.n_entries++;
+
+		switch (le->famfs_log_entry_type) {
+		case FAMFS_LOG_FILE:
+			famfs_logplay_file(le, i, mpt, role, dry_run, verbose, &ls);
+			break;
+		case FAMFS_LOG_MKDIR:
+			famfs_logplay_mkdir(le, mpt, dry_run, verbose, &ls);
+			break;
+		case FAMFS_LOG_ACCESS:
+		default:
+			if (verbose)
+				printf("%s: invalid log entry\n", __func__);
+			break;
+		}
+	}
+
+done:
+	famfs_print_log_stats("famfs_logplay", &ls, verbose);
+
+	/* Only advance the cursor past a clean replay, so entries that failed are retried */
+	if (use_cursor && !dry_run && !(ls.f_errs + ls.d_errs))
+		famfs_logplay_cursor_save(sb, logp, mpt, end);
+
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	return (ls.f_errs + ls.d_errs);
+}
+
+/**
+ * famfs_logplay()
+ *
+ * Outer function to play the log for a famfs file system
+ *
+ * @fspath      - mount point, or any path within the famfs file system
+ * @use_mmap    - Use mmap rather than reading the log into a buffer
+ * @dry_run     - process the log but don't create the files & directories
+ * @client_mode - for testing; play the log as if this is a client node, even on master
+ * @use_cursor  - skip entries already played on this node (see famfs_logplay_cursor_load())
+ * @nthreads    - number of threads for file creation (<= 1 plays the log serially)
+ * @verbose
  */
 int
 famfs_logplay(
@@ -1498,6 +1983,8 @@ famfs_logplay(
 	int                     use_mmap,
 	int                     dry_run,
 	int                     client_mode,
+	int                     use_cursor,
+	int                     nthreads,
 	int                     verbose)
 {
 	char mpt_out[PATH_MAX];
@@ -1557,7 +2044,8 @@ famfs_logplay(
 		} while (resid > 0);
 	}
 
-	rc = __famfs_logplay(logp, mpt_out, dry_run, client_mode, verbose);
+	rc = __famfs_logplay(logp, mpt_out, dry_run, client_mode, use_cursor, nthreads,
+			     verbose);
 err_out:
 	if (use_mmap)
 		munmap(logp, FAMFS_LOG_LEN);
@@ -1572,112 +2060,353 @@ err_out:
  * Log maintenance / append
  */
 
+static void
+__famfs_log_txn_begin(struct famfs_log_txn *txn, struct famfs_log *logp, u64 reserved)
+{
+	assert(txn);
+	assert(logp);
+
+	memset(txn, 0, sizeof(*txn));
+	txn->logp         = logp;
+	txn->start_index  = logp->famfs_log_next_index;
+	txn->start_seqnum = logp->famfs_log_next_seqnum;
+	txn->reserved     = reserved;
+}
+
 /**
- * famfs_append_log()
+ * famfs_log_txn_begin()
  *
- * @logp - pointer to struct famfs_log in memory media
- * @e    - pointer to log entry in memory
+ * Start a log transaction: entries appended to @txn are staged in the log slots after
+ * the current end of the log, but are not visible to log readers until
+ * famfs_log_txn_commit() publishes all of them with a single header update.
  *
- * NOTE: this function is not re-entrant. Must hold a lock or mutex when calling this
- * function if there is any chance of re-entrancy.
+ * Like famfs_append_log(), transactions are not re-entrant; the caller must hold the
+ * log lock from begin through commit, and must not append to the log by other means
+ * in between.
+ *
+ * @txn
+ * @lp   - the locked log; the txn leaves the log slots of its reservations free
  */
-static int
-famfs_append_log(struct famfs_log       *logp,
-		 struct famfs_log_entry *e)
+void
+famfs_log_txn_begin(struct famfs_log_txn *txn, struct famfs_locked_log *lp)
 {
-	assert(logp);
-	assert(e);
+	__famfs_log_txn_begin(txn, lp->logp, lp->resv_slots);
+}
 
-	/* XXX This function is not re-entrant */
+/**
+ * famfs_log_txn_defer()
+ *
+ * Make a newly begun @txn hold its file entries in memory rather than staging them in
+ * the log. The caller may then release the log lock (after saving reservations for the
+ * entries; see famfs_reservation_save()), and commit the txn after locking the log
+ * again, at whatever the end of the log is by then. Before committing, @txn->logp must
+ * be set to the log as mapped by the new lock holder.
+ *
+ * Directory entries are published right away: other writers may create files in a new
+ * directory while the lock is released, and their entries must not precede it in the
+ * log. (An empty directory exposes no partial data.)
+ */
+void
+famfs_log_txn_defer(struct famfs_log_txn *txn)
+{
+	assert(txn->nentries == 0);
 
-	e->famfs_log_entry_seqnum = logp->famfs_log_next_seqnum;
-	e->famfs_log_entry_crc = famfs_gen_log_entry_crc(e);
+	txn->deferred = 1;
+}
 
-	memcpy(&logp->entries[logp->famfs_log_next_index], e, sizeof(*e));
+/**
+ * famfs_log_txn_discard() - drop the entries of a deferred txn without publishing them
+ */
+void
+famfs_log_txn_discard(struct famfs_log_txn *txn)
+{
+	free(txn->entries);
+	txn->entries = NULL;
+	txn->max_entries = 0;
+	txn->nentries = 0;
+}
 
-	logp->famfs_log_next_seqnum++;
-	logp->famfs_log_next_index++;
+/**
+ * famfs_log_txn_abandon() - unlink the file of held entry @i of the deferred @txn, and
+ *                           drop the entry
+ *
+ * The entry has not been published, so once the file is gone nothing refers to its
+ * space. If the file can't be unlinked, the entry is kept (to be published), so the
+ * space is never handed out again.
+ *
+ * @mpt - mount point that the entry's relpath is relative to
+ *
+ * Returns 0 if the entry was dropped
+ */
+int
+famfs_log_txn_abandon(struct famfs_log_txn *txn, const char *mpt, u64 i)
+{
+	struct famfs_log_entry *e = &txn->entries[i];
+	char path[PATH_MAX + FAMFS_MAX_PATHLEN + 2];
+	int len;
 
-	/* Could flush: 1) the log entry, 2) the log header
-	 * That would be less flushing, but would not guarantee that the entry is visible
-	 * before the log header. If the log header becomes visible first (leading to
-	 * reading a cache-incoherent log entry), the checksum on the log entry will
-	 * save us - and the logplay can be retried.
-	 *
-	 * But now we're just flushing the whole log every time...
-	 */
-	flush_processor_cache(logp, logp->famfs_log_len);
+	assert(txn->deferred && i < txn->nentries);
 
+	len = snprintf(path, sizeof(path), "%s/%.*s", mpt, FAMFS_MAX_PATHLEN,
+		       (char *)e->famfs_fc.famfs_relpath);
+	if (len < 0 || len >= (int)sizeof(path)) {
+		fprintf(stderr, "%s: path too long under %s\n", __func__, mpt);
+		return -1;
+	}
+	if (unlink(path) && errno != ENOENT) {
+		fprintf(stderr, "%s: unable to unlink %s (errno %d)\n", __func__, path, errno);
+		return -1;
+	}
+	memmove(e, e + 1, (txn->nentries - i - 1) * sizeof(*e));
+	txn->nentries--;
 	return 0;
 }
 
+/* Append @e to the in-memory entries of a deferred txn */
+static int
+famfs_log_txn_hold(struct famfs_log_txn *txn, struct famfs_log_entry *e)
+{
+	struct famfs_log *logp = txn->logp;
+
+	if (logp->famfs_log_next_index + txn->nentries + txn->reserved >
+	    logp->famfs_log_last_index) {
+		fprintf(stderr, "%s: log full (%lld slots reserved by other writers)\n",
+			__func__, txn->reserved);
+		return -ENOMEM;
+	}
+	if (txn->nentries == txn->max_entries) {
+		u64 max = (txn->max_entries) ? 2 * txn->max_entries : 64;
+		struct famfs_log_entry *entries;
+
+		entries = realloc(txn->entries, max * sizeof(*entries));
+		if (!entries)
+			return -ENOMEM;
+		txn->entries = entries;
+		txn->max_entries = max;
+	}
+	memcpy(&txn->entries[txn->nentries++], e, sizeof(*e));
+	return 0;
+}
 
 /**
- * famfs_relpath_from_fullpath()
+ * famfs_log_txn_append()
  *
- * Returns a pointer to the relpath. This pointer points within the fullpath string
+ * Stage a log entry in @txn. Entries are written contiguously into the log, in order,
+ * but are not flushed or published until commit.
  *
- * @mpt - mount point string (rationalized by realpath())
- * @fullpath
+ * Returns 0 on success, or -ENOMEM if the log (including entries already staged, and
+ * the slots of other writers' reservations) is full
  */
-static char *
-famfs_relpath_from_fullpath(
-	const char *mpt,
-	char       *fullpath)
+int
+famfs_log_txn_append(struct famfs_log_txn *txn, struct famfs_log_entry *e)
 {
-	char *relpath;
+	struct famfs_log *logp = txn->logp;
+	u64 index = txn->start_index + txn->nentries;
 
-	assert(mpt);
-	assert(fullpath);
-	assert(strlen(fullpath) >= strlen(mpt));
+	assert(e);
 
-	if (strstr(fullpath, mpt) != fullpath) {
-		/* mpt path should be a substring starting at the beginning of fullpath*/
-		fprintf(stderr, "%s: failed to get relpath from mpt=%s fullpath=%s\n",
-			__func__, mpt, fullpath);
-		return NULL;
+	if (txn->deferred && e->famfs_log_entry_type == FAMFS_LOG_MKDIR) {
+		struct famfs_log_txn now;
+		int rc;
+
+		/* Publish it now, leaving room for the held entries too */
+		__famfs_log_txn_begin(&now, logp, txn->reserved + txn->nentries);
+		rc = famfs_log_txn_append(&now, e);
+		if (!rc)
+			famfs_log_txn_commit(&now);
+		return rc;
 	}
+	if (txn->deferred)
+		return famfs_log_txn_hold(txn, e);
 
-	/* This assumes relpath() removed any duplicate '/' characters: */
-	relpath = &fullpath[strlen(mpt) + 1];
-	return relpath;
+	if (index + txn->reserved > logp->famfs_log_last_index) {
+		fprintf(stderr, "%s: log full (%lld slots reserved by other writers)\n",
+			__func__, txn->reserved);
+		return -ENOMEM;
+	}
+
+	e->famfs_log_entry_seqnum = txn->start_seqnum + txn->nentries;
+	e->famfs_log_entry_crc = famfs_gen_log_entry_crc(e);
+
+	memcpy(&logp->entries[index], e, sizeof(*e));
+	txn->nentries++;
+	return 0;
 }
 
 /**
- * famfs_log_file_creation()
+ * famfs_log_txn_commit()
  *
- * Returns 0 on success
- * On error, returns <0. (all failures here should abort multi-file operations)
- */
-/* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
- * conversion itself. Then pretty much all calls would use the same stuff.
+ * Publish the entries staged in @txn: flush them, fence so they reach memory before
+ * the header update that makes them visible to log readers, then update and flush the
+ * header. (If a reader still sees a stale entry, the checksum catches it and the
+ * logplay can be retried.)
+ *
+ * The entries of a deferred txn are first copied to the current end of the log. Their
+ * slots were reserved, so they should fit; if they don't, none of them are published
+ * and they stay in the txn, so the caller can abandon the objects they describe.
+ *
+ * Returns the number of entries committed
  */
-static int
-famfs_log_file_creation(
-	struct famfs_log           *logp,
-	u64                         nextents,
-	struct famfs_simple_extent *ext_list,
-	const char                 *relpath,
-	mode_t                      mode,
-	uid_t                       uid,
-	gid_t                       gid,
-	size_t                      size)
+u64
+famfs_log_txn_commit(struct famfs_log_txn *txn)
 {
-	struct famfs_log_entry le = {0};
+	struct famfs_log *logp = txn->logp;
+	u64 n = txn->nentries;
+	u64 i;
+
+	if (!n)
+		return 0;
+
+	if (txn->deferred) {
+		txn->start_index  = logp->famfs_log_next_index;
+		txn->start_seqnum = logp->famfs_log_next_seqnum;
+		if (txn->start_index + n - 1 > logp->famfs_log_last_index) {
+			fprintf(stderr, "%s: log full; %lld deferred entries not published\n",
+				__func__, n);
+			return 0;
+		}
+		for (i = 0; i < n; i++) {
+			struct famfs_log_entry *e = &txn->entries[i];
+
+			e->famfs_log_entry_seqnum = txn->start_seqnum + i;
+			e->famfs_log_entry_crc = famfs_gen_log_entry_crc(e);
+			memcpy(&logp->entries[txn->start_index + i], e, sizeof(*e));
+		}
+		famfs_log_txn_discard(txn);
+	}
+
+	assert(logp->famfs_log_next_index == txn->start_index);
+
+	writeback_processor_cache(&logp->entries[txn->start_index],
+				  n * sizeof(logp->entries[0]));
+	__sync_synchronize();
+
+	logp->famfs_log_next_seqnum = txn->start_seqnum + n;
+	logp->famfs_log_next_index  = txn->start_index + n;
+
+	/* The header is all in the first cache line(s) of the log */
+	writeback_processor_cache(logp, offsetof(struct famfs_log, entries));
+
+	/* Leave the txn open (and empty) at the new end of the log */
+	if (txn->deferred) {
+		__famfs_log_txn_begin(txn, logp, txn->reserved);
+		famfs_log_txn_defer(txn);
+	} else {
+		__famfs_log_txn_begin(txn, logp, txn->reserved);
+	}
+	return n;
+}
+
+/**
+ * famfs_append_log()
+ *
+ * Append and publish a single log entry
+ *
+ * @logp     - pointer to struct famfs_log in memory media
+ * @reserved - log slots reserved by deferred writers, which must be left free
+ * @e        - pointer to log entry in memory
+ *
+ * NOTE: this function is not re-entrant. Must hold a lock or mutex when calling this
+ * function if there is any chance of re-entrancy.
+ */
+static int
+famfs_append_log(struct famfs_log       *logp,
+		 u64                     reserved,
+		 struct famfs_log_entry *e)
+{
+	struct famfs_log_txn txn;
+	int rc;
+
+	assert(logp);
+	assert(e);
+
+	__famfs_log_txn_begin(&txn, logp, reserved);
+	rc = famfs_log_txn_append(&txn, e);
+	if (rc)
+		return rc;
+
+	famfs_log_txn_commit(&txn);
+	return 0;
+}
+
+/**
+ * famfs_log_entry_add()
+ *
+ * Stage @e in @lp's txn if there is one, otherwise append and publish it right away
+ */
+static inline int
+famfs_log_entry_add(
+	struct famfs_locked_log *lp,
+	struct famfs_log_entry  *e)
+{
+	if (lp->txn) {
+		assert(lp->txn->logp == lp->logp);
+		return famfs_log_txn_append(lp->txn, e);
+	}
+	return famfs_append_log(lp->logp, lp->resv_slots, e);
+}
+
+
+/**
+ * famfs_relpath_from_fullpath()
+ *
+ * Returns a pointer to the relpath. This pointer points within the fullpath string
+ *
+ * @mpt - mount point string (rationalized by realpath())
+ * @fullpath
+ */
+static char *
+famfs_relpath_from_fullpath(
+	const char *mpt,
+	char       *fullpath)
+{
+	char *relpath;
+
+	assert(mpt);
+	assert(fullpath);
+	assert(strlen(fullpath) >= strlen(mpt));
+
+	if (strstr(fullpath, mpt) != fullpath) {
+		/* mpt path should be a substring starting at the beginning of fullpath*/
+		fprintf(stderr, "%s: failed to get relpath from mpt=%s fullpath=%s\n",
+			__func__, mpt, fullpath);
+		return NULL;
+	}
+
+	/* This assumes relpath() removed any duplicate '/' characters: */
+	relpath = &fullpath[strlen(mpt) + 1];
+	return relpath;
+}
+
+/**
+ * famfs_log_file_creation()
+ *
+ * Returns 0 on success
+ * On error, returns <0. (all failures here should abort multi-file operations)
+ */
+/* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
+ * conversion itself. Then pretty much all calls would use the same stuff.
+ */
+static int
+famfs_log_file_creation(
+	struct famfs_locked_log    *lp,
+	u64                         nextents,
+	struct famfs_simple_extent *ext_list,
+	const char                 *relpath,
+	mode_t                      mode,
+	uid_t                       uid,
+	gid_t                       gid,
+	size_t                      size)
+{
+	struct famfs_log_entry le = {0};
 	struct famfs_file_creation *fc = &le.famfs_fc;
 	int i;
 
-	assert(logp);
+	assert(lp->logp);
 	assert(ext_list);
 	assert(nextents >= 1);
 	assert(relpath[0] != '/');
 
-	if (famfs_log_full(logp)) {
-		fprintf(stderr, "%s: log full\n", __func__);
-		//assert(0);
-		return -ENOMEM;
-	}
-
 	le.famfs_log_entry_type = FAMFS_LOG_FILE;
 
 	fc->famfs_fc_size = size;
@@ -1699,7 +2428,7 @@ famfs_log_file_creation(
 		ext->se.famfs_extent_len    = ext_list[i].famfs_extent_len;
 	}
 
-	return famfs_append_log(logp, &le);
+	return famfs_log_entry_add(lp, &le);
 }
 
 /**
@@ -1708,10 +2437,9 @@ famfs_log_file_creation(
 /* TODO: UI would be cleaner if this accepted a fullpath and the mpt, and did the
  * conversion itself. Then pretty much all calls would use the same stuff.
  */
-/* XXX should take famfs_locked_log struct as input */
 static int
 famfs_log_dir_creation(
-	struct famfs_log           *logp,
+	struct famfs_locked_log    *lp,
 	const char                 *relpath,
 	mode_t                      mode,
 	uid_t                       uid,
@@ -1720,15 +2448,9 @@ famfs_log_dir_creation(
 	struct famfs_log_entry le = {0};
 	struct famfs_mkdir *md = &le.famfs_md;
 
-	assert(logp);
+	assert(lp->logp);
 	assert(relpath[0] != '/');
 
-	if (famfs_log_full(logp)) {
-		fprintf(stderr, "%s: log full\n", __func__);
-		//assert(0);
-		return -ENOMEM;
-	}
-
 	le.famfs_log_entry_type = FAMFS_LOG_MKDIR;
 
 	strncpy((char *)md->famfs_relpath, relpath, FAMFS_MAX_PATHLEN - 1);
@@ -1737,7 +2459,7 @@ famfs_log_dir_creation(
 	md->fc_uid  = uid;
 	md->fc_gid  = gid;
 
-	return famfs_append_log(logp, &le);
+	return famfs_log_entry_add(lp, &le);
 }
 
 /**
@@ -2240,13 +2962,90 @@ famfs_validate_superblock_by_path(const char *path)
 static inline void
 put_sb_log_into_bitmap(u8 *bitmap)
 {
-	int i;
-
 	/* Mark superblock and log as allocated */
-	mu_bitmap_set(bitmap, 0);
+	mu_bitmap_set_range(bitmap, 0, (FAMFS_LOG_OFFSET + FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT);
+}
+
+/**
+ * famfs_bitmap_nbits()
+ *
+ * Number of allocation units (bitmap bits) on a device of @dev_size bytes
+ */
+static inline u64
+famfs_bitmap_nbits(u64 dev_size)
+{
+	return (dev_size - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT;
+}
+
+/**
+ * famfs_bitmap_apply_log()
+ *
+ * Mark the extents of log entries [@start, @end) as allocated in @bitmap. Counters are
+ * added to (not overwritten); see famfs_build_bitmap() for what they mean.
+ */
+static void
+famfs_bitmap_apply_log(const struct famfs_log   *logp,
+		       u8                       *bitmap,
+		       u64                       start,
+		       u64                       end,
+		       u64                      *errors,
+		       u64                      *fsize_sum,
+		       u64                      *alloc_sum,
+		       struct famfs_log_stats   *ls,
+		       int                       verbose)
+{
+	u64 i;
+	int j;
+
+	/* This loop is over all log entries */
+	for (i = start; i < end; i++) {
+		const struct famfs_log_entry *le = &logp->entries[i];
+
+		ls->n_entries++;
+
+		/* TODO: validate log sequence number */
+
+		switch (le->famfs_log_entry_type) {
+		case FAMFS_LOG_FILE: {
+			const struct famfs_file_creation *fc = &le->famfs_fc;
+			const struct famfs_log_extent *ext = fc->famfs_ext_list;
 
-	for (i = 1; i < ((FAMFS_LOG_OFFSET + FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT); i++)
-		mu_bitmap_set(bitmap, i);
+			ls->f_logged++;
+			*fsize_sum += fc->famfs_fc_size;
+			if (verbose > 1)
+				printf("%s: file=%s size=%lld\n", __func__,
+				       fc->famfs_relpath, fc->famfs_fc_size);
+
+			/* For each extent in this log entry, mark the bitmap as allocated */
+			for (j = 0; j < fc->famfs_nextents; j++) {
+				u64 collisions;
+				s64 page_num;
+				s64 np;
+
+				assert(!(ext[j].se.famfs_extent_offset % FAMFS_ALLOC_UNIT));
+				page_num = ext[j].se.famfs_extent_offset / FAMFS_ALLOC_UNIT;
+				np = (ext[j].se.famfs_extent_len + FAMFS_ALLOC_UNIT - 1)
+					/ FAMFS_ALLOC_UNIT;
+
+				/* Bits that were already set are double allocations */
+				collisions = mu_bitmap_test_and_set_range(bitmap, page_num, np);
+				*errors += collisions;
+				/* Don't count double allocations */
+				*alloc_sum += (np - collisions) * FAMFS_ALLOC_UNIT;
+			}
+			break;
+		}
+		case FAMFS_LOG_MKDIR:
+			ls->d_logged++;
+			/* Ignore directory log entries - no space is used */
+			break;
+
+		case FAMFS_LOG_ACCESS:
+		default:
+			printf("%s: invalid log entry\n", __func__);
+			break;
+		}
+	}
 }
 
 /**
@@ -2276,15 +3075,13 @@ famfs_build_bitmap(const struct famfs_log   *logp,
 		   struct famfs_log_stats   *log_stats_out,
 		   int                       verbose)
 {
-	u64 nbits = (dev_size_in - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT;
+	u64 nbits = famfs_bitmap_nbits(dev_size_in);
 	u64 bitmap_nbytes = mu_bitmap_size(nbits);
 	u8 *bitmap = calloc(1, bitmap_nbytes);
 	struct famfs_log_stats ls = { 0 }; /* We collect a subset of stats collected by logplay */
 	u64 errors = 0;
 	u64 alloc_sum = 0;
 	u64 fsize_sum  = 0;
-	int i, j;
-	int rc;
 
 	if (verbose > 1)
 		printf("%s: dev_size %lld nbits %lld bitmap_nbytes %lld\n",
@@ -2299,114 +3096,737 @@ famfs_build_bitmap(const struct famfs_log   *logp,
 		printf("%s: superblock and log in bitmap:", __func__);
 		mu_print_bitmap(bitmap, nbits);
 	}
-	/* This loop is over all log entries */
-	for (i = 0; i < logp->famfs_log_next_index; i++) {
-		const struct famfs_log_entry *le = &logp->entries[i];
 
-		ls.n_entries++;
+	famfs_bitmap_apply_log(logp, bitmap, 0, logp->famfs_log_next_index,
+			       &errors, &fsize_sum, &alloc_sum, &ls, verbose);
 
-		/* TODO: validate log sequence number */
+	if (bitmap_nbits_out)
+		*bitmap_nbits_out = nbits;
+	if (alloc_errors_out)
+		*alloc_errors_out = errors;
+	if (fsize_total_out)
+		*fsize_total_out = fsize_sum;
+	if (alloc_sum_out)
+		*alloc_sum_out = alloc_sum;
+	if (log_stats_out)
+		memcpy(log_stats_out, &ls, sizeof(ls));
+	return bitmap;
+}
 
-		switch (le->famfs_log_entry_type) {
-		case FAMFS_LOG_FILE: {
-			const struct famfs_file_creation *fc = &le->famfs_fc;
-			const struct famfs_log_extent *ext = fc->famfs_ext_list;
+/*
+ * Allocation bitmap snapshot
+ *
+ * Rebuilding the bitmap means scanning the whole log, which scripts that run famfs creat
+ * or cp in a loop pay on every invocation. So the master keeps a snapshot of the bitmap
+ * (on local storage, since famfs files can't hold anything that isn't allocated from the
+ * log), tagged with the log position it reflects. The next locked-log allocation loads
+ * the snapshot and applies only the entries appended since; any mismatch with the
+ * current file system or log means a full rebuild.
+ */
 
-			ls.f_logged++;
-			fsize_sum += fc->famfs_fc_size;
-			if (verbose > 1)
-				printf("%s: file=%s size=%lld\n", __func__,
-				       fc->famfs_relpath, fc->famfs_fc_size);
+static unsigned long
+famfs_gen_bitmap_snapshot_crc(const struct famfs_bitmap_snapshot *bs)
+{
+	unsigned long crc = crc32(0L, Z_NULL, 0);
 
-			/* For each extent in this log entry, mark the bitmap as allocated */
-			for (j = 0; j < fc->famfs_nextents; j++) {
-				s64 page_num;
-				s64 np;
-				s64 k;
+	crc = crc32(crc, (const unsigned char *)bs,
+		    offsetof(struct famfs_bitmap_snapshot, bs_crc));
+	return crc;
+}
 
-				assert(!(ext[j].se.famfs_extent_offset % FAMFS_ALLOC_UNIT));
-				page_num = ext[j].se.famfs_extent_offset / FAMFS_ALLOC_UNIT;
-				np = (ext[j].se.famfs_extent_len + FAMFS_ALLOC_UNIT - 1)
-					/ FAMFS_ALLOC_UNIT;
+/**
+ * famfs_bitmap_snapshot_path()
+ *
+ * Exported for unit tests
+ */
+void
+famfs_bitmap_snapshot_path(const uuid_le *fs_uuid, char *path_out)
+{
+	uuid_t local_uuid;
+	char uuid_str[37];
 
-				for (k = page_num; k < (page_num + np); k++) {
-					rc = mu_bitmap_test_and_set(bitmap, k);
-					if (rc == 0) {
-						errors++; /* bit was already set */
-					} else {
-						/* Don't count double allocations */
-						alloc_sum += FAMFS_ALLOC_UNIT;
-					}
-				}
-			}
-			break;
+	memcpy(&local_uuid, fs_uuid, sizeof(local_uuid));
+	uuid_unparse(local_uuid, uuid_str);
+	snprintf(path_out, PATH_MAX - 1, "%s/alloc-%s.bitmap",
+		 FAMFS_LOCAL_STATE_DIR, uuid_str);
+}
+
+/**
+ * famfs_reservation_path()
+ *
+ * Exported for unit tests
+ */
+void
+famfs_reservation_path(const uuid_le *fs_uuid, char *path_out)
+{
+	uuid_t local_uuid;
+	char uuid_str[37];
+
+	memcpy(&local_uuid, fs_uuid, sizeof(local_uuid));
+	uuid_unparse(local_uuid, uuid_str);
+	snprintf(path_out, PATH_MAX - 1, "%s/alloc-%s.reservations",
+		 FAMFS_LOCAL_STATE_DIR, uuid_str);
+}
+
+/* Replace the reservation file with the @n records in @resv */
+static int
+famfs_reservation_write(
+	struct famfs_locked_log        *lp,
+	const struct famfs_reservation *resv,
+	u64                             n)
+{
+	char tmppath[PATH_MAX + 8];
+	char path[PATH_MAX];
+	u64 hdr[2] = { FAMFS_RESERVATION_MAGIC, n };
+	int rc = -1;
+	int fd;
+
+	famfs_reservation_path(&lp->fs_uuid, path);
+	if (!hdr[1])
+		return (unlink(path) && errno != ENOENT) ? -1 : 0;
+
+	mkdir(FAMFS_LOCAL_STATE_DIR, 0755);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: unable to create %s (errno %d)\n", __func__, tmppath, errno);
+		return -1;
+	}
+	if (write(fd, hdr, sizeof(hdr)) == sizeof(hdr) &&
+	    write(fd, resv, n * sizeof(*resv)) == (ssize_t)(n * sizeof(*resv)) &&
+	    !fsync(fd))
+		rc = 0;
+	close(fd);
+	if (!rc && rename(tmppath, path))
+		rc = -1;
+	if (rc) {
+		fprintf(stderr, "%s: failed to write %s\n", __func__, path);
+		unlink(tmppath);
+	}
+	return rc;
+}
+
+/*
+ * Start time of @pid, in clock ticks after boot (field 22 of /proc/<pid>/stat), or 0
+ * if there is no such process
+ */
+static u64
+famfs_pid_start_time(pid_t pid)
+{
+	unsigned long long start;
+	char path[64];
+	char buf[1024];
+	char *p;
+	FILE *f;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = 0;
+
+	/* Field 2 is the command name in parens, which may itself contain spaces */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 1, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s "
+			 "%*s %*s %*s %*s %*s %*s %llu", &start) != 1)
+		return 0;
+	return start;
+}
+
+/* Is the process that saved @rv still running? (Its pid may have been re-used) */
+static int
+famfs_reservation_live(const struct famfs_reservation *rv)
+{
+	u64 start;
+
+	if (!rv->rv_pid)
+		return 0;
+	start = famfs_pid_start_time(rv->rv_pid);
+	return start && start == rv->rv_start;
+}
+
+/*
+ * Recover record @i of @resv, which belongs to a process that exited. Returns 0 if the
+ * record can be dropped: its entry (or a later entry for the same path, created after
+ * the file was unlinked) is in the log, or its file is gone now.
+ */
+static int
+famfs_reservation_recover(
+	struct famfs_locked_log        *lp,
+	const struct famfs_reservation *resv,
+	u64                             nresv,
+	u64                             i,
+	int                             verbose)
+{
+	const char *relpath = (const char *)resv[i].rv_entry.famfs_fc.famfs_relpath;
+	const struct famfs_log *logp = lp->logp;
+	char path[PATH_MAX + FAMFS_MAX_PATHLEN + 2];
+	int len;
+	u64 j;
+
+	for (j = resv[i].rv_log_index; j < logp->famfs_log_next_index; j++) {
+		const struct famfs_log_entry *le = &logp->entries[j];
+
+		if (le->famfs_log_entry_type == FAMFS_LOG_FILE &&
+		    !strncmp((const char *)le->famfs_fc.famfs_relpath, relpath,
+			     FAMFS_MAX_PATHLEN))
+			return 0;
+	}
+
+	/* The path may have been re-used by a writer that is still running */
+	for (j = 0; j < nresv; j++) {
+		if (j == i ||
+		    strncmp((const char *)resv[j].rv_entry.famfs_fc.famfs_relpath, relpath,
+			    FAMFS_MAX_PATHLEN))
+			continue;
+		if (famfs_reservation_live(&resv[j]))
+			return 0;
+	}
+
+	/* The record is read from disk, so the relpath may not be terminated */
+	len = snprintf(path, sizeof(path), "%s/%.*s", lp->mpt, FAMFS_MAX_PATHLEN, relpath);
+	if (len < 0 || len >= (int)sizeof(path)) {
+		fprintf(stderr, "%s: path too long under %s; not unlinking the file of "
+			"exited pid %d\n", __func__, lp->mpt, resv[i].rv_pid);
+		return -1;
+	}
+	if (unlink(path) && errno != ENOENT) {
+		fprintf(stderr, "%s: unable to unlink %s, left unpublished by exited pid %d "
+			"(errno %d)\n", __func__, path, resv[i].rv_pid, errno);
+		return -1;
+	}
+	if (verbose)
+		printf("%s: unlinked %s, left unpublished by exited pid %d\n",
+		       __func__, path, resv[i].rv_pid);
+	return 0;
+}
+
+/**
+ * famfs_reservation_load()
+ *
+ * Read the reservations into @lp (caller holds the log lock, and @lp->logp and
+ * @lp->mpt are set). The records of processes that exited are recovered first.
+ *
+ * Returns 0, or -1 if the reservation file exists but cannot be read
+ */
+static int
+famfs_reservation_load(struct famfs_locked_log *lp, int verbose)
+{
+	struct famfs_reservation *resv = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+	u64 hdr[2];
+	u64 i, n;
+	int fd;
+
+	famfs_reservation_path(&lp->fs_uuid, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (errno == ENOENT) ? 0 : -1;
+
+	if (fstat(fd, &st) || read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr[0] != FAMFS_RESERVATION_MAGIC ||
+	    st.st_size != (off_t)(sizeof(hdr) + hdr[1] * sizeof(*resv))) {
+		fprintf(stderr, "%s: invalid reservation file %s\n", __func__, path);
+		goto err_out;
+	}
+	if (hdr[1]) {
+		resv = calloc(hdr[1], sizeof(*resv));
+		if (!resv ||
+		    read(fd, resv, hdr[1] * sizeof(*resv)) != (ssize_t)(hdr[1] * sizeof(*resv)))
+			goto err_out;
+	}
+	close(fd);
+
+	/* Recover the records of writers that exited (marked with pid 0 once dropped) */
+	for (i = 0; i < hdr[1]; i++) {
+		if (famfs_reservation_live(&resv[i]))
+			continue;
+		if (!famfs_reservation_recover(lp, resv, hdr[1], i, verbose))
+			resv[i].rv_pid = 0;
+	}
+	for (i = 0, n = 0; i < hdr[1]; i++)
+		if (resv[i].rv_pid)
+			resv[n++] = resv[i];
+	lp->resv = resv;
+	lp->nresv = n;
+	lp->resv_slots = n;
+
+	/* If this fails, the records are recovered again next time */
+	if (n < hdr[1]) {
+		if (verbose)
+			printf("%s: dropped %lld reservations of exited writers\n",
+			       __func__, hdr[1] - n);
+		famfs_reservation_write(lp, resv, n);
+	}
+	if (verbose && n)
+		printf("%s: %lld reservations hold %lld log slots\n", __func__, n, lp->resv_slots);
+	return 0;
+
+err_out:
+	free(resv);
+	close(fd);
+	return -1;
+}
+
+/* Drop this process's records from @lp->resv; returns the number dropped */
+static u64
+famfs_reservation_drop_mine(struct famfs_locked_log *lp)
+{
+	u64 start = famfs_pid_start_time(getpid());
+	u64 i, n = 0;
+	u64 ndropped;
+
+	for (i = 0; i < lp->nresv; i++) {
+		if (lp->resv[i].rv_pid == getpid() && lp->resv[i].rv_start == start)
+			continue;
+		lp->resv[n++] = lp->resv[i];
+	}
+	ndropped = lp->nresv - n;
+	lp->nresv = n;
+	lp->resv_slots = n;
+	return ndropped;
+}
+
+/**
+ * famfs_reservation_save()
+ *
+ * Record the entries held by the deferred @txn as this process's reservations (replacing
+ * any it saved before), so the log lock can be released before they are published.
+ * Caller holds the log lock.
+ *
+ * Returns 0 on success
+ */
+int
+famfs_reservation_save(struct famfs_locked_log *lp, const struct famfs_log_txn *txn)
+{
+	struct famfs_reservation *resv;
+	u64 i, n, start;
+
+	assert(txn->deferred);
+	if (!txn->nentries)
+		return 0;
+
+	famfs_reservation_drop_mine(lp);
+	resv = realloc(lp->resv, (lp->nresv + txn->nentries) * sizeof(*resv));
+	if (!resv)
+		return -1;
+	lp->resv = resv;
+
+	n = lp->nresv;
+	start = famfs_pid_start_time(getpid());
+	memset(&resv[n], 0, txn->nentries * sizeof(*resv));
+	for (i = 0; i < txn->nentries; i++) {
+		resv[n + i].rv_pid       = getpid();
+		resv[n + i].rv_start     = start;
+		resv[n + i].rv_log_index = txn->logp->famfs_log_next_index;
+		memcpy(&resv[n + i].rv_entry, &txn->entries[i], sizeof(resv[n + i].rv_entry));
+	}
+	lp->nresv += txn->nentries;
+	lp->resv_slots = lp->nresv;
+	return famfs_reservation_write(lp, resv, lp->nresv);
+}
+
+/**
+ * famfs_reservation_release()
+ *
+ * Drop this process's reservations (after its entries are published, or their files
+ * unlinked). Caller holds the log lock.
+ */
+int
+famfs_reservation_release(struct famfs_locked_log *lp)
+{
+	if (!famfs_reservation_drop_mine(lp))
+		return 0;
+	return famfs_reservation_write(lp, lp->resv, lp->nresv);
+}
+
+/* Mark reserved space as allocated in @lp's bitmap */
+static void
+famfs_reservation_apply(struct famfs_locked_log *lp)
+{
+	u64 i;
+	u32 j;
+
+	for (i = 0; i < lp->nresv; i++) {
+		const struct famfs_log_entry *e = &lp->resv[i].rv_entry;
+		const struct famfs_file_creation *fc = &e->famfs_fc;
+
+		if (e->famfs_log_entry_type != FAMFS_LOG_FILE)
+			continue;
+		for (j = 0; j < fc->famfs_nextents && j < FAMFS_FC_MAX_EXTENTS; j++) {
+			const struct famfs_simple_extent *se = &fc->famfs_ext_list[j].se;
+
+			mu_bitmap_set_range(lp->bitmap,
+					    se->famfs_extent_offset / FAMFS_ALLOC_UNIT,
+					    (se->famfs_extent_len + FAMFS_ALLOC_UNIT - 1) /
+					    FAMFS_ALLOC_UNIT);
 		}
-		case FAMFS_LOG_MKDIR:
-			ls.d_logged++;
-			/* Ignore directory log entries - no space is used */
-			break;
+	}
+}
 
-		case FAMFS_LOG_ACCESS:
-		default:
-			printf("%s: invalid log entry\n", __func__);
-			break;
+/**
+ * famfs_bitmap_snapshot_load()
+ *
+ * @fs_uuid
+ * @logp
+ * @nbits          - expected bitmap size
+ * @next_index_out - the snapshot reflects log entries [0, *next_index_out)
+ * @verbose
+ *
+ * Returns a bitmap that the caller must free, or NULL if there is no usable snapshot
+ */
+static u8 *
+famfs_bitmap_snapshot_load(
+	const uuid_le          *fs_uuid,
+	const struct famfs_log *logp,
+	u64                     nbits,
+	u64                    *next_index_out,
+	int                     verbose)
+{
+	u64 nbytes = mu_bitmap_size(nbits);
+	struct famfs_bitmap_snapshot bs;
+	const struct famfs_log_entry *le;
+	char path[PATH_MAX];
+	u8 *bitmap = NULL;
+	ssize_t bytes;
+	int fd;
+
+	famfs_bitmap_snapshot_path(fs_uuid, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL; /* No snapshot yet */
+
+	bytes = read(fd, &bs, sizeof(bs));
+	if (bytes != sizeof(bs) ||
+	    bs.bs_magic != FAMFS_BITMAP_SNAPSHOT_MAGIC ||
+	    bs.bs_crc != famfs_gen_bitmap_snapshot_crc(&bs)) {
+		fprintf(stderr, "%s: invalid bitmap snapshot %s; rebuilding\n", __func__, path);
+		goto err_out;
+	}
+
+	if (memcmp(&bs.bs_fs_uuid, fs_uuid, sizeof(bs.bs_fs_uuid)) ||
+	    bs.bs_nbits != nbits ||
+	    bs.bs_log_hdr_crc != famfs_gen_log_header_crc(logp)) {
+		if (verbose)
+			printf("%s: snapshot is for a different fs or log; rebuilding\n",
+			       __func__);
+		goto err_out;
+	}
+
+	if (bs.bs_next_index > logp->famfs_log_next_index) {
+		if (verbose)
+			printf("%s: snapshot index %lld beyond log (%lld); rebuilding\n",
+			       __func__, bs.bs_next_index, logp->famfs_log_next_index);
+		goto err_out;
+	}
+
+	/* The last entry reflected in the snapshot must still be in the same place */
+	if (bs.bs_next_index) {
+		le = &logp->entries[bs.bs_next_index - 1];
+		if (le->famfs_log_entry_seqnum != bs.bs_last_seqnum ||
+		    le->famfs_log_entry_crc != bs.bs_last_crc) {
+			if (verbose)
+				printf("%s: seqnum mismatch at index %lld; rebuilding\n",
+				       __func__, bs.bs_next_index - 1);
+			goto err_out;
 		}
 	}
-	if (bitmap_nbits_out)
-		*bitmap_nbits_out = nbits;
-	if (alloc_errors_out)
-		*alloc_errors_out = errors;
-	if (fsize_total_out)
-		*fsize_total_out = fsize_sum;
-	if (alloc_sum_out)
-		*alloc_sum_out = alloc_sum;
-	if (log_stats_out)
-		memcpy(log_stats_out, &ls, sizeof(ls));
-	return bitmap;
+
+	bitmap = calloc(1, nbytes);
+	if (!bitmap)
+		goto err_out;
+
+	bytes = read(fd, bitmap, nbytes);
+	if (bytes != (ssize_t)nbytes ||
+	    bs.bs_bitmap_crc != crc32(crc32(0L, Z_NULL, 0), bitmap, nbytes)) {
+		fprintf(stderr, "%s: corrupt bitmap snapshot %s; rebuilding\n", __func__, path);
+		goto err_out;
+	}
+	close(fd);
+
+	*next_index_out = bs.bs_next_index;
+	return bitmap;
+
+err_out:
+	free(bitmap);
+	close(fd);
+	return NULL;
+}
+
+/**
+ * famfs_bitmap_snapshot_save()
+ *
+ * Save @bitmap as reflecting log entries [0, @next_index). The snapshot file is replaced
+ * via rename, so a reader sees either the old or the new snapshot.
+ */
+static int
+famfs_bitmap_snapshot_save(
+	const uuid_le          *fs_uuid,
+	const struct famfs_log *logp,
+	const u8               *bitmap,
+	u64                     nbits,
+	u64                     next_index)
+{
+	u64 nbytes = mu_bitmap_size(nbits);
+	struct famfs_bitmap_snapshot bs = { 0 };
+	char tmppath[PATH_MAX + 8];
+	char path[PATH_MAX];
+	ssize_t bytes;
+	int fd;
+
+	bs.bs_magic       = FAMFS_BITMAP_SNAPSHOT_MAGIC;
+	memcpy(&bs.bs_fs_uuid, fs_uuid, sizeof(bs.bs_fs_uuid));
+	bs.bs_nbits       = nbits;
+	bs.bs_log_hdr_crc = famfs_gen_log_header_crc(logp);
+	bs.bs_next_index  = next_index;
+	if (next_index) {
+		bs.bs_last_seqnum = logp->entries[next_index - 1].famfs_log_entry_seqnum;
+		bs.bs_last_crc    = logp->entries[next_index - 1].famfs_log_entry_crc;
+	}
+	bs.bs_bitmap_crc  = crc32(crc32(0L, Z_NULL, 0), bitmap, nbytes);
+	bs.bs_crc         = famfs_gen_bitmap_snapshot_crc(&bs);
+
+	mkdir(FAMFS_LOCAL_STATE_DIR, 0755);
+	famfs_bitmap_snapshot_path(fs_uuid, path);
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "%s: unable to create bitmap snapshot %s (errno %d)\n",
+			__func__, tmppath, errno);
+		return -1;
+	}
+	bytes = write(fd, &bs, sizeof(bs));
+	if (bytes == sizeof(bs))
+		bytes = write(fd, bitmap, nbytes);
+	close(fd);
+	if (bytes != (ssize_t)nbytes) {
+		fprintf(stderr, "%s: failed to write bitmap snapshot %s\n", __func__, tmppath);
+		unlink(tmppath);
+		return -1;
+	}
+	if (rename(tmppath, path)) {
+		fprintf(stderr, "%s: failed to rename bitmap snapshot %s\n", __func__, tmppath);
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * famfs_load_alloc_bitmap()
+ *
+ * Get the allocation bitmap for a locked log: from the snapshot plus any newer log
+ * entries if possible, otherwise by scanning the whole log. Either way, the snapshot is
+ * brought up to date before the caller starts allocating, so it never contains space
+ * that was allocated but not logged.
+ *
+ * @lp
+ * @nbits_out
+ * @verbose
+ */
+static u8 *
+famfs_load_alloc_bitmap(
+	struct famfs_locked_log *lp,
+	u64                     *nbits_out,
+	int                      verbose)
+{
+	u64 nbits = famfs_bitmap_nbits(lp->devsize);
+	u64 end = lp->logp->famfs_log_next_index;
+	struct famfs_superblock *sb;
+	u64 snap_index = 0;
+	int save = 1;
+	u8 *bitmap;
+
+	sb = famfs_map_superblock_by_path(lp->mpt, 1 /* read-only */);
+	if (!sb)
+		return famfs_build_bitmap(lp->logp, lp->devsize, nbits_out,
+					  NULL, NULL, NULL, NULL, verbose);
+
+	bitmap = famfs_bitmap_snapshot_load(&sb->ts_uuid, lp->logp, nbits, &snap_index,
+					    verbose);
+	if (bitmap) {
+		struct famfs_log_stats ls = { 0 };
+		u64 errors = 0;
+		u64 fsize_sum = 0;
+		u64 alloc_sum = 0;
+
+		if (verbose)
+			printf("%s: bitmap snapshot at log index %lld; applying %lld entries\n",
+			       __func__, snap_index, end - snap_index);
+
+		famfs_bitmap_apply_log(lp->logp, bitmap, snap_index, end,
+				       &errors, &fsize_sum, &alloc_sum, &ls, verbose);
+		if (errors) {
+			/* Don't trust a snapshot that collides with the log */
+			fprintf(stderr, "%s: %lld collisions applying log to snapshot; rebuilding\n",
+				__func__, errors);
+			free(bitmap);
+			bitmap = NULL;
+		} else if (snap_index == end) {
+			save = 0; /* Snapshot is already current */
+		}
+	}
+
+	if (!bitmap) {
+		bitmap = famfs_build_bitmap(lp->logp, lp->devsize, &nbits,
+					    NULL, NULL, NULL, NULL, verbose);
+		if (!bitmap)
+			goto out;
+	}
+
+	if (save)
+		famfs_bitmap_snapshot_save(&sb->ts_uuid, lp->logp, bitmap, nbits, end);
+
+	*nbits_out = nbits;
+out:
+	munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	return bitmap;
+}
+
+/**
+ * bitmap_alloc_contiguous()
+ *
+ * @bitmap
+ * @nbits - number of bits in the bitmap
+ * @alloc_size - size to allocate in bytes (must convert to bits)
+ *
+ * Return value: the offset in bytes
+ */
+s64
+bitmap_alloc_contiguous(u8 *bitmap,
+			u64 nbits,
+			u64 alloc_size)
+{
+	u64 alloc_bits = (alloc_size + FAMFS_ALLOC_UNIT - 1) /  FAMFS_ALLOC_UNIT;
+	s64 i;
+
+	i = mu_bitmap_find_zero_run(bitmap, nbits, 0, alloc_bits);
+	if (i < 0) {
+		fprintf(stderr, "%s: alloc failed\n", __func__);
+		return -1;
+	}
+
+	mu_bitmap_set_range(bitmap, i, alloc_bits);
+	return i * FAMFS_ALLOC_UNIT;
+}
+
+/*
+ * Free-extent index
+ *
+ * Scanning the bitmap for every allocation is O(nbits) per file, which hurts on large,
+ * mostly-full devices. The free-extent index is built once from the bitmap (per locked
+ * log session) as an offset-ordered array of free runs, plus a max-run-length tree over
+ * that array. First-fit lookup descends the tree toward the lowest-offset run that is
+ * big enough, so it returns the same offset as bitmap_alloc_contiguous() in O(log nruns).
+ *
+ * Since famfs never frees space while the log is locked, runs only ever shrink; an
+ * allocation just trims the front of a run and updates one root-to-leaf path.
+ */
+
+/**
+ * famfs_free_index_build()
+ *
+ * @fi     - index to initialize (caller frees with famfs_free_index_free())
+ * @bitmap - allocation bitmap (1=allocated)
+ * @nbits  - number of bits in @bitmap
+ *
+ * Returns 0 on success, -ENOMEM on failure
+ */
+int
+famfs_free_index_build(
+	struct famfs_free_index *fi,
+	u8                      *bitmap,
+	u64                      nbits)
+{
+	u64 nruns = 0;
+	u64 i, n;
+
+	memset(fi, 0, sizeof(*fi));
+
+	/* Pass 1: count the free runs */
+	for (i = mu_bitmap_find_first_zero(bitmap, nbits); i < nbits;
+	     i = mu_bitmap_find_next_zero(bitmap, nbits, i)) {
+		nruns++;
+		i = mu_bitmap_find_next_set(bitmap, nbits, i);
+	}
+
+	fi->nleaves = 1;
+	while (fi->nleaves < nruns)
+		fi->nleaves <<= 1;
+
+	fi->runs = calloc(fi->nleaves, sizeof(*fi->runs));
+	fi->max_len = calloc(2 * fi->nleaves, sizeof(*fi->max_len));
+	if (!fi->runs || !fi->max_len) {
+		famfs_free_index_free(fi);
+		return -ENOMEM;
+	}
+
+	/* Pass 2: record the runs in offset order */
+	for (i = mu_bitmap_find_first_zero(bitmap, nbits), n = 0; i < nbits;
+	     i = mu_bitmap_find_next_zero(bitmap, nbits, i)) {
+		fi->runs[n].start = i;
+		i = mu_bitmap_find_next_set(bitmap, nbits, i);
+		fi->runs[n].len = i - fi->runs[n].start;
+		fi->max_len[fi->nleaves + n] = fi->runs[n].len;
+		n++;
+	}
+	fi->nruns = nruns;
+
+	for (n = fi->nleaves - 1; n > 0; n--)
+		fi->max_len[n] = MAX(fi->max_len[2 * n], fi->max_len[2 * n + 1]);
+
+	return 0;
+}
+
+void
+famfs_free_index_free(struct famfs_free_index *fi)
+{
+	free(fi->runs);
+	free(fi->max_len);
+	memset(fi, 0, sizeof(*fi));
 }
 
 /**
- * bitmap_alloc_contiguous()
+ * famfs_free_index_alloc()
  *
- * @bitmap
- * @nbits - number of bits in the bitmap
- * @alloc_size - size to allocate in bytes (must convert to bits)
+ * First-fit allocation from the free-extent index
  *
- * Return value: the offset in bytes
+ * @fi
+ * @alloc_bits - number of allocation units needed
+ *
+ * Return value: the first allocated bit, or -1 if there is no free run big enough
  */
-static s64
-bitmap_alloc_contiguous(u8 *bitmap,
-			u64 nbits,
-			u64 alloc_size)
+s64
+famfs_free_index_alloc(
+	struct famfs_free_index *fi,
+	u64                      alloc_bits)
 {
-	u64 i, j;
-	u64 alloc_bits = (alloc_size + FAMFS_ALLOC_UNIT - 1) /  FAMFS_ALLOC_UNIT;
-	u64 bitmap_remainder;
+	struct famfs_free_run *run;
+	u64 node = 1;
+	s64 start;
 
-	for (i = 0; i < nbits; i++) {
-		/* Skip bits that are set... */
-		if (mu_bitmap_test(bitmap, i))
-			continue;
+	if (!alloc_bits || !fi->nruns || fi->max_len[1] < alloc_bits)
+		return -1;
 
-		bitmap_remainder = nbits - i;
-		if (alloc_bits > bitmap_remainder) /* Remaining space is not enough */
-			return -1;
+	/* Descend toward the leftmost (lowest offset) leaf whose run is big enough */
+	while (node < fi->nleaves)
+		node = (fi->max_len[2 * node] >= alloc_bits) ? 2 * node : 2 * node + 1;
 
-		for (j = i; j < (i+alloc_bits); j++) {
-			if (mse_bitmap_test32(bitmap, j))
-				goto next;
-		}
-		/* If we get here, we didn't hit the "continue" which means that bits
-		 * i-(i+alloc_bits) are available
-		 */
-		for (j = i; j < (i+alloc_bits); j++)
-			mse_bitmap_set32(bitmap, j);
+	run = &fi->runs[node - fi->nleaves];
+	start = run->start;
+	run->start += alloc_bits;
+	run->len   -= alloc_bits;
 
-		return i * FAMFS_ALLOC_UNIT;
-next:
-	}
-	fprintf(stderr, "%s: alloc failed\n", __func__);
-	return -1;
+	fi->max_len[node] = run->len;
+	for (node >>= 1; node > 0; node >>= 1)
+		fi->max_len[node] = MAX(fi->max_len[2 * node], fi->max_len[2 * node + 1]);
+
+	return start;
 }
 
 /**
@@ -2420,6 +3840,7 @@ famfs_init_locked_log(struct famfs_locked_log *lp,
 		      const char *fspath,
 		      int verbose)
 {
+	struct famfs_superblock *sb;
 	size_t log_size;
 	void *addr;
 	int role;
@@ -2457,6 +3878,20 @@ famfs_init_locked_log(struct famfs_locked_log *lp,
 	}
 	lp->logp = (struct famfs_log *)addr;
 	flush_processor_cache(lp->logp, log_size); /* Invalidate the processor cache for the log */
+
+	/* Space and log slots held by writers that have not published their entries yet */
+	sb = famfs_map_superblock_by_path(lp->mpt, 1 /* read-only */);
+	if (sb) {
+		memcpy(&lp->fs_uuid, &sb->ts_uuid, sizeof(lp->fs_uuid));
+		munmap(sb, FAMFS_SUPERBLOCK_SIZE);
+	}
+	if (!sb || famfs_reservation_load(lp, verbose)) {
+		fprintf(stderr, "%s: unable to load allocation reservations\n", __func__);
+		munmap(lp->logp, log_size);
+		lp->logp = NULL;
+		rc = -1;
+		goto err_out;
+	}
 	return 0;
 
 err_out:
@@ -2475,16 +3910,34 @@ err_out:
 static s64
 famfs_alloc_contiguous(struct famfs_locked_log *lp, u64 size, int verbose)
 {
+	u64 alloc_bits = (size + FAMFS_ALLOC_UNIT - 1) / FAMFS_ALLOC_UNIT;
+	s64 start;
+
 	if (!lp->bitmap) {
-		/* Bitmap is needed and hasn't been built yet */
-		lp->bitmap = famfs_build_bitmap(lp->logp, lp->devsize, &lp->nbits,
-						NULL, NULL, NULL, NULL, verbose);
+		/* Bitmap is needed and hasn't been loaded or built yet */
+		lp->bitmap = famfs_load_alloc_bitmap(lp, &lp->nbits, verbose);
 		if (!lp->bitmap) {
 			fprintf(stderr, "%s: failed to allocate bitmap\n", __func__);
 			return -1;
 		}
+		famfs_reservation_apply(lp);
+		if (famfs_free_index_build(&lp->free_index, lp->bitmap, lp->nbits))
+			fprintf(stderr, "%s: no free-extent index; falling back to bitmap scan\n",
+				__func__);
+	}
+	if (!lp->free_index.max_len)
+		return bitmap_alloc_contiguous(lp->bitmap, lp->nbits, size);
+
+	start = famfs_free_index_alloc(&lp->free_index, alloc_bits);
+	if (start < 0) {
+		fprintf(stderr, "%s: alloc failed\n", __func__);
+		return -1;
 	}
-	return bitmap_alloc_contiguous(lp->bitmap, lp->nbits, size);
+
+	/* Keep the bitmap consistent with the index */
+	mu_bitmap_set_range(lp->bitmap, start, alloc_bits);
+
+	return start * FAMFS_ALLOC_UNIT;
 }
 
 
@@ -2493,8 +3946,16 @@ famfs_release_locked_log(struct famfs_locked_log *lp)
 {
 	int rc;
 
+	/* Don't lose entries for objects that have already been created */
+	if (lp->txn) {
+		famfs_log_txn_commit(lp->txn);
+		lp->txn = NULL;
+	}
+
 	if (lp->bitmap)
 		free(lp->bitmap);
+	famfs_free_index_free(&lp->free_index);
+	free(lp->resv);
 
 	assert(lp->lfd > 0);
 	rc = flock(lp->lfd, LOCK_UN);
@@ -2541,7 +4002,6 @@ famfs_file_alloc(
 	int                      verbose)
 {
 	struct famfs_simple_extent ext = {0};
-	struct famfs_log *logp;
 	char mpt[PATH_MAX];
 	char *relpath;
 	char *rpath = strdup(path);
@@ -2551,8 +4011,6 @@ famfs_file_alloc(
 	assert(lp);
 	assert(fd > 0);
 
-	/* XXX do we need the non-locked-log case? */
-	logp = lp->logp;
 	strncpy(mpt, lp->mpt, PATH_MAX - 1);
 
 	/* For the log, we need the path relative to the mount point.
@@ -2575,8 +4033,7 @@ famfs_file_alloc(
 	ext.famfs_extent_len    = round_size_to_alloc_unit(size);
 	ext.famfs_extent_offset = offset;
 
-	rc = famfs_log_file_creation(logp, 1, &ext,
-				     relpath, mode, uid, gid, size);
+	rc = famfs_log_file_creation(lp, 1, &ext, relpath, mode, uid, gid, size);
 	if (rc)
 		goto out;
 
@@ -2884,7 +4341,7 @@ __famfs_mkdir(
 	}
 
 	/* Should it be logged before it's locally created? */
-	rc = famfs_log_dir_creation(lp->logp, relpath, mode, uid, gid);
+	rc = famfs_log_dir_creation(lp, relpath, mode, uid, gid);
 
 err_out:
 	if (dirdupe)
@@ -2989,55 +4446,688 @@ famfs_make_parent_dir(
 }
 
 int
-famfs_mkdir_parents(
-	const char *dirpath,
-	mode_t      mode,
-	uid_t       uid,
-	gid_t       gid,
-	int         verbose)
+famfs_mkdir_parents(
+	const char *dirpath,
+	mode_t      mode,
+	uid_t       uid,
+	gid_t       gid,
+	int         verbose)
+{
+	struct famfs_locked_log ll = { 0 };
+	char *cwd = get_current_dir_name();
+	struct famfs_log_txn txn;
+	char abspath[PATH_MAX];
+	char *rpath;
+	int rc;
+
+	/* dirpath as an indeterminate number of nonexistent dirs, under a path that
+	 * must exist. But the immediate parent may not exist. All existing elements
+	 * in the path must be dirs. By opening the log, we can get the mount point path...
+	 */
+
+	if (dirpath[0] == '/')
+		strncpy(abspath, dirpath, PATH_MAX - 1);
+	else
+		snprintf(abspath, PATH_MAX - 1, "%s/%s", cwd, dirpath);
+
+	if (verbose)
+		printf("%s: cwd %s abspath %s\n", __func__, cwd, abspath);
+
+	rpath = find_real_parent_path(abspath);
+	if (!rpath) {
+		fprintf(stderr, "%s: failed to find real parent dir\n", __func__);
+		return -1;
+	}
+
+	/* OK, we know were in a FAMFS instance. get a locked log struct */
+	rc = famfs_init_locked_log(&ll, rpath, verbose);
+	if (rc) {
+		free(rpath);
+		return rc;
+	}
+
+	/* Now recurse up fromm abspath till we find an existing parent, and mkdir back down.
+	 * The new directories are published to the log together.
+	 */
+	famfs_log_txn_begin(&txn, &ll);
+	ll.txn = &txn;
+	rc = famfs_make_parent_dir(&ll, abspath, mode, uid, gid, 0, verbose);
+
+	/* Even on error, publish the dirs that were created */
+	ll.txn = NULL;
+	famfs_log_txn_commit(&txn);
+
+	/* Separate function should release ll and lock */
+	famfs_release_locked_log(&ll);
+	free(rpath);
+	if (cwd)
+		free(cwd);
+
+	return rc;
+}
+
+/**
+ * famfs_cp_copy_data() - copy [@offset, @offset + @len) of @srcfd to the same range of
+ *                        the mapped destination file
+ *
+ * Without @bounce, the source is read directly into the mapping, which is then flushed
+ * from the cache. With @bounce (FAMFS_CP_IO_SIZE bytes), the source is read into it and
+ * written to the mapping with non-temporal stores, which need no flush.
+ */
+static int
+famfs_cp_copy_data(
+	int         srcfd,
+	char       *destp,
+	u64         offset,
+	u64         len,
+	char       *bounce,
+	const char *destfile)
+{
+	u64 done = 0;
+
+	while (done < len) {
+		size_t cur_chunksize = MIN(FAMFS_CP_IO_SIZE, len - done);
+		char *buf = (bounce) ? bounce : &destp[offset + done];
+		ssize_t bytes;
+
+		/* read into mmapped destination (or the bounce buffer) */
+		bytes = pread(srcfd, buf, cur_chunksize, offset + done);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0) {
+			fprintf(stderr, "%s: copy fail (%s): ofs %lld cur_chunksize %ld "
+				"rc=%ld errno=%d\n", __func__, destfile, offset + done,
+				cur_chunksize, bytes, (bytes) ? errno : 0);
+			return -1;
+		}
+		if (bounce)
+			mu_memcpy_nt(&destp[offset + done], bounce, bytes);
+		done += bytes;
+	}
+	/* Flush the processor cache for the dest range */
+	if (!bounce)
+		flush_processor_cache(&destp[offset], len);
+	return 0;
+}
+
+/**
+ * famfs_cp_copy_range() - copy [@offset, @offset + @len) of @srcfd to the mapped
+ *                         destination file, skipping holes in the source
+ *
+ * Data extents are found with SEEK_DATA / SEEK_HOLE and copied by famfs_cp_copy_data();
+ * holes are not read, but zeroed in the destination with non-temporal stores (famfs
+ * allocations are not known to be zeroed). If the source file system does not support
+ * SEEK_DATA, the whole range is copied. The number of hole bytes is added to @holes.
+ */
+static int
+famfs_cp_copy_range(
+	int         srcfd,
+	char       *destp,
+	u64         offset,
+	u64         len,
+	char       *bounce,
+	const char *destfile,
+	u64        *holes)
+{
+	u64 end = offset + len;
+	u64 pos = offset;
+	struct stat st;
+	off_t data, hole;
+	int rc;
+
+	if (fstat(srcfd, &st))
+		return famfs_cp_copy_data(srcfd, destp, offset, len, bounce, destfile);
+
+	while (pos < end) {
+		data = lseek(srcfd, pos, SEEK_DATA);
+		if (data < 0) {
+			/* ENXIO: no data from pos to EOF. Past EOF, let the read fail */
+			if (errno == ENXIO && pos < (u64)st.st_size)
+				data = st.st_size;
+			else
+				data = pos;
+		}
+		data = MIN((u64)data, end);
+		if ((u64)data > pos) {
+			mu_memzero_nt(&destp[pos], data - pos);
+			*holes += data - pos;
+			pos = data;
+			continue;
+		}
+
+		hole = lseek(srcfd, pos, SEEK_HOLE);
+		if (hole < 0 || (u64)hole <= pos)
+			hole = end;
+		hole = MIN((u64)hole, end);
+
+		rc = famfs_cp_copy_data(srcfd, destp, pos, hole - pos, bounce, destfile);
+		if (rc)
+			return rc;
+		pos = hole;
+	}
+	return 0;
+}
+
+/**
+ * struct famfs_uring - minimal io_uring for famfs cp --direct
+ *
+ * famfs does not depend on liburing, so the ring is set up and driven with the raw
+ * syscalls. Each copy worker owns one; it is not thread safe.
+ */
+struct famfs_uring {
+	int                  fd;
+	unsigned int        *sq_tail;
+	unsigned int        *sq_mask;
+	unsigned int        *sq_array;
+	unsigned int        *cq_head;
+	unsigned int        *cq_tail;
+	unsigned int        *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void                *sq_ring;
+	void                *cq_ring;
+	size_t               sq_ring_size;
+	size_t               cq_ring_size;
+	size_t               sqes_size;
+};
+
+static void
+famfs_uring_exit(struct famfs_uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+static void *
+famfs_uring_mmap(struct famfs_uring *r, size_t size, off_t which)
+{
+	void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, which);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+/**
+ * famfs_uring_init() - set up a ring with at least @entries submission queue entries
+ *
+ * Returns 0, or -1 if io_uring is not available (old kernel, or disabled by policy)
+ */
+static int
+famfs_uring_init(struct famfs_uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_ring_size = r->cq_ring_size = MAX(r->sq_ring_size, r->cq_ring_size);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_ring = famfs_uring_mmap(r, r->sq_ring_size, IORING_OFF_SQ_RING);
+	if (!r->sq_ring)
+		goto err_out;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_ring = r->sq_ring;
+	else
+		r->cq_ring = famfs_uring_mmap(r, r->cq_ring_size, IORING_OFF_CQ_RING);
+	r->sqes = famfs_uring_mmap(r, r->sqes_size, IORING_OFF_SQES);
+	if (!r->cq_ring || !r->sqes)
+		goto err_out;
+
+	r->sq_tail  = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask  = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head  = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail  = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask  = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes     = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+	return 0;
+
+err_out:
+	famfs_uring_exit(r);
+	return -1;
+}
+
+/* Queue (but do not submit) a read of @len bytes at @offset of @fd into @buf */
+static void
+famfs_uring_prep_read(
+	struct famfs_uring *r,
+	int                 fd,
+	void               *buf,
+	u32                 len,
+	u64                 offset,
+	u64                 user_data)
+{
+	unsigned int tail = *r->sq_tail;
+	unsigned int idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (u64)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit @to_submit queued reads and wait for at least @min_complete completions.
+ * Returns the number submitted, or -1 */
+static int
+famfs_uring_enter(struct famfs_uring *r, unsigned int to_submit, unsigned int min_complete)
+{
+	int rc;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+			     IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	return rc;
+}
+
+/* Pop a completion, if there is one */
+static int
+famfs_uring_reap(struct famfs_uring *r, u64 *user_data, s64 *res)
+{
+	unsigned int head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &r->cqes[head & *r->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Wait for the completions of @n reads that were submitted to @r. Tearing down a ring
+ * does not wait for its reads, so this is how a caller makes sure none of them lands
+ * after it has moved on. Works even if io_uring_enter() fails: the reads complete
+ * anyway, and their completions are polled for.
+ */
+static void
+famfs_uring_drain(struct famfs_uring *r, unsigned int n)
+{
+	u64 user_data;
+	s64 res;
+
+	while (n) {
+		if (famfs_uring_reap(r, &user_data, &res)) {
+			n--;
+			continue;
+		}
+		if (mock_failure == MOCK_FAIL_URING_ENTER || famfs_uring_enter(r, 0, 1) < 0)
+			usleep(1000);
+	}
+}
+
+#define FAMFS_CP_DIRECT_FALLBACK -1 /* read the range through the page cache instead */
+#define FAMFS_CP_RING_FAILED     -2 /* ...and stop using the ring */
+
+/**
+ * famfs_cp_read_direct() - read [@offset, @offset + @len) of @dsrcfd (opened O_DIRECT)
+ *                          into the same range of @destp, bypassing the page cache
+ *
+ * @offset must be FAMFS_CP_DIRECT_ALIGN-aligned. The last read is rounded up to the
+ * alignment, which is safe because the mapping covers whole pages and the read stops
+ * at EOF. With @ring, up to FAMFS_CP_DIRECT_QDEPTH reads are in flight at a time;
+ * without it the reads are synchronous.
+ *
+ * Returns 0 if the whole range was read, FAMFS_CP_DIRECT_FALLBACK if any part of it
+ * was not (the caller re-reads it through the page cache), or FAMFS_CP_RING_FAILED if
+ * @ring has become unusable. Either way, no read is still in flight when it returns.
+ */
+static int
+famfs_cp_read_direct(
+	struct famfs_uring *ring,
+	int                 dsrcfd,
+	char               *destp,
+	u64                 offset,
+	u64                 len)
+{
+	unsigned int inflight = 0, unsubmitted = 0;
+	u64 end = offset + len;
+	u64 next = offset;
+	int rc = 0;
+
+	if (offset % FAMFS_CP_DIRECT_ALIGN)
+		return FAMFS_CP_DIRECT_FALLBACK;
+
+	if (!ring) {
+		while (next < end) {
+			u64 want = MIN(FAMFS_CP_IO_SIZE, end - next);
+			ssize_t bytes;
+
+			bytes = pread(dsrcfd, &destp[next], roundup(want, FAMFS_CP_DIRECT_ALIGN),
+				      next);
+			if (bytes < 0 && errno == EINTR)
+				continue;
+			if (bytes < (ssize_t)want)
+				return FAMFS_CP_DIRECT_FALLBACK;
+			next += want;
+		}
+		return 0;
+	}
+
+	/* After an error nothing more is queued, so stop once the reads in flight are done */
+	while ((!rc && next < end) || inflight) {
+		u64 want;
+		s64 res;
+		int n;
+
+		while (!rc && next < end && inflight < FAMFS_CP_DIRECT_QDEPTH) {
+			want = MIN(FAMFS_CP_IO_SIZE, end - next);
+			famfs_uring_prep_read(ring, dsrcfd, &destp[next],
+					      roundup(want, FAMFS_CP_DIRECT_ALIGN), next, want);
+			next += want;
+			inflight++;
+			unsubmitted++;
+		}
+
+		if (mock_failure == MOCK_FAIL_URING_ENTER && inflight > unsubmitted) {
+			n = -1;
+			errno = EIO;
+		} else {
+			n = famfs_uring_enter(ring, unsubmitted, 1);
+		}
+		if (n < 0) {
+			int err = errno;
+
+			/* Reads that were submitted may still be writing into @destp; they must
+			 * not land after the caller re-reads the range, or unmaps it
+			 */
+			famfs_uring_drain(ring, inflight - unsubmitted);
+			errno = err;
+			return FAMFS_CP_RING_FAILED;
+		}
+		unsubmitted -= n;
+
+		while (famfs_uring_reap(ring, &want, &res)) {
+			inflight--;
+			if (res < (s64)want)
+				rc = FAMFS_CP_DIRECT_FALLBACK; /* error, or short of EOF */
+		}
+	}
+	return rc;
+}
+
+/**
+ * struct famfs_cp_file - a file queued for a famfs_cp_engine
+ *
+ * @next:         next file in the engine's queue (or its failed list)
+ * @dsrcfd:       the source opened with O_DIRECT, or -1
+ * @next_offset:  start of the next range to be claimed by a worker
+ * @nranges_left: ranges not yet copied
+ * @err:          first error copying a range of this file
+ * @id:           the caller's id for the file (see famfs_cp_engine_failed())
+ */
+struct famfs_cp_file {
+	struct famfs_cp_file *next;
+	int                   srcfd;
+	int                   dsrcfd;
+	int                   destfd;
+	char                 *destp;
+	u64                   size;
+	u64                   next_offset;
+	u64                   nranges_left;
+	int                   err;
+	u64                   id;
+	char                  destfile[];
+};
+
+static void *
+famfs_cp_worker(void *arg)
+{
+	struct famfs_cp_engine *ce = arg;
+	struct famfs_uring ring = { .fd = -1 };
+	struct famfs_uring *ringp = NULL;
+	char *bounce = NULL;
+
+	if (ce->direct && !famfs_uring_init(&ring, FAMFS_CP_DIRECT_QDEPTH)) {
+		ringp = &ring;
+		__atomic_fetch_add(&ce->nrings, 1, __ATOMIC_RELAXED);
+	}
+	if (ce->nt && posix_memalign((void **)&bounce, FAMFS_CP_DIRECT_ALIGN, FAMFS_CP_IO_SIZE)) {
+		fprintf(stderr, "%s: no bounce buffer; copying through the cache\n", __func__);
+		bounce = NULL;
+	}
+
+	while (1) {
+		struct famfs_cp_file *f;
+		int done, direct = 0;
+		u64 offset, len;
+		u64 holes = 0;
+		int rc;
+
+		/* Claim the next range */
+		pthread_mutex_lock(&ce->lock);
+		while (!ce->head && !ce->stopping)
+			pthread_cond_wait(&ce->work, &ce->lock);
+		f = ce->head;
+		if (!f) {
+			pthread_mutex_unlock(&ce->lock);
+			famfs_uring_exit(&ring);
+			free(bounce);
+			return NULL;
+		}
+		offset = f->next_offset;
+		len = MIN(ce->chunk, f->size - offset);
+		f->next_offset += len;
+		if (f->next_offset == f->size) {
+			ce->head = f->next;
+			if (!ce->head)
+				ce->tail = NULL;
+		}
+		pthread_mutex_unlock(&ce->lock);
+
+		if (f->dsrcfd >= 0) {
+			rc = famfs_cp_read_direct(ringp, f->dsrcfd, f->destp, offset, len);
+			if (rc == FAMFS_CP_RING_FAILED) {
+				/* famfs_cp_read_direct() reaped every read it submitted, so
+				 * tearing down the ring can't leave any in flight
+				 */
+				fprintf(stderr, "%s: io_uring failed (errno %d); using pread\n",
+					__func__, errno);
+				famfs_uring_exit(&ring);
+				ringp = NULL;
+			}
+			direct = (rc == 0);
+		}
+		if (direct) {
+			flush_processor_cache(&f->destp[offset], len);
+			rc = 0;
+		} else {
+			rc = famfs_cp_copy_range(f->srcfd, f->destp, offset, len, bounce,
+						 f->destfile, &holes);
+		}
+
+		pthread_mutex_lock(&ce->lock);
+		if (rc && !f->err)
+			f->err = rc;
+		if (direct)
+			ce->nbytes_direct += len;
+		ce->nbytes_holes += holes;
+		done = (--f->nranges_left == 0);
+		if (done && f->err) {
+			if (!ce->err)
+				ce->err = f->err;
+			f->next = ce->failed;
+			ce->failed = f;
+		}
+		if (done) {
+			ce->nfiles++;
+			ce->nbytes += f->size;
+			ce->ninflight--;
+			pthread_cond_broadcast(&ce->idle);
+		}
+		pthread_mutex_unlock(&ce->lock);
+
+		if (done) {
+			munmap(f->destp, f->size);
+			close(f->srcfd);
+			if (f->dsrcfd >= 0)
+				close(f->dsrcfd);
+			close(f->destfd);
+			if (!f->err)
+				free(f);
+		}
+	}
+}
+
+/**
+ * famfs_cp_engine_start() - start @nthreads copy workers
+ *
+ * @chunk:  size of the ranges that files are split into (0 for FAMFS_CP_CHUNK_DEFAULT)
+ * @direct: read sources with O_DIRECT where possible (@chunk is rounded up to
+ *          FAMFS_CP_DIRECT_ALIGN)
+ * @nt:     write file data with non-temporal stores (from a bounce buffer per worker)
+ *
+ * Returns 0 on success. Every started engine must be stopped with
+ * famfs_cp_engine_finish().
+ */
+int
+famfs_cp_engine_start(struct famfs_cp_engine *ce, int nthreads, u64 chunk, int direct, int nt)
 {
-	struct famfs_locked_log ll = { 0 };
-	char *cwd = get_current_dir_name();
-	char abspath[PATH_MAX];
-	char *rpath;
-	int rc;
-
-	/* dirpath as an indeterminate number of nonexistent dirs, under a path that
-	 * must exist. But the immediate parent may not exist. All existing elements
-	 * in the path must be dirs. By opening the log, we can get the mount point path...
-	 */
-
-	if (dirpath[0] == '/')
-		strncpy(abspath, dirpath, PATH_MAX - 1);
-	else
-		snprintf(abspath, PATH_MAX - 1, "%s/%s", cwd, dirpath);
-
-	if (verbose)
-		printf("%s: cwd %s abspath %s\n", __func__, cwd, abspath);
+	int t;
+
+	memset(ce, 0, sizeof(*ce));
+	ce->chunk = (chunk) ? chunk : FAMFS_CP_CHUNK_DEFAULT;
+	ce->direct = direct;
+	ce->nt = nt;
+	if (direct)
+		ce->chunk = roundup(ce->chunk, FAMFS_CP_DIRECT_ALIGN);
+	ce->threads = calloc(nthreads, sizeof(*ce->threads));
+	if (!ce->threads)
+		return -1;
+	pthread_mutex_init(&ce->lock, NULL);
+	pthread_cond_init(&ce->work, NULL);
+	pthread_cond_init(&ce->idle, NULL);
 
-	rpath = find_real_parent_path(abspath);
-	if (!rpath) {
-		fprintf(stderr, "%s: failed to find real parent dir\n", __func__);
+	for (t = 0; t < nthreads; t++) {
+		if (pthread_create(&ce->threads[t], NULL, famfs_cp_worker, ce))
+			break;
+		ce->nthreads++;
+	}
+	if (!ce->nthreads) {
+		fprintf(stderr, "%s: failed to start any copy threads\n", __func__);
+		famfs_cp_engine_finish(ce);
 		return -1;
 	}
+	return 0;
+}
 
-	/* OK, we know were in a FAMFS instance. get a locked log struct */
-	rc = famfs_init_locked_log(&ll, rpath, verbose);
-	if (rc) {
-		free(rpath);
-		return rc;
-	}
+/**
+ * famfs_cp_engine_queue() - queue a created and mapped file to be copied
+ *
+ * Once the file is queued, the engine owns @srcfd, @dsrcfd (the source opened with
+ * O_DIRECT, or -1), @destfd and @destp, and unmaps and closes them after the copy.
+ * Waits while FAMFS_CP_MAX_INFLIGHT files are being copied.
+ *
+ * @id - reported by famfs_cp_engine_failed() if the file is not copied completely
+ *
+ * Returns 0 if the file was queued, or -ENOMEM if not (the caller still owns it)
+ */
+int
+famfs_cp_engine_queue(
+	struct famfs_cp_engine *ce,
+	int                     srcfd,
+	int                     dsrcfd,
+	int                     destfd,
+	char                   *destp,
+	u64                     size,
+	const char             *destfile,
+	u64                     id)
+{
+	struct famfs_cp_file *f = calloc(1, sizeof(*f) + strlen(destfile) + 1);
 
-	/* Now recurse up fromm abspath till we find an existing parent, and mkdir back down */
-	rc = famfs_make_parent_dir(&ll, abspath, mode, uid, gid, 0, verbose);
+	assert(size > 0);
+	if (!f)
+		return -ENOMEM;
+	f->srcfd = srcfd;
+	f->dsrcfd = dsrcfd;
+	f->destfd = destfd;
+	f->destp = destp;
+	f->size = size;
+	f->nranges_left = (size + ce->chunk - 1) / ce->chunk;
+	f->id = id;
+	strcpy(f->destfile, destfile);
+
+	pthread_mutex_lock(&ce->lock);
+	while (ce->ninflight >= FAMFS_CP_MAX_INFLIGHT)
+		pthread_cond_wait(&ce->idle, &ce->lock);
+	if (ce->tail)
+		ce->tail->next = f;
+	else
+		ce->head = f;
+	ce->tail = f;
+	ce->ninflight++;
+	pthread_cond_broadcast(&ce->work);
+	pthread_mutex_unlock(&ce->lock);
+	return 0;
+}
 
-	/* Separate function should release ll and lock */
-	famfs_release_locked_log(&ll);
-	free(rpath);
-	if (cwd)
-		free(cwd);
+/**
+ * famfs_cp_engine_finish() - wait until everything queued has been copied, then stop
+ *                            the workers
+ *
+ * Returns 0 if every copy succeeded, else the first error (negative)
+ */
+int
+famfs_cp_engine_finish(struct famfs_cp_engine *ce)
+{
+	int t;
+
+	pthread_mutex_lock(&ce->lock);
+	ce->stopping = 1;
+	pthread_cond_broadcast(&ce->work);
+	pthread_mutex_unlock(&ce->lock);
+
+	for (t = 0; t < ce->nthreads; t++)
+		pthread_join(ce->threads[t], NULL);
+	assert(ce->ninflight == 0);
+
+	pthread_mutex_destroy(&ce->lock);
+	pthread_cond_destroy(&ce->work);
+	pthread_cond_destroy(&ce->idle);
+	free(ce->threads);
+	ce->threads = NULL;
+	return ce->err;
+}
 
-	return rc;
+/**
+ * famfs_cp_engine_failed() - after famfs_cp_engine_finish(), get the id of a file that
+ *                            was not copied completely
+ *
+ * Returns 1 and sets @id_out if there is one (each is returned once), else 0
+ */
+int
+famfs_cp_engine_failed(struct famfs_cp_engine *ce, u64 *id_out)
+{
+	struct famfs_cp_file *f = ce->failed;
+
+	if (!f)
+		return 0;
+	ce->failed = f->next;
+	*id_out = f->id;
+	free(f);
+	return 1;
 }
 
 /**
@@ -3076,10 +5166,9 @@ __famfs_cp(
 	gid_t                     gid,
 	int                       verbose)
 {
-	size_t chunksize, remainder, offset;
 	int rc, srcfd, destfd;
 	struct stat srcstat;
-	ssize_t bytes;
+	u64 holes = 0;
 	char *destp;
 
 	assert(lp);
@@ -3124,15 +5213,16 @@ __famfs_cp(
 		return 1;
 	}
 
-	/* XXX famfs_mkfile() calls famfs_file_alloc()
-	 * famfs_file_alloc() allocates and logs the file under log lock
-	 * but this function copies the data into the file after the log lock is released
-	 * Need a way of holding the lock until the data is copied.
+	/* __famfs_mkfile() allocates the file and logs it under the log lock. Clients can't
+	 * see a file before its data is copied as long as the entry goes into a log txn
+	 * that is committed after the copy; famfs_cp_multi() does that, and defers the
+	 * txn so the lock need not be held while copying.
 	 */
 	destfd = __famfs_mkfile(lp, destfile, (mode == 0) ? srcstat.st_mode : mode,
 				uid, gid, srcstat.st_size, verbose);
 	if (destfd <= 0) {
 		fprintf(stderr, "%s: failed in __famfs_mkfile\n", __func__);
+		close(srcfd);
 		return destfd;
 	}
 
@@ -3141,44 +5231,51 @@ __famfs_cp(
 			mock_failure == MOCK_FAIL_MMAP) {
 		fprintf(stderr, "%s: dest mmap failed (%s) size %ld\n",
 			__func__, destfile, srcstat.st_size);
+		if (destp != MAP_FAILED)
+			munmap(destp, srcstat.st_size);
+		close(srcfd);
+		close(destfd);
 		unlink(destfile);
+		/* A held entry for the file is dropped with it */
+		if (lp->txn && lp->txn->deferred)
+			lp->txn->nentries--;
 		return -1; /* XXX */
 	}
 
-	/* Copy the data */
-	chunksize = 0x100000; /* 1 MiB copy chunks */
-	offset = 0;
-	remainder = srcstat.st_size;
-	for ( ; remainder > 0; ) {
-		size_t cur_chunksize = MIN(chunksize, remainder);
-
-		/* read into mmapped destination */
-		bytes = read(srcfd, &destp[offset], cur_chunksize);
-		if (bytes < 0) {
-			fprintf(stderr, "%s: copy fail: "
-				"ofs %ld cur_chunksize %ld remainder %ld\n",
-				__func__, offset, cur_chunksize, remainder);
-			printf("rc=%ld errno=%d\n", bytes, errno);
-			munmap(destp, srcstat.st_size);
-			return -1;
-		}
-		if (bytes < cur_chunksize) {
-			fprintf(stderr, "%s: short read: "
-				"ofs %ld cur_chunksize %ld remainder %ld\n",
-				__func__, offset, cur_chunksize, remainder);
-		}
+	/* With a copy engine, the data is copied (and the files closed) by its workers.
+	 * The file's held log entry is the txn's last; if the copy fails, the entry is
+	 * dropped and the file unlinked rather than published (see famfs_cp_multi())
+	 */
+	if (lp->cp) {
+		/* Not every file system supports O_DIRECT; if not, dsrcfd is -1 and the
+		 * file is read through the page cache
+		 */
+		int dsrcfd = (lp->cp->direct) ? open(srcfile, O_RDONLY | O_DIRECT) : -1;
 
-		/* Update offset and remainder */
-		offset += bytes;
-		remainder -= bytes;
+		assert(lp->txn && lp->txn->deferred && lp->txn->nentries);
+		rc = famfs_cp_engine_queue(lp->cp, srcfd, dsrcfd, destfd, destp,
+					   srcstat.st_size, destfile, lp->txn->nentries - 1);
+		if (!rc)
+			return 0;
+		if (dsrcfd >= 0)
+			close(dsrcfd);
+		munmap(destp, srcstat.st_size);
+		close(srcfd);
+		close(destfd);
+		famfs_log_txn_abandon(lp->txn, lp->mpt, lp->txn->nentries - 1);
+		return rc;
 	}
-	/* Flush the processor cache for the dest file */
-	flush_processor_cache(destp, srcstat.st_size);
+
+	/* Copy the data */
+	rc = famfs_cp_copy_range(srcfd, destp, 0, srcstat.st_size, NULL, destfile, &holes);
+	if (!rc && verbose && holes)
+		printf("%s: %s: %lld bytes of source holes skipped (zeroed)\n",
+		       __func__, destfile, holes);
 
 	munmap(destp, srcstat.st_size);
 	close(srcfd);
 	close(destfd);
-	return 0;
+	return (rc) ? -1 : 0;
 }
 
 /**
@@ -3362,6 +5459,24 @@ bailout:
 	return err;
 }
 
+/*
+ * Unlink the files of the entries held by the deferred @txn (all of them, or those
+ * whose @failed flag is set), and drop the entries. An entry whose file can't be
+ * unlinked is kept. Returns 0 if all of them were dropped
+ */
+static int
+famfs_cp_abandon(struct famfs_log_txn *txn, const char *mpt, const u8 *failed)
+{
+	s64 i;
+	int rc = 0;
+
+	/* Dropping an entry moves the ones after it, so go from the end */
+	for (i = txn->nentries - 1; i >= 0; i--)
+		if ((!failed || failed[i]) && famfs_log_txn_abandon(txn, mpt, i))
+			rc = -1;
+	return rc;
+}
+
 /**
  * famfs_cp_multi()
  *
@@ -3373,6 +5488,13 @@ bailout:
  * @uid
  * @gid
  * @recursive - Recursive copy if true
+ * @nthreads  - copy file data with this many threads (see struct famfs_cp_engine)
+ * @chunk     - split files into ranges of this size for the threads (0 for
+ *              FAMFS_CP_CHUNK_DEFAULT)
+ * @direct    - read source files with O_DIRECT (via io_uring if available), bypassing
+ *              the page cache
+ * @nt        - write file data with non-temporal stores instead of through the cache
+ *              (and flushing it afterward)
  * @verbose -
  *
  * Rules:
@@ -3401,11 +5523,20 @@ famfs_cp_multi(
 	uid_t uid,
 	gid_t gid,
 	int recursive,
+	int nthreads,
+	u64 chunk,
+	int direct,
+	int nt,
 	int verbose)
 {
 	struct famfs_locked_log ll = { 0 };
+	struct timespec cp_start, cp_end;
+	struct famfs_cp_engine ce;
+	int locked = 1;
+	u64 nentries;
 	char *dest = argv[argc - 1];
 	int src_argc = argc - 1;
+	struct famfs_log_txn txn;
 	char *dirdupe   = NULL;
 	char *parentdir = NULL;
 	char *dest_parent_path;
@@ -3489,6 +5620,26 @@ famfs_cp_multi(
 		return rc;
 	}
 
+	/* Log entries for the whole copy are published together, so clients see all of
+	 * it or none of it
+	 */
+	famfs_log_txn_begin(&txn, &ll);
+	ll.txn = &txn;
+
+	/* Two-phase create: files are allocated and created under the log lock, but their
+	 * data is copied by the engine, and the log entries are deferred. The space is
+	 * reserved and the lock dropped while the data is copied, so concurrent copies
+	 * are not serialized; the entries are published (under the lock again) once the
+	 * data is in place. Without the engine, everything is done under the lock.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &cp_start);
+	if (famfs_cp_engine_start(&ce, nthreads, chunk, direct, nt)) {
+		fprintf(stderr, "%s: copying single-threaded\n", __func__);
+	} else {
+		ll.cp = &ce;
+		famfs_log_txn_defer(&txn);
+	}
+
 	for (i = 0; i < src_argc; i++) {
 		struct stat src_stat;
 
@@ -3548,6 +5699,97 @@ famfs_cp_multi(
 	}
 
 err_out:
+	if (ll.cp) {
+		char mpt[PATH_MAX];
+		u64 id;
+
+		/* Unless the reservations can't be saved, release the lock while copying */
+		strcpy(mpt, ll.mpt);
+		ll.txn = NULL;
+		locked = !!famfs_reservation_save(&ll, &txn);
+		if (!locked)
+			famfs_release_locked_log(&ll);
+
+		/* The log entries are not published until all of the data has been copied */
+		rc = famfs_cp_engine_finish(&ce);
+		if (rc && err >= 0)
+			err = rc;
+		clock_gettime(CLOCK_MONOTONIC, &cp_end);
+		if (verbose) {
+			double elapsed = (cp_end.tv_sec - cp_start.tv_sec) +
+				(cp_end.tv_nsec - cp_start.tv_nsec) / 1e9;
+
+			printf("%s: copied %lld files (%lld bytes) with %d threads in %.3f sec: "
+			       "%.0f bytes/sec (%s)\n", __func__, ce.nfiles, ce.nbytes,
+			       ce.nthreads, elapsed, ce.nbytes / elapsed,
+			       (ce.nt) ? "non-temporal stores" : "cached stores + flush");
+		}
+		if (verbose && direct)
+			printf("%s: %lld bytes read with O_DIRECT (%d threads using io_uring)\n",
+			       __func__, ce.nbytes_direct, ce.nrings);
+		if (verbose && ce.nbytes_holes)
+			printf("%s: %lld bytes of source holes skipped (zeroed)\n",
+			       __func__, ce.nbytes_holes);
+		ll.cp = NULL;
+
+		if (!locked && famfs_init_locked_log(&ll, dest_parent_path, verbose)) {
+			/* Nothing can be published, so unlink the files. Their space stays
+			 * reserved until the next writer finds that this process has exited
+			 */
+			fprintf(stderr, "%s: unable to re-lock the log; %lld files not published\n",
+				__func__, txn.nentries);
+			famfs_cp_abandon(&txn, mpt, NULL);
+			while (famfs_cp_engine_failed(&ce, &id))
+				;
+			famfs_log_txn_discard(&txn);
+			free(dirdupe);
+			free(dest_parent_path);
+			return -1;
+		}
+		txn.logp = ll.logp; /* the log may be mapped at a new address */
+
+		/* Files that were not copied completely are unlinked, not published */
+		if (ce.failed) {
+			u8 *failed = calloc(txn.nentries, 1);
+
+			while (famfs_cp_engine_failed(&ce, &id))
+				if (failed)
+					failed[id] = 1;
+			if (!failed) {
+				/* Drop every file rather than publish a partial one */
+				fprintf(stderr, "%s: out of memory; not publishing\n", __func__);
+				err = -ENOMEM;
+			}
+			if (famfs_cp_abandon(&txn, ll.mpt, failed) && err >= 0)
+				err = -1;
+			free(failed);
+		}
+	}
+
+	/* Even on error, publish whatever was copied (those files already exist here) */
+	ll.txn = NULL;
+	if (verbose)
+		printf("%s: publishing %lld log entries\n", __func__, txn.nentries);
+	nentries = txn.nentries;
+	if (famfs_log_txn_commit(&txn) < nentries) {
+		/* The log slots were reserved, so this should not happen; don't leave the
+		 * files allocated but unpublished
+		 */
+		famfs_cp_abandon(&txn, ll.mpt, NULL);
+		if (err >= 0)
+			err = -ENOMEM;
+	}
+	if (txn.deferred) {
+		/* Entries whose files could not be unlinked stay reserved, and are
+		 * recovered once this process exits
+		 */
+		if (txn.nentries)
+			famfs_reservation_save(&ll, &txn);
+		else
+			famfs_reservation_release(&ll);
+		famfs_log_txn_discard(&txn);
+	}
+
 	/* Separate function should release ll and lock */
 	free(dirdupe);
 	famfs_release_locked_log(&ll);
@@ -3568,6 +5810,7 @@ famfs_clone(const char *srcfile,
 	    int   verbose)
 {
 	struct famfs_ioc_map filemap = {0};
+	struct famfs_locked_log ll = { 0 };
 	struct famfs_extent *ext_list = NULL;
 	char srcfullpath[PATH_MAX];
 	char destfullpath[PATH_MAX];
@@ -3676,6 +5919,16 @@ famfs_clone(const char *srcfile,
 
 	/* Clone is only allowed on the master, so we don't need to invalidate the cache */
 
+	/* The log append must leave the slots of deferred writers' reservations free */
+	ll.logp = logp;
+	memcpy(&ll.fs_uuid, &dest_fs_uuid, sizeof(ll.fs_uuid));
+	strncpy(ll.mpt, mpt_out, PATH_MAX - 1);
+	if (famfs_reservation_load(&ll, verbose)) {
+		fprintf(stderr, "%s: unable to load allocation reservations\n", __func__);
+		rc = -1;
+		goto err_out;
+	}
+
 	/* Create the destination file. This will be unlinked later if we don't get all
 	 * the way through the operation.
 	 */
@@ -3715,7 +5968,7 @@ famfs_clone(const char *srcfile,
 		goto err_out;
 	}
 
-	rc = famfs_log_file_creation(logp, filemap.ext_list_count, se,
+	rc = famfs_log_file_creation(&ll, filemap.ext_list_count, se,
 				     relpath, src_stat.st_mode, src_stat.st_uid, src_stat.st_gid,
 				     filemap.file_size);
 	if (rc) {
@@ -3733,6 +5986,7 @@ famfs_clone(const char *srcfile,
 	/***************/
 
 err_out:
+	free(ll.resv);
 	free(ext_list);
 	free(se);
 	if (lfd > 0)
@@ -4069,3 +6323,326 @@ famfs_flush_file(const char *filename, int verbose)
 	hard_flush_processor_cache(addr, size);
 	return 0;
 }
+
+/**
+ * struct famfs_flush_pool - regular files to flush, split into chunks for a worker pool
+ *
+ * @files:   paths of the files to flush
+ * @chunks:  work items; each covers up to FAMFS_FLUSH_CHUNK_SIZE bytes of one file
+ * @next:    index of the next chunk to be claimed by a worker
+ * @nerrs:   number of errors (collection and flushing)
+ * @nbytes:  total bytes covered by @chunks
+ * @mode:    how to flush each chunk
+ */
+struct famfs_flush_chunk {
+	u32 file;
+	u64 offset;
+	u64 len;
+};
+
+struct famfs_flush_pool {
+	char                    **files;
+	u32                       nfiles;
+	u32                       files_alloc;
+	struct famfs_flush_chunk *chunks;
+	u64                       nchunks;
+	u64                       chunks_alloc;
+	u64                       next;
+	int                       nerrs;
+	u64                       nbytes;
+	enum famfs_flush_mode     mode;
+	int                       verbose;
+};
+
+static int
+famfs_flush_pool_add_file(
+	struct famfs_flush_pool *pool,
+	const char              *path,
+	u64                      size)
+{
+	u64 nchunks = (size + FAMFS_FLUSH_CHUNK_SIZE - 1) / FAMFS_FLUSH_CHUNK_SIZE;
+	u64 i;
+
+	if (pool->nfiles == pool->files_alloc) {
+		u32 n = (pool->files_alloc) ? 2 * pool->files_alloc : 64;
+		char **files = realloc(pool->files, n * sizeof(*files));
+
+		if (!files)
+			return -1;
+		pool->files = files;
+		pool->files_alloc = n;
+	}
+	if (pool->nchunks + nchunks > pool->chunks_alloc) {
+		u64 n = MAX(2 * pool->chunks_alloc, pool->nchunks + nchunks + 64);
+		struct famfs_flush_chunk *chunks = realloc(pool->chunks, n * sizeof(*chunks));
+
+		if (!chunks)
+			return -1;
+		pool->chunks = chunks;
+		pool->chunks_alloc = n;
+	}
+
+	pool->files[pool->nfiles] = strdup(path);
+	if (!pool->files[pool->nfiles])
+		return -1;
+
+	for (i = 0; i < nchunks; i++) {
+		struct famfs_flush_chunk *c = &pool->chunks[pool->nchunks++];
+
+		c->file = pool->nfiles;
+		c->offset = i * FAMFS_FLUSH_CHUNK_SIZE;
+		c->len = MIN(FAMFS_FLUSH_CHUNK_SIZE, size - c->offset);
+	}
+	pool->nfiles++;
+	pool->nbytes += size;
+	return 0;
+}
+
+/**
+ * famfs_flush_pool_add_path()
+ *
+ * Add @path to the pool if it is a regular file. If it is a directory and @recursive
+ * is set, add every regular file beneath it. Anything else is an error (as with
+ * famfs_flush_file()), except non-file/dir entries found while recursing, which are
+ * skipped. @path itself is followed if it is a symlink, but symlinks found while
+ * recursing are not (as with nftw(FTW_PHYS)), so a link can't make the walk revisit
+ * files or loop.
+ */
+static void
+famfs_flush_pool_add_path(
+	struct famfs_flush_pool *pool,
+	const char              *path,
+	int                      recursive,
+	int                      depth)
+{
+	struct dirent *entry;
+	DIR *directory;
+	struct stat st;
+
+	if ((depth ? lstat(path, &st) : stat(path, &st)) < 0) {
+		fprintf(stderr, "%s: file not found (%s)\n", __func__, path);
+		pool->nerrs++;
+		return;
+	}
+
+	switch (st.st_mode & S_IFMT) {
+	case S_IFREG:
+		if (famfs_flush_pool_add_file(pool, path, st.st_size)) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			pool->nerrs++;
+		}
+		return;
+
+	case S_IFDIR:
+		if (recursive)
+			break;
+		/* fallthrough */
+	default:
+		if (depth)
+			return;
+		if (pool->verbose)
+			fprintf(stderr, "%s: not a regular file: (%s)\n", __func__, path);
+		pool->nerrs++;
+		return;
+	}
+
+	directory = opendir(path);
+	if (!directory) {
+		fprintf(stderr, "%s: failed to open dir (%s)\n", __func__, path);
+		pool->nerrs++;
+		return;
+	}
+	while ((entry = readdir(directory)) != NULL) {
+		char fullpath[PATH_MAX];
+
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		snprintf(fullpath, PATH_MAX - 1, "%s/%s", path, entry->d_name);
+		famfs_flush_pool_add_path(pool, fullpath, recursive, depth + 1);
+	}
+	closedir(directory);
+}
+
+/**
+ * __famfs_flush_range()
+ *
+ * Map only the pages that cover [@offset, @offset + @len) of @path, and apply @mode to
+ * the cache lines of that range.
+ */
+static int
+__famfs_flush_range(
+	const char           *path,
+	u64                   offset,
+	u64                   len,
+	enum famfs_flush_mode mode,
+	int                   verbose)
+{
+	u64 pgsize = sysconf(_SC_PAGESIZE);
+	u64 map_offset = offset & ~(pgsize - 1);
+	u64 map_len = offset + len - map_offset;
+	char *addr;
+	int fd;
+
+	if (!len)
+		return 0;
+
+	fd = open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to open %s (%s)\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	addr = mmap(0, map_len, PROT_READ, MAP_SHARED, fd, map_offset);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: failed to mmap %s (%s)\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	if (verbose > 1)
+		printf("%s: flushing: %s [%lld, %lld)\n", __func__, path, offset, offset + len);
+
+	switch (mode) {
+	case FAMFS_FLUSH_WRITEBACK:
+		/* This host wrote the range and is handing it off */
+		writeback_processor_cache(addr + (offset - map_offset), len);
+		break;
+	case FAMFS_FLUSH_INVALIDATE:
+		/* This host is about to read a range that was written elsewhere */
+		invalidate_processor_cache(addr + (offset - map_offset), len);
+		break;
+	case FAMFS_FLUSH_HARD:
+	default:
+		/* We don't know caller needs a flush or an invalidate, so barriers on both sides */
+		hard_flush_processor_cache(addr + (offset - map_offset), len);
+		break;
+	}
+	munmap(addr, map_len);
+	return 0;
+}
+
+/**
+ * famfs_flush_range()
+ *
+ * Flush or invalidate the processor cache for part of a file, e.g. the region that a
+ * producer has mutated before handing the file to another host. Only the pages that
+ * cover the range are mapped, so the cost is proportional to @len rather than the size
+ * of the file.
+ *
+ * @path:   regular file
+ * @offset: start of the range (need not be aligned)
+ * @len:    length of the range; 0 means through the end of the file
+ * @mode:   FAMFS_FLUSH_WRITEBACK after writing the range, FAMFS_FLUSH_INVALIDATE before
+ *          reading it, or FAMFS_FLUSH_HARD if the caller doesn't know
+ *
+ * Returns 0 on success, -1 on error (including a range that extends past end of file)
+ */
+int
+famfs_flush_range(
+	const char           *path,
+	u64                   offset,
+	u64                   len,
+	enum famfs_flush_mode mode)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		fprintf(stderr, "%s: file not found (%s)\n", __func__, path);
+		return -1;
+	}
+	if ((st.st_mode & S_IFMT) != S_IFREG) {
+		fprintf(stderr, "%s: not a regular file: (%s)\n", __func__, path);
+		return -1;
+	}
+	if (offset > (u64)st.st_size || len > (u64)st.st_size - offset) {
+		fprintf(stderr, "%s: range [%lld, %lld) is beyond end of file %s (%lld)\n",
+			__func__, offset, offset + len, path, (u64)st.st_size);
+		return -1;
+	}
+	if (!len)
+		len = st.st_size - offset;
+
+	return __famfs_flush_range(path, offset, len, mode, 0);
+}
+
+static void *
+famfs_flush_worker(void *arg)
+{
+	struct famfs_flush_pool *pool = arg;
+	u64 i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->nchunks) {
+		struct famfs_flush_chunk *c = &pool->chunks[i];
+
+		if (__famfs_flush_range(pool->files[c->file], c->offset, c->len, pool->mode,
+					pool->verbose))
+			__atomic_fetch_add(&pool->nerrs, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/**
+ * famfs_flush_files()
+ *
+ * Flush/invalidate the processor cache for a set of files. Files are split into
+ * FAMFS_FLUSH_CHUNK_SIZE chunks which are flushed by a pool of @nthreads workers, so a
+ * single large file and a tree of many files are both flushed in parallel.
+ *
+ * @nfiles:    number of paths in @files
+ * @files:     paths of files (or directories, if @recursive)
+ * @recursive: flush every regular file in any directories in @files
+ * @mode:      see famfs_flush_range()
+ * @nthreads:  number of worker threads
+ * @verbose:
+ *
+ * Returns the number of errors (0=complete success)
+ */
+int
+famfs_flush_files(
+	int                   nfiles,
+	char                **files,
+	int                   recursive,
+	enum famfs_flush_mode mode,
+	int                   nthreads,
+	int                   verbose)
+{
+	struct famfs_flush_pool pool = { 0 };
+	pthread_t *threads = NULL;
+	int nstarted = 0;
+	u32 i;
+	int t;
+
+	pool.mode = mode;
+	pool.verbose = verbose;
+	for (t = 0; t < nfiles; t++)
+		famfs_flush_pool_add_path(&pool, files[t], recursive, 0);
+
+	nthreads = MAX(1, MIN((u64)nthreads, pool.nchunks));
+	if (nthreads > 1) {
+		threads = calloc(nthreads - 1, sizeof(*threads));
+		if (!threads)
+			fprintf(stderr, "%s: out of memory; flushing single-threaded\n", __func__);
+	}
+	for (t = 0; threads && t < nthreads - 1; t++) {
+		if (pthread_create(&threads[t], NULL, famfs_flush_worker, &pool))
+			break;
+		nstarted++;
+	}
+
+	/* The calling thread helps (and does all the work if no threads were started) */
+	famfs_flush_worker(&pool);
+	for (t = 0; t < nstarted; t++)
+		pthread_join(threads[t], NULL);
+
+	if (verbose)
+		printf("%s: flushed %lld bytes in %d files (%lld chunks, %d threads)\n",
+		       __func__, pool.nbytes, pool.nfiles, pool.nchunks, nstarted + 1);
+
+	for (i = 0; i < pool.nfiles; i++)
+		free(pool.files[i]);
+	free(pool.files);
+	free(pool.chunks);
+	free(threads);
+	return pool.nerrs;
+}
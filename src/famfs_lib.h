@@ -24,6 +24,13 @@ enum famfs_extent_type {
 };
 #endif
 
+/* Cache maintenance for famfs_flush_range() and famfs_flush_files() */
+enum famfs_flush_mode {
+	FAMFS_FLUSH_HARD = 0,   /* write back and invalidate, with barriers on both sides */
+	FAMFS_FLUSH_WRITEBACK,  /* make this host's writes visible to other hosts */
+	FAMFS_FLUSH_INVALIDATE, /* make other hosts' writes visible to this host */
+};
+
 int famfs_module_loaded(int verbose);
 void *famfs_mmap_whole_file(const char *fname, int read_only, size_t *sizep);
 
@@ -36,12 +43,13 @@ int famfs_get_system_uuid(uuid_le *uuid_out);
 int famfs_mkmeta(const char *devname);
 u64 famfs_alloc(const char *devname, u64 size);
 int famfs_logplay(const char *mpt, int use_mmap,
-		  int dry_run, int client_mode, int verbose);
+		  int dry_run, int client_mode, int use_cursor, int nthreads, int verbose);
 
 int famfs_mkfile(const char *filename, mode_t mode, uid_t uid, gid_t gid, size_t size, int verbose);
 
-int famfs_cp_multi(int argc, char *argv[],
-		   mode_t mode, uid_t uid, gid_t gid, int recursive, int verbose);
+int famfs_cp_multi(int argc, char *argv[], mode_t mode, uid_t uid, gid_t gid,
+		   int recursive, int nthreads, u64 chunk, int direct, int nt,
+		   int verbose);
 int famfs_clone(const char *srcfile, const char *destfile, int verbose);
 
 int famfs_mkdir(const char *dirpath, mode_t mode, uid_t uid, gid_t gid, int verbose);
@@ -52,5 +60,8 @@ int famfs_check(const char *path, int verbose);
 void famfs_dump_log(struct famfs_log *logp);
 void famfs_dump_super(struct famfs_superblock *sb);
 int famfs_flush_file(const char *filename, int verbose);
+int famfs_flush_files(int nfiles, char **files, int recursive, enum famfs_flush_mode mode,
+		      int nthreads, int verbose);
+int famfs_flush_range(const char *path, u64 offset, u64 len, enum famfs_flush_mode mode);
 
 #endif /* _H_FAMFS_LIB */
@@ -6,6 +6,8 @@
 #ifndef _H_FAMFS_LIB_INTERNAL
 #define _H_FAMFS_LIB_INTERNAL
 
+#include <pthread.h>
+
 #include "famfs_meta.h"
 
 enum lock_opt {
@@ -27,15 +29,245 @@ enum mock_failure {
 	MOCK_FAIL_SROLE,
 	MOCK_FAIL_OPEN,
 	MOCK_FAIL_MMAP,
+	MOCK_FAIL_URING_ENTER,
+};
+
+/**
+ * struct famfs_logplay_cursor - per-node record of how far the log has been played
+ *
+ * This lives on local storage (not in the shared log), so each node can skip log
+ * entries that it has already applied to the current mount of a file system.
+ *
+ * @lc_magic:           FAMFS_LOGPLAY_CURSOR_MAGIC
+ * @lc_fs_uuid:         uuid of the file system the cursor applies to
+ * @lc_meta_ino:        inode number of the .meta dir (identifies the mount instance)
+ * @lc_meta_ctime_sec:  ctime of the .meta dir (identifies the mount instance)
+ * @lc_meta_ctime_nsec:
+ * @lc_log_hdr_crc:     crc of the log header when the cursor was saved
+ * @lc_next_index:      index of the first log entry that has not been played
+ * @lc_last_seqnum:     seqnum of the entry at (@lc_next_index - 1)
+ * @lc_last_crc:        crc of the entry at (@lc_next_index - 1)
+ * @lc_crc:             crc which covers the preceding fields
+ */
+#define FAMFS_LOGPLAY_CURSOR_MAGIC 0xc0c0fa3f
+#define FAMFS_LOCAL_STATE_DIR      "/opt/famfs" /* per-node state (not in famfs) */
+
+struct famfs_logplay_cursor {
+	u64           lc_magic;
+	uuid_le       lc_fs_uuid;
+	u64           lc_meta_ino;
+	s64           lc_meta_ctime_sec;
+	s64           lc_meta_ctime_nsec;
+	unsigned long lc_log_hdr_crc;
+	u64           lc_next_index;
+	u64           lc_last_seqnum;
+	unsigned long lc_last_crc;
+	unsigned long lc_crc;
+};
+
+/**
+ * struct famfs_bitmap_snapshot - master's cached allocation bitmap
+ *
+ * Stored on the master's local storage, followed by mu_bitmap_size(@bs_nbits) bytes of
+ * bitmap. The bitmap reflects log entries [0, @bs_next_index).
+ *
+ * @bs_magic:       FAMFS_BITMAP_SNAPSHOT_MAGIC
+ * @bs_fs_uuid:     uuid of the file system the snapshot applies to
+ * @bs_nbits:       number of bits in the bitmap
+ * @bs_log_hdr_crc: crc of the log header when the snapshot was saved
+ * @bs_next_index:  first log entry that is not reflected in the bitmap
+ * @bs_last_seqnum: seqnum of the entry at (@bs_next_index - 1)
+ * @bs_last_crc:    crc of the entry at (@bs_next_index - 1)
+ * @bs_bitmap_crc:  crc of the bitmap
+ * @bs_crc:         crc which covers the preceding fields
+ */
+#define FAMFS_BITMAP_SNAPSHOT_MAGIC 0xb17b17fa
+
+struct famfs_bitmap_snapshot {
+	u64           bs_magic;
+	uuid_le       bs_fs_uuid;
+	u64           bs_nbits;
+	unsigned long bs_log_hdr_crc;
+	u64           bs_next_index;
+	u64           bs_last_seqnum;
+	unsigned long bs_last_crc;
+	unsigned long bs_bitmap_crc;
+	unsigned long bs_crc;
+};
+
+/* famfs_flush_files() hands files to its workers in chunks of this size */
+#define FAMFS_FLUSH_CHUNK_SIZE (64ULL * 1024 * 1024)
+
+/**
+ * struct famfs_free_index - first-fit index of free runs in the allocation bitmap
+ *
+ * @nruns:   number of free runs found when the index was built
+ * @nleaves: number of leaves in the @max_len tree (power of 2 >= @nruns)
+ * @runs:    free runs in offset order, in allocation units
+ * @max_len: implicit binary tree (root at [1]; leaves at [@nleaves + i]) where each
+ *           node holds the longest run in its subtree
+ */
+struct famfs_free_run {
+	u64 start;
+	u64 len;
+};
+
+struct famfs_free_index {
+	u64                    nruns;
+	u64                    nleaves;
+	struct famfs_free_run *runs;
+	u64                   *max_len;
+};
+
+/**
+ * struct famfs_log_txn - log entries that are published together
+ *
+ * Entries are staged in the log slots starting at @start_index (beyond the end of the
+ * log as readers see it) and become visible when famfs_log_txn_commit() advances the
+ * log header past all of them.
+ *
+ * A deferred txn (famfs_log_txn_defer()) holds its entries in memory instead, so the
+ * log lock can be dropped and re-taken before they are published. Its allocations are
+ * meanwhile protected by reservations (struct famfs_reservation).
+ *
+ * @logp:         the log
+ * @start_index:  log index of the first staged entry
+ * @start_seqnum: seqnum of the first staged entry
+ * @nentries:     number of entries staged
+ * @deferred:     entries are held in @entries until commit
+ * @reserved:     log slots that other writers have reserved, which must be left free
+ * @entries:      deferred entries
+ * @max_entries:  allocated size of @entries
+ */
+struct famfs_log_txn {
+	struct famfs_log       *logp;
+	u64                     start_index;
+	u64                     start_seqnum;
+	u64                     nentries;
+	int                     deferred;
+	u64                     reserved;
+	struct famfs_log_entry *entries;
+	u64                     max_entries;
+};
+
+/**
+ * struct famfs_reservation - a log entry that a writer holds but has not published yet
+ *
+ * famfs cp creates and allocates files under the log lock, but releases the lock while
+ * their data is copied, and re-takes it to publish the (deferred) log entries. In
+ * between, the held entries are recorded in the master's local reservation file (all
+ * writers run on the master), and every locked log treats their extents as allocated
+ * and leaves a log slot free for each of them.
+ *
+ * A record lasts until its entry is published, or its file is unlinked. The records
+ * of a process that exited are recovered by the next writer to lock the log: a record
+ * whose entry (or a later entry for the same path) is in the log is dropped; otherwise
+ * the file is unlinked (nothing refers to its space) and then the record is dropped.
+ *
+ * The file is a u64 FAMFS_RESERVATION_MAGIC and a u64 record count, then the records.
+ *
+ * @rv_pid:       the process that will publish the entry
+ * @rv_start:     its start time (field 22 of /proc/<pid>/stat); a process with the
+ *                same pid but a different start time does not own the record
+ * @rv_log_index: the log's next index when the record was saved; the entry is
+ *                published at or after it
+ * @rv_entry:     the held entry
+ */
+#define FAMFS_RESERVATION_MAGIC 0xfa3f5e5e
+
+struct famfs_reservation {
+	pid_t                  rv_pid;
+	u32                    rv_pad;
+	u64                    rv_start;
+	u64                    rv_log_index;
+	struct famfs_log_entry rv_entry;
+};
+
+/* famfs cp: default size of the ranges that copy workers split files into */
+#define FAMFS_CP_CHUNK_DEFAULT (64ULL * 1024 * 1024)
+/* famfs cp: pause allocating files while this many are still being copied */
+#define FAMFS_CP_MAX_INFLIGHT  256
+/* famfs cp --direct: O_DIRECT reads are aligned to this, and each copy worker keeps
+ * this many of them in flight (via io_uring, where the kernel allows it)
+ */
+#define FAMFS_CP_DIRECT_ALIGN  4096
+#define FAMFS_CP_DIRECT_QDEPTH 8
+/* famfs cp: source reads are at most this size */
+#define FAMFS_CP_IO_SIZE       0x100000
+
+/**
+ * struct famfs_cp_engine - worker pool that copies file data for famfs cp
+ *
+ * __famfs_cp() still creates, allocates and logs each file in the calling thread (under
+ * the locked log), but then queues the file for the engine rather than copying it. The
+ * workers copy each file in @chunk-sized ranges, so a large file is copied by all of
+ * them at once, many small files are copied concurrently, and copying overlaps with
+ * allocating the next files.
+ *
+ * With @direct, sources are read with O_DIRECT straight into the famfs mapping, so data
+ * that is only touched once does not pollute the page cache. Each worker keeps
+ * FAMFS_CP_DIRECT_QDEPTH reads in flight on its own io_uring, or issues synchronous
+ * O_DIRECT preads if io_uring is not available. Ranges that cannot be read with O_DIRECT
+ * (e.g. the source file system does not support it) are read through the page cache.
+ *
+ * With @nt, each worker reads into a bounce buffer and writes the mapping with
+ * non-temporal stores (mu_memcpy_nt()), rather than reading through the cache into the
+ * mapping and flushing it afterward.
+ *
+ * @lock:      protects the fields below it
+ * @work:      signalled when a file is queued or @stopping is set
+ * @idle:      signalled when a file has been completely copied
+ * @head:      files with ranges not yet claimed by a worker (FIFO)
+ * @tail:
+ * @ninflight: files queued and not yet completely copied
+ * @stopping:  workers exit once @head is empty
+ * @err:       first copy error (negative), or 0
+ * @nfiles:    files completely copied
+ * @nbytes:    bytes in @nfiles
+ * @nbytes_direct: bytes (in ranges of @nfiles) that were read with O_DIRECT
+ * @nbytes_holes: bytes (in ranges of @nfiles) that were holes in the source, zeroed
+ *             rather than read
+ * @nrings:    workers that are using an io_uring
+ * @failed:    files that were not copied completely (see famfs_cp_engine_failed())
+ */
+struct famfs_cp_file;
+
+struct famfs_cp_engine {
+	int                   nthreads;
+	u64                   chunk;
+	int                   direct;
+	int                   nt;
+	pthread_t            *threads;
+	pthread_mutex_t       lock;
+	pthread_cond_t        work;
+	pthread_cond_t        idle;
+	struct famfs_cp_file *head;
+	struct famfs_cp_file *tail;
+	u64                   ninflight;
+	int                   stopping;
+	int                   err;
+	u64                   nfiles;
+	u64                   nbytes;
+	u64                   nbytes_direct;
+	u64                   nbytes_holes;
+	int                   nrings;
+	struct famfs_cp_file *failed;
 };
 
 struct famfs_locked_log {
-	s64               devsize;
-	struct famfs_log *logp;
-	int               lfd;
-	u64               nbits;
-	u8               *bitmap;
-	char              mpt[PATH_MAX];
+	s64                     devsize;
+	struct famfs_log       *logp;
+	int                     lfd;
+	u64                     nbits;
+	u8                     *bitmap;
+	struct famfs_free_index free_index;
+	struct famfs_log_txn   *txn;  /* if non-NULL, log entries are staged here */
+	struct famfs_cp_engine *cp;   /* if non-NULL, __famfs_cp() queues file data here */
+	uuid_le                 fs_uuid;
+	struct famfs_reservation *resv; /* live reservations when the log was locked */
+	u64                     nresv;
+	u64                     resv_slots; /* log slots held by @resv (one per record) */
+	char                    mpt[PATH_MAX];
 };
 
 
@@ -60,7 +292,8 @@ int __famfs_mkdir(struct famfs_locked_log *lp, const char *dirpath, mode_t mode,
 int famfs_init_locked_log(struct famfs_locked_log *lp, const char *fspath, int verbose);
 int famfs_release_locked_log(struct famfs_locked_log *lp);
 int __famfs_logplay(const struct famfs_log *logp, const char *mpt, int dry_run,
-		    int client_mode, int verbose);
+		    int client_mode, int use_cursor, int nthreads, int verbose);
+s64 famfs_logplay_cursor_start(const struct famfs_log *logp, const char *mpt, int verbose);
 int famfs_fsck_scan(const struct famfs_superblock *sb, const struct famfs_log *logp,
 		    int human, int verbose);
 int famfs_create_sys_uuid_file(char *sys_uuid_file);
@@ -69,5 +302,27 @@ void famfs_print_role_string(int role);
 int famfs_validate_log_entry(const struct famfs_log_entry *le, u64 index);
 int famfs_cp(struct famfs_locked_log *lp, const char *srcfile, const char *destfile,
 		mode_t mode, uid_t uid, gid_t gid, int verbose);
+s64 bitmap_alloc_contiguous(u8 *bitmap, u64 nbits, u64 alloc_size);
+void famfs_bitmap_snapshot_path(const uuid_le *fs_uuid, char *path_out);
+void famfs_reservation_path(const uuid_le *fs_uuid, char *path_out);
+int famfs_reservation_save(struct famfs_locked_log *lp, const struct famfs_log_txn *txn);
+int famfs_reservation_release(struct famfs_locked_log *lp);
+
+int famfs_cp_engine_start(struct famfs_cp_engine *ce, int nthreads, u64 chunk, int direct,
+			  int nt);
+int famfs_cp_engine_queue(struct famfs_cp_engine *ce, int srcfd, int dsrcfd, int destfd,
+			  char *destp, u64 size, const char *destfile, u64 id);
+int famfs_cp_engine_finish(struct famfs_cp_engine *ce);
+int famfs_cp_engine_failed(struct famfs_cp_engine *ce, u64 *id_out);
+
+void famfs_log_txn_begin(struct famfs_log_txn *txn, struct famfs_locked_log *lp);
+void famfs_log_txn_defer(struct famfs_log_txn *txn);
+void famfs_log_txn_discard(struct famfs_log_txn *txn);
+int famfs_log_txn_abandon(struct famfs_log_txn *txn, const char *mpt, u64 i);
+int famfs_log_txn_append(struct famfs_log_txn *txn, struct famfs_log_entry *e);
+u64 famfs_log_txn_commit(struct famfs_log_txn *txn);
+int famfs_free_index_build(struct famfs_free_index *fi, u8 *bitmap, u64 nbits);
+void famfs_free_index_free(struct famfs_free_index *fi);
+s64 famfs_free_index_alloc(struct famfs_free_index *fi, u64 alloc_bits);
 
 #endif /* _H_FAMFS_LIB_INTERNAL */
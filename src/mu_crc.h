@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: Apache-2.0
+/*
+ * Copyright (C) 2024 Micron Technology, Inc.  All rights reserved.
+ */
+#ifndef H_MU_CRC
+#define H_MU_CRC
+
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/*
+ * Checksums
+ *
+ * MU_CSUM_CRC32 is zlib crc32(). MU_CSUM_CRC32C (Castagnoli) uses the SSE4.2 crc32
+ * instruction if the cpu has it, which is several times faster than zlib on large
+ * buffers; otherwise it falls back to a table-driven software implementation. Both
+ * produce the same value for the same data.
+ */
+enum mu_csum_type {
+	MU_CSUM_CRC32 = 0,
+	MU_CSUM_CRC32C,
+	MU_CSUM_MAX,
+};
+
+/* Force the software CRC32C (for benchmarks and tests) */
+extern int mu_crc32c_force_sw;
+
+#define MU_CRC32C_POLY 0x82f63b78 /* reflected */
+
+static inline const char *
+mu_csum_name(enum mu_csum_type type)
+{
+	switch (type) {
+	case MU_CSUM_CRC32:  return "crc32";
+	case MU_CSUM_CRC32C: return "crc32c";
+	default:             return "unknown";
+	}
+}
+
+static inline int
+mu_csum_parse(const char *name, enum mu_csum_type *type_out)
+{
+	if (strcmp(name, "crc32") == 0)
+		*type_out = MU_CSUM_CRC32;
+	else if (strcmp(name, "crc32c") == 0)
+		*type_out = MU_CSUM_CRC32C;
+	else
+		return -1;
+	return 0;
+}
+
+static inline int
+mu_crc32c_hw_supported(void)
+{
+	static int sse42 = -1;
+
+	if (sse42 < 0) {
+		unsigned int eax, ebx, ecx = 0, edx;
+
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			ecx = 0;
+		sse42 = !!(ecx & bit_SSE4_2);
+	}
+	return sse42;
+}
+
+/* Slicing-by-8 tables: [0] is the bytewise table; [k][i] is [k-1][i] advanced a byte */
+static inline const uint32_t (*mu_crc32c_tables(void))[256]
+{
+	static uint32_t table[8][256];
+	static int built;
+	uint32_t c;
+	int i, j;
+
+	if (__atomic_load_n(&built, __ATOMIC_ACQUIRE))
+		return table;
+
+	/* Threads that race here all store the same values */
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ MU_CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+	__atomic_store_n(&built, 1, __ATOMIC_RELEASE);
+	return table;
+}
+
+static inline uint32_t
+__mu_crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint32_t (*t)[256] = mu_crc32c_tables();
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t v;
+
+	for (; len >= sizeof(v); len -= sizeof(v), p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v)); /* little endian */
+		v ^= crc;
+		crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^
+			t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+			t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+			t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+	}
+	while (len--)
+		crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t
+__mu_crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t c = crc;
+	uint64_t v;
+
+	for (; len >= sizeof(v); len -= sizeof(v), p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v)); /* buf need not be aligned */
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+	return (uint32_t)c;
+}
+
+/**
+ * mu_crc32c()
+ *
+ * Like zlib crc32(): pass 0 as @crc to start, or a previous result to continue.
+ */
+static inline uint32_t
+mu_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc = ~crc;
+	if (!mu_crc32c_force_sw && mu_crc32c_hw_supported())
+		crc = __mu_crc32c_hw(crc, buf, len);
+	else
+		crc = __mu_crc32c_sw(crc, buf, len);
+	return ~crc;
+}
+
+/**
+ * mu_csum_update() - continue checksum @crc (0 to start) over @len bytes at @buf
+ */
+static inline unsigned long
+mu_csum_update(enum mu_csum_type type, unsigned long crc, const void *buf, size_t len)
+{
+	if (type == MU_CSUM_CRC32C)
+		return mu_crc32c((uint32_t)crc, buf, len);
+	return crc32(crc, (const unsigned char *)buf, len);
+}
+
+/**
+ * mu_csum() - checksum of @len bytes at @buf, using @type
+ */
+static inline unsigned long
+mu_csum(enum mu_csum_type type, const void *buf, size_t len)
+{
+	return mu_csum_update(type, 0, buf, len);
+}
+
+#endif
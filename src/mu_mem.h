@@ -6,28 +6,179 @@
 #define H_MU_MEM
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <cpuid.h>
+#include <immintrin.h>
 #include <sys/types.h>
 #include <sys/user.h>
 #include <sys/param.h>
 
 extern int mock_flush;
+extern int count_flush;
+extern unsigned long long flushed_cache_lines; /* lines flushed while count_flush is set */
 
 #define CL_SIZE 64
 #define CL_SHIFT 6
 
+/*
+ * Cache maintenance backends
+ *
+ * clflush is serializing with respect to other clflushes, so flushing a large range
+ * with it is slow. If the cpu has them, we use clflushopt (invalidate; weakly ordered)
+ * and clwb (write back without evicting; weakly ordered) instead, with a single fence
+ * at the end of the range.
+ */
+enum mu_flush_backend {
+	MU_FLUSH_AUTO = 0,
+	MU_FLUSH_CLFLUSH,
+	MU_FLUSH_CLFLUSHOPT,
+	MU_FLUSH_CLWB,
+};
+
+/* MU_FLUSH_AUTO, or a backend to force (for benchmarks and tests). A forced backend
+ * that the cpu lacks falls back to the auto choice.
+ */
+extern int mu_flush_backend;
+
+static inline int
+mu_flush_backend_supported(enum mu_flush_backend backend)
+{
+	static int cpu_features = -1;
+
+	if (cpu_features < 0) {
+		unsigned int eax, ebx = 0, ecx, edx;
+
+		if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+			ebx = 0;
+		cpu_features = ebx & (bit_CLFLUSHOPT | bit_CLWB);
+	}
+
+	switch (backend) {
+	case MU_FLUSH_CLFLUSH:
+		return 1;
+	case MU_FLUSH_CLFLUSHOPT:
+		return !!(cpu_features & bit_CLFLUSHOPT);
+	case MU_FLUSH_CLWB:
+		return !!(cpu_features & bit_CLWB);
+	default:
+		return 0;
+	}
+}
+
+static inline const char *
+mu_flush_backend_name(enum mu_flush_backend backend)
+{
+	switch (backend) {
+	case MU_FLUSH_CLFLUSH:    return "clflush";
+	case MU_FLUSH_CLFLUSHOPT: return "clflushopt";
+	case MU_FLUSH_CLWB:       return "clwb";
+	default:                  return "auto";
+	}
+}
+
+/**
+ * mu_invalidate_backend() - the backend for flushes that must also evict (invalidate)
+ */
+static inline enum mu_flush_backend
+mu_invalidate_backend(void)
+{
+	/* clwb doesn't invalidate, so it is never used here */
+	if (mu_flush_backend == MU_FLUSH_CLFLUSH ||
+	    (mu_flush_backend == MU_FLUSH_CLFLUSHOPT &&
+	     mu_flush_backend_supported(MU_FLUSH_CLFLUSHOPT)))
+		return (enum mu_flush_backend)mu_flush_backend;
+
+	if (mu_flush_backend_supported(MU_FLUSH_CLFLUSHOPT))
+		return MU_FLUSH_CLFLUSHOPT;
+	return MU_FLUSH_CLFLUSH;
+}
+
+/**
+ * mu_writeback_backend() - the backend for a writer pushing its own data to memory
+ */
+static inline enum mu_flush_backend
+mu_writeback_backend(void)
+{
+	if (mu_flush_backend != MU_FLUSH_AUTO &&
+	    mu_flush_backend_supported((enum mu_flush_backend)mu_flush_backend))
+		return (enum mu_flush_backend)mu_flush_backend;
+
+	if (mu_flush_backend_supported(MU_FLUSH_CLWB))
+		return MU_FLUSH_CLWB;
+	return mu_invalidate_backend();
+}
+
+__attribute__((target("clflushopt")))
 static inline void
-__flush_processor_cache(const void *addr, size_t len)
+__mu_clflushopt_range(uintptr_t start, uintptr_t end)
 {
-	int64_t i;
-	const char *buffer = (const char *)addr;
+	uintptr_t p;
 
-	if (mock_flush)
+	for (p = start; p < end; p += CL_SIZE)
+		__builtin_ia32_clflushopt((void *)p);
+}
+
+__attribute__((target("clwb")))
+static inline void
+__mu_clwb_range(uintptr_t start, uintptr_t end)
+{
+	uintptr_t p;
+
+	for (p = start; p < end; p += CL_SIZE)
+		__builtin_ia32_clwb((const void *)p);
+}
+
+/**
+ * __mu_cache_range()
+ *
+ * Apply @backend to every cache line that overlaps [@addr, @addr + @len) (which need
+ * not be cache line aligned). The weakly-ordered backends are followed by one fence,
+ * so the whole range is complete when this returns.
+ */
+static inline void
+__mu_cache_range(const void *addr, size_t len, enum mu_flush_backend backend)
+{
+	uintptr_t start = (uintptr_t)addr & ~((uintptr_t)CL_SIZE - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+	uintptr_t p;
+
+	if (mock_flush || !len)
 		return;
 
-	/* Flush the processor cache for the target range */
-	for (i=0; i<len; i+=CL_SIZE)
-		__builtin_ia32_clflush(&buffer[i]);
+	switch (backend) {
+	case MU_FLUSH_CLWB:
+		__mu_clwb_range(start, end);
+		__sync_synchronize();
+		break;
+	case MU_FLUSH_CLFLUSHOPT:
+		__mu_clflushopt_range(start, end);
+		__sync_synchronize();
+		break;
+	default:
+		for (p = start; p < end; p += CL_SIZE)
+			__builtin_ia32_clflush((const void *)p);
+		break;
+	}
 
+	/* Only unit tests count; a shared counter would be a hot spot for flushing threads */
+	if (count_flush)
+		__atomic_fetch_add(&flushed_cache_lines, (end - start + CL_SIZE - 1) >> CL_SHIFT,
+				   __ATOMIC_RELAXED);
+}
+
+/* Write back and invalidate */
+static inline void
+__flush_processor_cache(const void *addr, size_t len)
+{
+	__mu_cache_range(addr, len, mu_invalidate_backend());
+}
+
+/* Write back; the lines may stay in the cache */
+static inline void
+__writeback_processor_cache(const void *addr, size_t len)
+{
+	__mu_cache_range(addr, len, mu_writeback_backend());
 }
 
 /**
@@ -59,6 +210,22 @@ flush_processor_cache(const void *addr, size_t len)
 	__flush_processor_cache(addr, len);
 }
 
+/**
+ * writeback_processor_cache() - write data that this host has written back to memory,
+ * without necessarily evicting it from the cache. Only for data that this host will not
+ * subsequently need to re-read from memory (e.g. a producer's own writes).
+ */
+static inline void
+writeback_processor_cache(const void *addr, size_t len)
+{
+	if (mock_flush)
+		return;
+
+	/* Barrier before write-back to guarantee all prior memory mutations are included */
+	__sync_synchronize();
+	__writeback_processor_cache(addr, len);
+}
+
 /**
  * invalidate_processor_cache() - invalidate the cache so we can see data written from elsewhere
  */
@@ -75,4 +242,157 @@ invalidate_processor_cache(const void *addr, size_t len)
 	 */
 }
 
+/*
+ * Non-temporal copies
+ *
+ * mu_memcpy_nt() writes the destination with streaming (movnt) stores, which go to
+ * memory without allocating cache lines, so the destination does not need to be
+ * flushed afterward; a single sfence orders the stores. It uses 32-byte AVX stores if
+ * the cpu (and OS) support AVX, else 16-byte SSE2 stores. mu_memzero_nt() is the same
+ * for zeroing.
+ */
+
+/* Force the SSE2 stores (for benchmarks and tests) */
+extern int mu_memcpy_nt_force_sse2;
+
+static inline int
+mu_avx_supported(void)
+{
+	static int avx = -1;
+
+	/* Unlike a cpuid check, this also verifies that the OS saves the ymm registers */
+	if (avx < 0)
+		avx = !!__builtin_cpu_supports("avx");
+	return avx;
+}
+
+/* @dst is cache line aligned and @len is a multiple of CL_SIZE */
+__attribute__((target("avx")))
+static inline void
+__mu_memcpy_nt_avx(char *dst, const char *src, size_t len)
+{
+	for (; len; len -= CL_SIZE, dst += CL_SIZE, src += CL_SIZE) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)src);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+
+		_mm256_stream_si256((__m256i *)dst, a);
+		_mm256_stream_si256((__m256i *)(dst + 32), b);
+	}
+}
+
+static inline void
+__mu_memcpy_nt_sse2(char *dst, const char *src, size_t len)
+{
+	for (; len; len -= CL_SIZE, dst += CL_SIZE, src += CL_SIZE) {
+		__m128i a = _mm_loadu_si128((const __m128i *)src);
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+		_mm_stream_si128((__m128i *)dst, a);
+		_mm_stream_si128((__m128i *)(dst + 16), b);
+		_mm_stream_si128((__m128i *)(dst + 32), c);
+		_mm_stream_si128((__m128i *)(dst + 48), d);
+	}
+}
+
+/**
+ * mu_memcpy_nt() - copy @len bytes to @dst with non-temporal stores
+ *
+ * Partial cache lines at either end of @dst are copied with ordinary stores and
+ * flushed, so the whole range is in memory (not the cache) when this returns.
+ */
+static inline void
+mu_memcpy_nt(void *dst, const void *src, size_t len)
+{
+	uintptr_t d = (uintptr_t)dst;
+	uintptr_t start = (d + CL_SIZE - 1) & ~(uintptr_t)(CL_SIZE - 1);
+	uintptr_t end = (d + len) & ~(uintptr_t)(CL_SIZE - 1);
+	const char *s = (const char *)src;
+
+	if (start >= end) {
+		/* No whole cache lines */
+		memcpy(dst, src, len);
+		flush_processor_cache(dst, len);
+		return;
+	}
+
+	if (start > d)
+		memcpy(dst, s, start - d);
+	if (d + len > end)
+		memcpy((void *)end, s + (end - d), d + len - end);
+
+	if (mu_avx_supported() && !mu_memcpy_nt_force_sse2)
+		__mu_memcpy_nt_avx((char *)start, s + (start - d), end - start);
+	else
+		__mu_memcpy_nt_sse2((char *)start, s + (start - d), end - start);
+
+	if (start > d)
+		flush_processor_cache(dst, start - d);
+	if (d + len > end)
+		flush_processor_cache((void *)end, d + len - end);
+	_mm_sfence();
+}
+
+/* @dst is cache line aligned and @len is a multiple of CL_SIZE */
+__attribute__((target("avx")))
+static inline void
+__mu_memzero_nt_avx(char *dst, size_t len)
+{
+	__m256i z = _mm256_setzero_si256();
+
+	for (; len; len -= CL_SIZE, dst += CL_SIZE) {
+		_mm256_stream_si256((__m256i *)dst, z);
+		_mm256_stream_si256((__m256i *)(dst + 32), z);
+	}
+}
+
+static inline void
+__mu_memzero_nt_sse2(char *dst, size_t len)
+{
+	__m128i z = _mm_setzero_si128();
+
+	for (; len; len -= CL_SIZE, dst += CL_SIZE) {
+		_mm_stream_si128((__m128i *)dst, z);
+		_mm_stream_si128((__m128i *)(dst + 16), z);
+		_mm_stream_si128((__m128i *)(dst + 32), z);
+		_mm_stream_si128((__m128i *)(dst + 48), z);
+	}
+}
+
+/**
+ * mu_memzero_nt() - zero @len bytes at @dst with non-temporal stores
+ *
+ * Like mu_memcpy_nt(), the whole range is in memory when this returns.
+ */
+static inline void
+mu_memzero_nt(void *dst, size_t len)
+{
+	uintptr_t d = (uintptr_t)dst;
+	uintptr_t start = (d + CL_SIZE - 1) & ~(uintptr_t)(CL_SIZE - 1);
+	uintptr_t end = (d + len) & ~(uintptr_t)(CL_SIZE - 1);
+
+	if (start >= end) {
+		memset(dst, 0, len);
+		flush_processor_cache(dst, len);
+		return;
+	}
+
+	if (start > d)
+		memset(dst, 0, start - d);
+	if (d + len > end)
+		memset((void *)end, 0, d + len - end);
+
+	if (mu_avx_supported() && !mu_memcpy_nt_force_sse2)
+		__mu_memzero_nt_avx((char *)start, end - start);
+	else
+		__mu_memzero_nt_sse2((char *)start, end - start);
+
+	if (start > d)
+		flush_processor_cache(dst, start - d);
+	if (d + len > end)
+		flush_processor_cache((void *)end, d + len - end);
+	_mm_sfence();
+}
+
 #endif
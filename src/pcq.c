@@ -35,6 +35,7 @@
 
 #include "famfs_lib.h"
 #include "mu_mem.h"
+#include "mu_crc.h"
 #include "random_buffer.h"
 #include "famfs.h"
 #include "pcq.h"
@@ -118,6 +119,16 @@ pcq_usage(int   argc,
 	       "                                and crc (ignored if queue already exists)\n"
 	       "    -n|--nbuckets <nnbuckets> - Number of buckets in the queue\n"
 	       "                                (ignored if queue already exists)\n"
+	       "    -M|--mpmc                 - Create a multi-producer/multi-consumer queue,\n"
+	       "                                which may be used by several producer and\n"
+	       "                                consumer threads on a host at once\n"
+	       "    -F|--framed               - Create a framed queue, whose messages have\n"
+	       "                                their own lengths and may span buckets\n"
+	       "    --csum <crc32|crc32c>     - Bucket checksum (default crc32c, which uses\n"
+	       "                                the SSE4.2 crc32 instruction if available)\n"
+	       "    --subscribers <n>         - Create a broadcast queue with <n> consumer\n"
+	       "                                files; each subscriber receives every message\n"
+	       "                                (not compatible with --mpmc)\n"
 	       "\n"
 	       "Queue permissions:\n"
 	       "    -P|--setperm <p|c|b|n>    - Set permissions on a queue for (p)roducer or\n"
@@ -131,6 +142,41 @@ pcq_usage(int   argc,
 	       "    -p|--producer             - Run the producer\n"
 	       "    -c|--consumer             - Run the consumer\n"
 	       "    -s|--status <interval>    - Print status at the specified interval\n"
+	       "    --producers <n>           - Run <n> producer threads (implies --producer;\n"
+	       "                                more than 1 requires an MPMC queue)\n"
+	       "    --consumers <n>           - Run <n> consumer threads (implies --consumer;\n"
+	       "                                more than 1 requires an MPMC queue, or\n"
+	       "                                --subscriber)\n"
+	       "    --subscriber <k>          - Broadcast queues: consume as subscriber <k>\n"
+	       "                                (default 0); with --consumers <n>, the\n"
+	       "                                threads are subscribers <k>..<k+n-1> and\n"
+	       "                                each receives all --nmessages\n"
+	       "    -B|--batch <n>            - Put/get up to <n> messages per batch; each\n"
+	       "                                batch flushes its buckets together and\n"
+	       "                                updates the queue index once (default 1)\n"
+	       "    -Z|--zerocopy             - Fill and check messages in place in the queue\n"
+	       "                                buckets rather than copying them in and out\n"
+	       "                                (not compatible with --batch)\n"
+	       "    --max-msg <size>          - Framed queues: producers send messages of\n"
+	       "                                random length up to <size> (default 4\n"
+	       "                                buckets' worth)\n"
+	       "    -W|--wait <policy>        - How to wait while the queue is full/empty:\n"
+	       "                                yield    - sched_yield() (default)\n"
+	       "                                spin     - busy-poll with cpu pause\n"
+	       "                                backoff  - spin with exponential backoff\n"
+	       "                                sleep    - sleep, doubling up to --sleep-max\n"
+	       "    --sleep-max <usec>        - Longest sleep for --wait sleep (default %d)\n"
+	       "    -L|--latency              - Timestamp each message and report send-to-\n"
+	       "                                receive latency percentiles (producer and\n"
+	       "                                consumer must both use this; their clocks\n"
+	       "                                must be synchronized)\n"
+	       "    --latency-json <file>     - Write latency histograms to <file> as JSON\n"
+	       "                                at exit (implies --latency)\n"
+	       "    --doorbell <fifo>         - Same-host producers and consumers: consumers\n"
+	       "                                block in poll() on the local FIFO <fifo>\n"
+	       "                                (created if needed) while the queue is\n"
+	       "                                empty, and producers ring it after\n"
+	       "                                publishing. Not for MPMC queues\n"
 	       "\n"
 	       "Special options:\n"
 	       "    -i|--info                 - Dump the state of a queue\n"
@@ -141,13 +187,21 @@ pcq_usage(int   argc,
 	       "                                invalidates\n"
 	       "    -f|--statusfile           - Write exit status to file (for testing)\n"
 	       "    -?                        - Print this message\n"
-	       "\n", progname, progname, progname, progname, progname, progname);
+	       "\n", progname, progname, progname, progname, progname, progname,
+	       PCQ_SLEEP_MAX_US_DEFAULT);
 }
 
 int
 main(int argc, char **argv)
 {
-	pthread_t producer_thread, consumer_thread, status_thread;
+	pthread_t *producer_threads, *consumer_threads, status_thread;
+	struct pcq_thread_arg *prods, *conss;
+	struct timespec start, end;
+	int nproducers = 0;
+	int nconsumers = 0;
+	bool mpmc = false;
+	double elapsed;
+	int i;
 	struct pcq_status_thread_arg status = { 0 };
 	struct pcq_thread_arg prod = { 0 };
 	struct pcq_thread_arg cons = { 0 };
@@ -164,6 +218,18 @@ main(int argc, char **argv)
 	u64 nmessages = 0;
 	bool info = false;
 	u64 nbuckets = 0;
+	bool zerocopy = false;
+	enum pcq_wait_policy wait_policy = PCQ_WAIT_YIELD;
+	enum mu_csum_type csum_type = MU_CSUM_CRC32C;
+	char *latency_json = NULL;
+	bool latency = false;
+	bool framed = false;
+	u64 nsubscribers = 0;
+	int subscriber = -1;
+	char *doorbell = NULL;
+	u64 max_msg = 0;
+	u64 sleep_max_us = 0;
+	u64 batch = 1;
 	int wait = true;
 	int runtime = 0;
 	int verbose = 0;
@@ -182,6 +248,8 @@ main(int argc, char **argv)
 		{"time",        required_argument,        0,  't'},
 		{"status",      required_argument,        0,  's'},
 		{"setperm",     required_argument,        0,  'P'},
+		{"batch",       required_argument,        0,  'B'},
+		{"wait",        required_argument,        0,  'W'},
 
 		{"create",      no_argument,              0,  'C'},
 		{"producer",    no_argument,              0,  'p'},
@@ -189,6 +257,20 @@ main(int argc, char **argv)
 		{"info",        no_argument,              0,  'i'},
 		{"drain",       no_argument,              0,  'd'},
 		{"dontflush",   no_argument,              0,  'D'},
+		{"zerocopy",    no_argument,              0,  'Z'},
+		{"mpmc",        no_argument,              0,  'M'},
+		{"latency",     no_argument,              0,  'L'},
+		{"framed",      no_argument,              0,  'F'},
+		/* No short forms */
+		{"producers",   required_argument,        0,  'R'},
+		{"consumers",   required_argument,        0,  'U'},
+		{"sleep-max",   required_argument,        0,  'X'},
+		{"latency-json", required_argument,       0,  'J'},
+		{"csum",        required_argument,        0,  'K'},
+		{"max-msg",     required_argument,        0,  'Q'},
+		{"subscribers", required_argument,        0,  'G'},
+		{"subscriber",  required_argument,        0,  'H'},
+		{"doorbell",    required_argument,        0,  'E'},
 		/* These options don't set a flag.
 		 * We distinguish them by their indices.
 		 */
@@ -200,7 +282,7 @@ main(int argc, char **argv)
 	 * to return -1 when it sees something that is not recognized option
 	 * (e.g. the command that will mux us off to the command handlers
 	 */
-	while ((c = getopt_long(argc, argv, "+b:s:S:n:N:f:t:s:CdpcwDih?v",
+	while ((c = getopt_long(argc, argv, "+b:s:S:n:N:f:t:s:B:W:CdpcwDZMLFih?v",
 				pcq_options, &optind)) != EOF) {
 		char *endptr;
 
@@ -268,6 +350,18 @@ main(int argc, char **argv)
 				nmessages *= mult;
 			break;
 
+		case 'B':
+			batch = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult > 0)
+				batch *= mult;
+			if (batch < 1) {
+				fprintf(stderr, "%s: invalid --batch arg (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
 		case 'f':
 			/* Write execution status to this file (for testing) */
 			statusfname= optarg;
@@ -294,6 +388,103 @@ main(int argc, char **argv)
 			mock_flush = 1;
 			break;
 
+		case 'Z':
+			zerocopy = true;
+			break;
+
+		case 'M':
+			mpmc = true;
+			break;
+
+		case 'R':
+		case 'U': {
+			int n = strtol(optarg, 0, 0);
+
+			if (n < 1) {
+				fprintf(stderr, "%s: invalid thread count (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			if (c == 'R') {
+				producer = true;
+				nproducers = n;
+			} else {
+				consumer = true;
+				nconsumers = n;
+			}
+			break;
+		}
+
+		case 'W':
+			if (pcq_wait_policy_parse(optarg, &wait_policy)) {
+				fprintf(stderr, "%s: invalid wait policy (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'X':
+			sleep_max_us = strtoull(optarg, 0, 0);
+			if (sleep_max_us == 0) {
+				fprintf(stderr, "%s: invalid --sleep-max (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'L':
+			latency = true;
+			break;
+
+		case 'F':
+			framed = true;
+			break;
+
+		case 'Q':
+			max_msg = strtoull(optarg, &endptr, 0);
+			mult = get_multiplier(endptr);
+			if (mult > 0)
+				max_msg *= mult;
+			if (max_msg == 0 || mult <= 0) {
+				fprintf(stderr, "%s: invalid --max-msg (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'G':
+			nsubscribers = strtoull(optarg, 0, 0);
+			if (nsubscribers < 1 || nsubscribers > PCQ_MAX_SUBSCRIBERS) {
+				fprintf(stderr, "%s: invalid --subscribers (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'H':
+			subscriber = strtol(optarg, &endptr, 0);
+			if (*endptr || subscriber < 0 || subscriber >= PCQ_MAX_SUBSCRIBERS) {
+				fprintf(stderr, "%s: invalid --subscriber (%s)\n",
+					__func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'E':
+			doorbell = optarg;
+			break;
+
+		case 'K':
+			if (mu_csum_parse(optarg, &csum_type)) {
+				fprintf(stderr, "%s: invalid csum (%s)\n", __func__, optarg);
+				return -1;
+			}
+			break;
+
+		case 'J':
+			latency_json = optarg;
+			latency = true;
+			break;
+
 		case 'h':
 		case '?':
 			pcq_usage(argc, argv);
@@ -319,6 +510,12 @@ main(int argc, char **argv)
 		pcq_usage(argc, argv);
 		return -1;
 	}
+	if (zerocopy && batch > 1) {
+		fprintf(stderr, "%s: --zerocopy and --batch are mutually exclusive\n\n",
+			__func__);
+		pcq_usage(argc, argv);
+		return -1;
+	}
 	if (runtime && nmessages) {
 		fprintf(stderr,
 			"%s: the --nmessages and --time args cannot be used together\n\n",
@@ -348,22 +545,38 @@ main(int argc, char **argv)
 		return pcq_set_perm(filename, role);
 
 	if (create)
-		return pcq_create(filename, nbuckets, bucket_size, verbose);
+		return pcq_create(filename, nbuckets, bucket_size, mpmc, framed, nsubscribers,
+				  csum_type, verbose);
 
 	if (info)
 		return get_queue_info(filename, statusfile, verbose);
+	if (producer && !nproducers)
+		nproducers = 1;
+	if (consumer && !nconsumers)
+		nconsumers = 1;
+	producer_threads = calloc(nproducers + 1, sizeof(*producer_threads));
+	consumer_threads = calloc(nconsumers + 1, sizeof(*consumer_threads));
+	prods = calloc(nproducers + 1, sizeof(*prods));
+	conss = calloc(nconsumers + 1, sizeof(*conss));
+	assert(producer_threads && consumer_threads && prods && conss);
+
 	if (drain) {
 		struct pcq_thread_arg ta = { 0 };
 
 		ta.role = CONSUMER;
 		ta.stop_mode = EMPTY;
 		ta.basename = filename;
+		ta.batch = batch;
+		ta.zerocopy = zerocopy;
+		ta.latency = latency;
+		ta.subscriber = MAX(subscriber, 0);
 		ta.verbose = verbose;
 
 		printf("pcq:    %s\n", filename);
 		rc = run_consumer(&ta);
-		printf("pcq drain: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld\n",
-		       ta.nreceived, ta.nerrors, ta.nempty, ta.retries);
+		printf("pcq drain: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld "
+		       "nindex_reads=%lld\n",
+		       ta.nreceived, ta.nerrors, ta.nempty, ta.retries, ta.nindex_reads);
 		if (ta.nerrors) {
 			if (statusfile) {
 				fprintf(statusfile, "%lld", -ta.nerrors);
@@ -382,45 +595,78 @@ main(int argc, char **argv)
 	}
 
 	/*
-	 * Start the producer thread if needed
+	 * Start the producer thread(s) if needed
 	 */
 	assert(wait);
-	if (producer) {
-		prod.role = PRODUCER;
-		prod.stop_mode = (runtime) ? STOP_FLAG : NMESSAGES;
-		prod.nmessages = nmessages;
-		prod.runtime = runtime;
-		prod.basename = filename;
-		prod.seed = seed;
-		prod.wait = wait;
-		prod.verbose = verbose;
-		rc = pthread_create(&producer_thread, NULL, pcq_worker, (void *)&prod);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nproducers; i++) {
+		struct pcq_thread_arg *p = &prods[i];
+
+		p->role = PRODUCER;
+		p->stop_mode = (runtime) ? STOP_FLAG : NMESSAGES;
+		/* Divide the messages among the producers */
+		p->nmessages = nmessages / nproducers + ((u64)i < nmessages % nproducers);
+		p->runtime = runtime;
+		p->basename = filename;
+		p->seed = seed;
+		p->batch = batch;
+		p->zerocopy = zerocopy;
+		p->shared = (nproducers > 1);
+		p->wait = wait;
+		p->wait_policy = wait_policy;
+		p->latency = latency;
+		p->max_msg = max_msg;
+		p->sleep_max_us = sleep_max_us;
+		p->doorbell = doorbell;
+		p->verbose = verbose;
+		rc = pthread_create(&producer_threads[i], NULL, pcq_worker, (void *)p);
 		if (rc) {
 			fprintf(stderr, "%s: failed to start producer thread\n", __func__);
+			return -1;
 		}
 	}
 
 	/*
-	 * Start the consumer thread
+	 * Start the consumer thread(s)
 	 */
-	if (consumer) {
-		cons.role = CONSUMER;
-		cons.stop_mode = (runtime) ? STOP_FLAG : NMESSAGES;
-		cons.nmessages = nmessages;
-		prod.runtime = runtime;
-		cons.basename = filename;
-		cons.seed = seed;
-		cons.wait = wait;
-		cons.verbose = verbose;
-		rc = pthread_create(&consumer_thread, NULL, pcq_worker, (void *)&cons);
+	for (i = 0; i < nconsumers; i++) {
+		struct pcq_thread_arg *c = &conss[i];
+
+		c->role = CONSUMER;
+		c->stop_mode = (runtime) ? STOP_FLAG : NMESSAGES;
+		if (subscriber >= 0) {
+			/* Each thread is its own subscriber, and receives every message */
+			c->subscriber = subscriber + i;
+			c->nmessages = nmessages;
+			c->shared = false;
+		} else {
+			c->nmessages = nmessages / nconsumers +
+				((u64)i < nmessages % nconsumers);
+			c->shared = (nconsumers > 1);
+		}
+		c->runtime = runtime;
+		c->basename = filename;
+		c->seed = seed;
+		c->batch = batch;
+		c->zerocopy = zerocopy;
+		c->wait = wait;
+		c->wait_policy = wait_policy;
+		c->latency = latency;
+		c->sleep_max_us = sleep_max_us;
+		c->doorbell = doorbell;
+		c->verbose = verbose;
+		rc = pthread_create(&consumer_threads[i], NULL, pcq_worker, (void *)c);
 		if (rc) {
 			fprintf(stderr, "%s: failed to start consumer thread\n", __func__);
+			return -1;
 		}
 	}
 
 	if (status_interval) {
-		status.p = &prod;
-		status.c = &cons;
+		status.p = prods;
+		status.c = conss;
+		status.np = nproducers;
+		status.nc = nconsumers;
 		status.basename = filename;
 		status.interval = status_interval;
 		status.stop_now = 0;
@@ -433,21 +679,44 @@ main(int argc, char **argv)
 
 	if (runtime) {
 		sleep(runtime);
-		prod.stop_now = 1;
-		cons.stop_now = 1;
+		for (i = 0; i < nproducers; i++)
+			prods[i].stop_now = 1;
+		for (i = 0; i < nconsumers; i++)
+			conss[i].stop_now = 1;
 		status.stop_now = 1;
 	}
 
-	if (producer) {
-		rc = pthread_join(producer_thread, NULL);
+	for (i = 0; i < nproducers; i++) {
+		rc = pthread_join(producer_threads[i], NULL);
 		if (rc)
 			fprintf(stderr, "%s: failed to join producer thread\n", __func__);
+		prod.nsent += prods[i].nsent;
+		prod.nerrors += prods[i].nerrors;
+		prod.nfull += prods[i].nfull;
+		prod.nbatches += prods[i].nbatches;
+		prod.nindex_reads += prods[i].nindex_reads;
+		prod.ndoorbells += prods[i].ndoorbells;
+		prod.nbytes += prods[i].nbytes;
+		pcq_hist_merge(&prod.wakeup_hist, &prods[i].wakeup_hist);
+		prod.result += prods[i].result;
 	}
-	if (consumer) {
-		rc = pthread_join(consumer_thread, NULL);
+	for (i = 0; i < nconsumers; i++) {
+		rc = pthread_join(consumer_threads[i], NULL);
 		if (rc)
 			fprintf(stderr, "%s: failed to join consumer thread\n", __func__);
+		cons.nreceived += conss[i].nreceived;
+		cons.nerrors += conss[i].nerrors;
+		cons.nempty += conss[i].nempty;
+		cons.retries += conss[i].retries;
+		cons.nbatches += conss[i].nbatches;
+		cons.nindex_reads += conss[i].nindex_reads;
+		cons.ndoorbells += conss[i].ndoorbells;
+		cons.nbytes += conss[i].nbytes;
+		pcq_hist_merge(&cons.wakeup_hist, &conss[i].wakeup_hist);
+		pcq_hist_merge(&cons.latency_hist, &conss[i].latency_hist);
+		cons.result += conss[i].result;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 	if (status_interval) {
 		status.stop_now = 1;
 		rc = pthread_join(status_thread, NULL);
@@ -456,10 +725,58 @@ main(int argc, char **argv)
 	}
 
 	printf("pcq:    %s\n", filename);
-	printf("pcq producer: nsent=%lld nerrors=%lld nfull=%lld\n",
-	       prod.nsent, prod.nerrors, prod.nfull);
-	printf("pcq consumer: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld\n",
-	       cons.nreceived, cons.nerrors, cons.nempty, cons.retries);
+	printf("pcq producer: nsent=%lld nerrors=%lld nfull=%lld nbatches=%lld "
+	       "nindex_reads=%lld\n",
+	       prod.nsent, prod.nerrors, prod.nfull, prod.nbatches, prod.nindex_reads);
+	printf("pcq consumer: nreceived=%lld nerrors=%lld nempty=%lld retries=%lld "
+	       "nbatches=%lld nindex_reads=%lld\n",
+	       cons.nreceived, cons.nerrors, cons.nempty, cons.retries, cons.nbatches,
+	       cons.nindex_reads);
+	printf("pcq wait policy: %s\n", pcq_wait_policy_name(wait_policy));
+	if (doorbell)
+		printf("pcq doorbell: %s producer rings=%lld consumer blocking waits=%lld\n",
+		       doorbell, prod.ndoorbells, cons.ndoorbells);
+	printf("pcq producer wakeups: n=%lld p50=%lldns p99=%lldns max=%lldns\n",
+	       prod.wakeup_hist.count, pcq_hist_percentile(&prod.wakeup_hist, 50),
+	       pcq_hist_percentile(&prod.wakeup_hist, 99), prod.wakeup_hist.max);
+	printf("pcq consumer wakeups: n=%lld p50=%lldns p99=%lldns max=%lldns\n",
+	       cons.wakeup_hist.count, pcq_hist_percentile(&cons.wakeup_hist, 50),
+	       pcq_hist_percentile(&cons.wakeup_hist, 99), cons.wakeup_hist.max);
+	if (latency && nconsumers)
+		printf("pcq latency: n=%lld p50=%lldns p90=%lldns p99=%lldns p99.9=%lldns "
+		       "max=%lldns\n", cons.latency_hist.count,
+		       pcq_hist_percentile(&cons.latency_hist, 50),
+		       pcq_hist_percentile(&cons.latency_hist, 90),
+		       pcq_hist_percentile(&cons.latency_hist, 99),
+		       pcq_hist_percentile(&cons.latency_hist, 99.9),
+		       cons.latency_hist.max);
+	if (latency_json) {
+		FILE *jf = fopen(latency_json, "w");
+
+		if (!jf) {
+			fprintf(stderr, "%s: failed to open %s (errno %d)\n",
+				__func__, latency_json, errno);
+		} else {
+			fprintf(jf, "{\"queue\": \"%s\", \"wait_policy\": \"%s\",\n",
+				filename, pcq_wait_policy_name(wait_policy));
+			fprintf(jf, " \"latency_ns\": ");
+			pcq_hist_print_json(jf, &cons.latency_hist);
+			fprintf(jf, ",\n \"producer_wakeup_ns\": ");
+			pcq_hist_print_json(jf, &prod.wakeup_hist);
+			fprintf(jf, ",\n \"consumer_wakeup_ns\": ");
+			pcq_hist_print_json(jf, &cons.wakeup_hist);
+			fprintf(jf, "}\n");
+			fclose(jf);
+		}
+	}
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("pcq throughput: %d producer(s) %.0f msgs/sec; %d consumer(s) %.0f msgs/sec "
+	       "(%.3f seconds)\n",
+	       nproducers, prod.nsent / elapsed, nconsumers, cons.nreceived / elapsed, elapsed);
+	if (prod.nbytes || cons.nbytes)
+		printf("pcq framed: sent %lld bytes (%.0f bytes/sec); received %lld bytes "
+		       "(%.0f bytes/sec)\n", prod.nbytes, prod.nbytes / elapsed,
+		       cons.nbytes, cons.nbytes / elapsed);
 
 	if (prod.nerrors || cons.nerrors) {
 		if (statusfile) {
@@ -8,6 +8,74 @@
 
 #define PCQ_MAGIC 0xBEEBEE3
 #define PCQ_CONSUMER_MAGIC 0xBEEBEE4
+#define PCQ_MPMC_MAGIC 0xBEEBEE5
+
+/*
+ * Multi-producer/multi-consumer (MPMC) queues
+ *
+ * An MPMC queue uses the same producer/consumer file pair, but the producer_index and
+ * consumer_index are monotonic tickets that threads claim with compare-and-swap (so
+ * claims are atomic among threads on one host). A ticket t uses bucket (t % nbuckets):
+ *
+ * - The seq at the end of a bucket is its sequence tag: a producer sets it to t + 1
+ *   after the rest of the bucket is written, which tells consumers the entry is ready
+ * - The consumer file has a release tag per bucket (at PCQ_MPMC_RELEASE_OFFSET); after a
+ *   consumer has copied out ticket t it sets the tag to (t / nbuckets) + 1, which tells
+ *   producers the bucket is free for the next lap
+ *
+ * Producers only write the producer file and consumers only write the consumer file,
+ * as with single-producer/single-consumer queues.
+ */
+#define PCQ_MPMC_RELEASE_OFFSET (2 * 1024 * 1024)
+
+/*
+ * Framed queues (PCQ_FLAG_FRAMED)
+ *
+ * In a framed queue, the payload of each bucket starts with a struct pcq_frame that
+ * gives the number of payload bytes actually used, and the crc covers only the frame
+ * header, the used bytes and the seq. A message that is larger than one bucket's frame
+ * capacity spans consecutive buckets; all of its buckets are published together.
+ */
+#define PCQ_FLAG_FRAMED    0x1
+#define PCQ_FLAG_BROADCAST 0x2
+#define PCQ_FLAGS_ALL      (PCQ_FLAG_FRAMED | PCQ_FLAG_BROADCAST)
+
+/*
+ * Broadcast queues (PCQ_FLAG_BROADCAST)
+ *
+ * A broadcast queue has one consumer file per subscriber, and every subscriber receives
+ * every message. Subscriber 0 uses <name>.consumer and subscriber i > 0 uses
+ * <name>.consumer.<i>; each is an ordinary consumer of its own file. The producer maps
+ * all of them read-only, and a bucket is free only once the slowest subscriber has
+ * consumed it.
+ */
+#define PCQ_MAX_SUBSCRIBERS 256
+
+/*
+ * Doorbells
+ *
+ * A consumer on the same host as the producer can block in poll()/epoll rather than
+ * polling producer_index, if both attach the same doorbell: a local named pipe (FIFO),
+ * with "<path>.<i>" for subscriber i > 0 of a broadcast queue. Before blocking, the
+ * consumer makes doorbell_gen in its consumer file odd and re-checks producer_index;
+ * after publishing, a producer with the doorbell attached writes a byte to the FIFO of
+ * each consumer whose doorbell_gen is odd (once per generation). Consumers and producers without the
+ * doorbell (e.g. on other hosts) use the shared memory path as before, and a consumer
+ * that is blocked on its doorbell still re-checks the queue every
+ * PCQ_DOORBELL_POLL_MS. The doorbell is not supported on MPMC queues.
+ */
+#define PCQ_DOORBELL_POLL_MS 10
+
+/**
+ * struct @pcq_frame
+ *
+ * @len         - bytes of message data in this bucket (following this header)
+ * @nfrags_left - number of buckets of the same message that follow this one
+ */
+struct pcq_frame {
+	u32 len;
+	u32 nfrags_left;
+};
 
 /**
  * struct @pcq
@@ -17,6 +85,10 @@
  * @bucket_size         - bucket size, inclusive of crc in the last 32 bits
  * @bucket_array_offset - offset within this file of the first bucket
  * @producer_index      - index of the last valid entry; empty if == consumer_index
+ * @nsubscribers        - broadcast queues: number of consumer files (else 0)
+ * @flags               - PCQ_FLAG_*
+ * @csum_type           - enum mu_csum_type of the bucket crcs (queues from before this
+ *                        field have 0 here, which is zlib crc32)
  * @next_seq            - next seq number (not in same cacche line as producer_index)
  */
 struct pcq {
@@ -25,38 +97,93 @@ struct pcq {
 	u64 bucket_size;
 	u64 bucket_array_offset;
 	u64 producer_index;
-	char pad[1024];
+	char pad[1000];
+	u64 nsubscribers;
+	u64 flags;
+	u64 csum_type;
 	u64 next_seq;
 	u64 pcq_size;
 };
 
+static inline bool
+pcq_is_mpmc(const struct pcq *pcq)
+{
+	return pcq->pcq_magic == PCQ_MPMC_MAGIC;
+}
+
+static inline bool
+pcq_is_broadcast(const struct pcq *pcq)
+{
+	return !!(pcq->flags & PCQ_FLAG_BROADCAST);
+}
+
 /**
  * struct @pcq_consumer
  *
  * @pcq_consumer_magic
  * @pad
- * @consumer_index - Consumer index for the queue
+ * @consumer_index   - Consumer index for the queue
  * @pad2
- * @next_seq       - Sequence number for next entry from the queue
+ * @doorbell_gen     - odd while the consumer is (about to be) blocked on its doorbell;
+ *                     in its own cache line, so the producer can check it on every
+ *                     publish
+ * @pad3
+ * @next_seq         - Sequence number for next entry from the queue
  */
 struct pcq_consumer {
 	u32 pcq_consumer_magic;
 	u32 pad;
 	u64 consumer_index;
-	char pad2[1048576];
+	char pad2[48];
+	u64 doorbell_gen;
+	char pad3[1048576 - 56];
 	u64 next_seq;
 	u64 pcqc_size;
 };
 
+/**
+ * struct @pcq_doorbell
+ *
+ * @fd       - the FIFO
+ * @rung_gen - producer: the consumer's doorbell_gen when the doorbell was last rung
+ */
+struct pcq_doorbell {
+	int fd;
+	u64 rung_gen;
+};
+
+/**
+ * struct @pcq_handle
+ *
+ * @pcq
+ * @pcqc
+ * @subscribers           - producer/info on a broadcast queue: every subscriber's
+ *                          consumer file (@subscribers[0] == @pcqc); else NULL
+ * @nsubscribers          - number of entries in @subscribers
+ * @subscriber            - consumer of a broadcast queue: which subscriber this is
+ * @doorbells             - doorbells if attached, else NULL: the consumer's own, or
+ *                          the producer's one per subscriber
+ * @ndoorbells            - number of entries in @doorbells
+ * @cached_producer_index - consumer's private copy of pcq->producer_index
+ * @cached_consumer_index - producer's private copy of pcqc->consumer_index (of the
+ *                          slowest subscriber, on a broadcast queue)
+ */
 struct pcq_handle {
 	struct pcq *pcq;
 	struct pcq_consumer *pcqc;
+	struct pcq_consumer **subscribers;
+	u64 nsubscribers;
+	u64 subscriber;
+	struct pcq_doorbell *doorbells;
+	u64 ndoorbells;
+	u64 cached_producer_index;
+	u64 cached_consumer_index;
 };
 
 static inline int64_t
 pcq_payload_size(struct pcq *pcq)
 {
-	assert(pcq->pcq_magic == PCQ_MAGIC);
+	assert(pcq->pcq_magic == PCQ_MAGIC || pcq->pcq_magic == PCQ_MPMC_MAGIC);
 	return pcq->bucket_size - sizeof(unsigned long) - sizeof(u64);
 }
 
@@ -66,6 +193,26 @@ pcq_crc_offset(struct pcq *pcq)
 	return pcq->bucket_size - sizeof(unsigned long);
 }
 
+static inline bool
+pcq_is_framed(const struct pcq *pcq)
+{
+	return !!(pcq->flags & PCQ_FLAG_FRAMED);
+}
+
+/* Message bytes that fit in one bucket of a framed queue */
+static inline u64
+pcq_frame_capacity(struct pcq *pcq)
+{
+	return pcq_payload_size(pcq) - sizeof(struct pcq_frame);
+}
+
+/* Largest message that a framed queue can hold (one bucket is always empty) */
+static inline u64
+pcq_max_msg_size(struct pcq *pcq)
+{
+	return (pcq->nbuckets - 1) * pcq_frame_capacity(pcq);
+}
+
 enum pcq_role {
 	PRODUCER,
 	CONSUMER,
@@ -78,6 +225,43 @@ enum stop_mode {
 	STOP_FLAG,
 };
 
+/**
+ * enum pcq_wait_policy - how a producer (consumer) waits while the queue is full (empty)
+ *
+ * @PCQ_WAIT_YIELD:   sched_yield() between checks (the default)
+ * @PCQ_WAIT_SPIN:    busy-poll with a cpu pause between checks
+ * @PCQ_WAIT_BACKOFF: spin with exponentially more pauses between checks, up to
+ *                    PCQ_BACKOFF_MAX_SPINS, then also yield
+ * @PCQ_WAIT_SLEEP:   sleep between checks, doubling from 1us up to the sleep cap
+ */
+enum pcq_wait_policy {
+	PCQ_WAIT_YIELD = 0,
+	PCQ_WAIT_SPIN,
+	PCQ_WAIT_BACKOFF,
+	PCQ_WAIT_SLEEP,
+};
+
+#define PCQ_BACKOFF_MAX_SPINS    1024
+#define PCQ_SLEEP_MAX_US_DEFAULT 1000
+
+#define PCQ_TIMESTAMP_SIZE sizeof(u64) /* at the start of payloads with --latency */
+
+/**
+ * struct pcq_hist - log-bucketed latency histogram (in ns)
+ *
+ * Values below 2^PCQ_HIST_SUB_BITS have their own bucket; above that, each power of 2 is
+ * split into 2^PCQ_HIST_SUB_BITS buckets, so a bucket is within 1/16 of its values.
+ */
+#define PCQ_HIST_SUB_BITS 4
+#define PCQ_HIST_NBUCKETS ((64 - PCQ_HIST_SUB_BITS + 1) << PCQ_HIST_SUB_BITS)
+
+struct pcq_hist {
+	u64 count;
+	u64 min;
+	u64 max;
+	u64 buckets[PCQ_HIST_NBUCKETS];
+};
+
 struct pcq_thread_arg {
 	enum pcq_role role;
 	int verbose;
@@ -86,7 +270,16 @@ struct pcq_thread_arg {
 	u64 runtime;
 	u64 seed;
 	bool wait;
+	enum pcq_wait_policy wait_policy;
+	u64 sleep_max_us; /* cap for PCQ_WAIT_SLEEP (0 = PCQ_SLEEP_MAX_US_DEFAULT) */
 	char *basename;
+	u64 batch;  /* max entries per pcq_put_batch()/pcq_get_batch() call */
+	bool zerocopy; /* use pcq_reserve()/pcq_commit() and pcq_peek()/pcq_release() */
+	bool shared;   /* other threads share this role on the queue (requires MPMC) */
+	int subscriber; /* consumers of broadcast queues: which subscriber this is */
+	char *doorbell; /* if non-NULL, attach the doorbell FIFO at this path */
+	bool latency;  /* send timestamps in payloads (both sides must agree) */
+	u64 max_msg;   /* framed queues: largest message the producer sends */
 	int stop_now;
 
 	/* Outputs */
@@ -96,12 +289,35 @@ struct pcq_thread_arg {
 	u64 nfull;  /* # of times full (producer) */
 	u64 nempty; /* # of times empty (consumer) */
 	u64 retries;
+	u64 nbatches; /* # of successful put/get batches */
+	u64 nbytes;   /* framed queues: message bytes sent/received */
+	u64 nindex_reads; /* # of times the other side's index was re-read from memory */
+	u64 ndoorbells; /* # of doorbell rings (producer) or blocking waits (consumer) */
+	struct pcq_hist wakeup_hist; /* from the last full/empty check to the one that wasn't */
+	struct pcq_hist latency_hist; /* consumer: send-to-receive latency (if latency) */
 	int result;
 };
 
+enum pcq_producer_status {
+	PCQ_PUT_GOOD,
+	PCQ_PUT_FULL_NOWAIT,
+	PCQ_PUT_STOPPED,
+	PCQ_PUT_TOO_BIG,
+};
+
+enum pcq_consumer_status {
+	PCQ_GET_GOOD,
+	PCQ_GET_EMPTY,
+	PCQ_GET_STOPPED,
+	PCQ_GET_BAD_MSG,
+	PCQ_GET_TOO_BIG,
+};
+
 struct pcq_status_thread_arg {
-	struct pcq_thread_arg *p; /* producer */
-	struct pcq_thread_arg *c; /* consumer */
+	struct pcq_thread_arg *p; /* producer(s) */
+	struct pcq_thread_arg *c; /* consumer(s) */
+	int np;
+	int nc;
 	char *basename;
 	u64 interval;
 	int stop_now;
@@ -115,12 +331,43 @@ enum pcq_perm {
 	pcq_perm_consumer,
 };
 
+void pcq_hist_record(struct pcq_hist *h, u64 val);
+void pcq_hist_merge(struct pcq_hist *dst, const struct pcq_hist *src);
+u64 pcq_hist_percentile(const struct pcq_hist *h, double pct);
+void pcq_hist_print_json(FILE *f, const struct pcq_hist *h);
+const char *pcq_wait_policy_name(enum pcq_wait_policy policy);
+int pcq_wait_policy_parse(const char *name, enum pcq_wait_policy *policy_out);
+
 int pcq_set_perm(const char *filename, enum pcq_perm role);
-int pcq_create(char *fname, u64 nbuckets, u64 bucket_size, int verbose);
+int pcq_create(char *fname, u64 nbuckets, u64 bucket_size, bool mpmc, bool framed,
+	       u64 nsubscribers, enum mu_csum_type csum_type, int verbose);
 int get_queue_info(const char *fname, FILE *statusfile, int verbose);
 int run_producer(struct pcq_thread_arg *a);
 void *pcq_worker(void *arg);
 void *status_worker(void *arg);
 int run_consumer(struct pcq_thread_arg *a);
 
+struct pcq_handle *pcq_producer_open(const char *fname, int verbose);
+struct pcq_handle *pcq_consumer_open(const char *fname, int verbose);
+struct pcq_handle *pcq_subscriber_open(const char *fname, int subscriber, int verbose);
+void pcq_close(struct pcq_handle *pcqh);
+int pcq_doorbell_attach(struct pcq_handle *pcqh, const char *path, enum pcq_role role);
+int pcq_doorbell_fd(struct pcq_handle *pcqh);
+bool pcq_doorbell_arm(struct pcq_handle *pcqh);
+void pcq_doorbell_ack(struct pcq_handle *pcqh);
+enum pcq_producer_status pcq_put_batch(struct pcq_handle *pcqh, void *entries, u64 nentries,
+				       u64 *nput, struct pcq_thread_arg *a);
+enum pcq_consumer_status pcq_get_batch(struct pcq_handle *pcqh, void *entries, u64 nentries,
+				       u64 *ngot, u64 *first_seq, struct pcq_thread_arg *a);
+enum pcq_producer_status pcq_reserve(struct pcq_handle *pcqh, void **bucket_out,
+				     struct pcq_thread_arg *a);
+void pcq_commit(struct pcq_handle *pcqh, struct pcq_thread_arg *a);
+enum pcq_consumer_status pcq_peek(struct pcq_handle *pcqh, const void **bucket_out,
+				  u64 *seq_out, struct pcq_thread_arg *a);
+void pcq_release(struct pcq_handle *pcqh, struct pcq_thread_arg *a);
+enum pcq_producer_status pcq_put_msg(struct pcq_handle *pcqh, const void *msg, u64 len,
+				     struct pcq_thread_arg *a);
+enum pcq_consumer_status pcq_get_msg(struct pcq_handle *pcqh, void *buf, u64 buflen,
+				     u64 *len_out, struct pcq_thread_arg *a);
+
 #endif
@@ -32,9 +32,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "famfs_lib.h"
 #include "mu_mem.h"
+#include "mu_crc.h"
 #include "random_buffer.h"
 #include "famfs.h"
 #include "pcq.h"
@@ -44,6 +46,8 @@ extern int mock_flush;
 bool
 pcq_valid(struct pcq_handle *pcqh, int verbose)
 {
+	u64 i;
+
 	if (!pcqh) {
 		if (verbose)
 			fprintf(stderr, "pcqh null\n");
@@ -59,7 +63,7 @@ pcq_valid(struct pcq_handle *pcqh, int verbose)
 			fprintf(stderr, "pcqc null\n");
 		return false;
 	}
-	if (pcqh->pcq->pcq_magic != PCQ_MAGIC) {
+	if (pcqh->pcq->pcq_magic != PCQ_MAGIC && !pcq_is_mpmc(pcqh->pcq)) {
 		if (verbose)
 			fprintf(stderr, "pcq bad magic\n");
 		return false;
@@ -69,6 +73,25 @@ pcq_valid(struct pcq_handle *pcqh, int verbose)
 			fprintf(stderr, "pcqc bad magic\n");
 		return false;
 	}
+	if (pcqh->pcq->csum_type >= MU_CSUM_MAX) {
+		if (verbose)
+			fprintf(stderr, "pcq unknown csum_type %lld\n", pcqh->pcq->csum_type);
+		return false;
+	}
+	if (pcqh->pcq->flags & ~PCQ_FLAGS_ALL) {
+		if (verbose)
+			fprintf(stderr, "pcq unknown flags %llx\n", pcqh->pcq->flags);
+		return false;
+	}
+	if (pcq_is_mpmc(pcqh->pcq)) {
+		/* MPMC indices are monotonic tickets */
+		if (pcqh->pcqc->consumer_index > pcqh->pcq->producer_index) {
+			if (verbose)
+				fprintf(stderr, "pcq consumer_index beyond producer_index\n");
+			return false;
+		}
+		return true;
+	}
 	if (pcqh->pcq->producer_index >= pcqh->pcq->nbuckets) {
 		if (verbose)
 			fprintf(stderr, "pcq invalid producer_index\n");
@@ -79,39 +102,73 @@ pcq_valid(struct pcq_handle *pcqh, int verbose)
 			fprintf(stderr, "pcq invalid consumer_index\n");
 		return false;
 	}
+	for (i = 1; i < pcqh->nsubscribers; i++) {
+		struct pcq_consumer *sub = pcqh->subscribers[i];
+
+		if (sub->pcq_consumer_magic != PCQ_CONSUMER_MAGIC ||
+		    sub->consumer_index >= pcqh->pcq->nbuckets) {
+			if (verbose)
+				fprintf(stderr, "pcq subscriber %lld invalid\n", i);
+			return false;
+		}
+	}
 	return true;
 }
 
+/* Number of buckets between a (non-MPMC) consumer index and the producer index */
+static inline u64
+pcq_lag(struct pcq *pcq, u64 pidx, u64 cidx)
+{
+	return (pidx + pcq->nbuckets - cidx) % pcq->nbuckets;
+}
+
+/**
+ * pcq_nmessages() - number of buckets in use
+ *
+ * For the producer (or info) handle of a broadcast queue, this is the slowest
+ * subscriber's backlog.
+ */
 u64
 pcq_nmessages(struct pcq_handle *pcqh)
 {
 	u64 pidx = pcqh->pcq->producer_index;
 	u64 cidx = pcqh->pcqc->consumer_index;
+	u64 nmessages;
+	u64 i;
 
-	if (pidx == cidx)
-		return 0;
-	if (pidx < cidx)
-		pidx = pidx + pcqh->pcq->nbuckets;
-	return pidx - cidx;
+	if (pcq_is_mpmc(pcqh->pcq))
+		return pidx - cidx; /* claimed, not necessarily filled/copied out yet */
+
+	nmessages = pcq_lag(pcqh->pcq, pidx, cidx);
+	for (i = 1; i < pcqh->nsubscribers; i++)
+		nmessages = MAX(nmessages, pcq_lag(pcqh->pcq, pidx,
+						   pcqh->subscribers[i]->consumer_index));
+	return nmessages;
 }
 
 /**
  * pcq_consumer_fname() - get the consumer file name for a pcq
  *
+ * @subscriber: broadcast queues: the subscriber whose consumer file to name (0 for
+ *              the only consumer file of other queues)
+ *
  * Caller must free the returned string
  */
 static char *
-pcq_consumer_fname(const char *basename)
+pcq_consumer_fname(const char *basename, u64 subscriber)
 {
 	char *fname;
 	size_t baselen = strlen(basename);
 
 	assert(baselen > 0);
-	fname = malloc(strlen(basename) + 10);
+	fname = malloc(strlen(basename) + 32);
 	if (!fname)
 		return NULL;
 
-	sprintf(fname, "%s.consumer", basename);
+	if (subscriber)
+		sprintf(fname, "%s.consumer.%lld", basename, subscriber);
+	else
+		sprintf(fname, "%s.consumer", basename);
 	return fname;
 }
 
@@ -126,25 +183,92 @@ pcq_alloc_entry(struct pcq_handle *pcqh)
 {
 	assert(pcqh);
 	assert(pcqh->pcq);
-	assert(pcqh->pcq->pcq_magic == PCQ_MAGIC);
+	assert(pcqh->pcq->pcq_magic == PCQ_MAGIC || pcq_is_mpmc(pcqh->pcq));
 	return calloc(1, pcqh->pcq->bucket_size);
 }
 
+/**
+ * pcq_bucket_addr() - address of bucket @index in the queue
+ */
+static inline void *
+pcq_bucket_addr(struct pcq *pcq, u64 index)
+{
+	return (void *)((u64)pcq + pcq->bucket_array_offset + (index * pcq->bucket_size));
+}
+
+/**
+ * pcq_release_tags() - the per-bucket release tags of an MPMC queue
+ */
+static inline u64 *
+pcq_release_tags(struct pcq_consumer *pcqc)
+{
+	return (u64 *)((u64)pcqc + PCQ_MPMC_RELEASE_OFFSET);
+}
+
+/**
+ * pcq_create_consumer_file() - create and initialize one consumer file of a queue
+ */
+static int
+pcq_create_consumer_file(const char *consumer_fname, u64 csize, u64 nbuckets, bool mpmc)
+{
+	struct pcq_consumer *pcqc;
+	size_t csz;
+	int fd;
+
+	fd = famfs_mkfile(consumer_fname, 0644, 0, 0, csize, 1);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to create consumer file %s\n",
+			__func__, consumer_fname);
+		return -1;
+	}
+	close(fd);
+
+	pcqc = famfs_mmap_whole_file(consumer_fname, 0 /* writable */, &csz);
+	if (!pcqc) {
+		fprintf(stderr, "%s: failed to map consumer file %s\n",
+			__func__, consumer_fname);
+		return -1;
+	}
+
+	pcqc->pcq_consumer_magic = PCQ_CONSUMER_MAGIC;
+	pcqc->consumer_index = 0;
+	pcqc->next_seq = 0;
+	pcqc->pcqc_size = csz;
+	flush_processor_cache(pcqc, sizeof(*pcqc));
+	if (mpmc) {
+		/* All buckets start out free for lap 0 */
+		memset(pcq_release_tags(pcqc), 0, nbuckets * sizeof(u64));
+		flush_processor_cache(pcq_release_tags(pcqc), nbuckets * sizeof(u64));
+	}
+	munmap(pcqc, csz); /* We're the producer; will remap read-only */
+	return 0;
+}
+
+/**
+ * pcq_create() - create the files of a queue
+ *
+ * @nsubscribers: if non-zero, create a broadcast queue with this many subscribers
+ */
 int
 pcq_create(
 	char *fname,
 	u64 nbuckets,
 	u64 bucket_size,
+	bool mpmc,
+	bool framed,
+	u64 nsubscribers,
+	enum mu_csum_type csum_type,
 	int verbose)
 {
 	int two_mb = 2 * 1024 * 1024;
-	struct pcq_consumer *pcqc;
+	u64 nconsumer_files = MAX(nsubscribers, 1);
 	char *consumer_fname;
-	size_t psz, csz;
 	struct pcq *pcq;
 	struct stat st;
-	int rc, rc2;
+	size_t psz;
+	u64 csize;
 	u64 size;
+	u64 i;
 	int fd;
 
 	if (bucket_size & (bucket_size - 1)) {
@@ -152,98 +276,221 @@ pcq_create(
 			__func__, bucket_size);
 		return -1;
 	}
+	if (framed && mpmc) {
+		fprintf(stderr, "%s: framed MPMC queues are not supported\n", __func__);
+		return -1;
+	}
+	if (nsubscribers && mpmc) {
+		fprintf(stderr, "%s: broadcast MPMC queues are not supported\n", __func__);
+		return -1;
+	}
+	if (nsubscribers > PCQ_MAX_SUBSCRIBERS) {
+		fprintf(stderr, "%s: too many subscribers (%lld; max %d)\n",
+			__func__, nsubscribers, PCQ_MAX_SUBSCRIBERS);
+		return -1;
+	}
+	if (framed && bucket_size <= sizeof(struct pcq_frame) + sizeof(u64) +
+	    sizeof(unsigned long)) {
+		fprintf(stderr, "%s: bucket_size %lld too small for a framed queue\n",
+			__func__, bucket_size);
+		return -1;
+	}
 
 	size = two_mb + (nbuckets * bucket_size);
-
-	consumer_fname = pcq_consumer_fname(fname);
-	assert(consumer_fname);
+	csize = two_mb;
+	if (mpmc)
+		csize = PCQ_MPMC_RELEASE_OFFSET + nbuckets * sizeof(u64);
 
 	if (verbose)
-		printf("%s: creating queue  %s / %s\n", __func__, fname, consumer_fname);
+		printf("%s: creating queue %s with %lld consumer file(s)\n",
+		       __func__, fname, nconsumer_files);
 	/*
-	 * Fail if either file already exists
+	 * Fail if any of the files already exists
 	 */
-	rc = stat(consumer_fname, &st);
-	rc2 = stat(fname, &st);
-	if (rc == 0 || rc2 == 0) {
-		fprintf(stderr,
-			"%s: can't create pcq %s - something with that name already exists\n",
-			__func__, fname);
-		rc = -1;
-		goto out;
+	for (i = 0; i <= nconsumer_files; i++) {
+		/* The last iteration checks the producer file */
+		consumer_fname = (i < nconsumer_files) ? pcq_consumer_fname(fname, i) : NULL;
+		if (stat((consumer_fname) ? consumer_fname : fname, &st) == 0) {
+			fprintf(stderr,
+				"%s: can't create pcq %s - something with that name already exists\n",
+				__func__, fname);
+			free(consumer_fname);
+			return -1;
+		}
+		free(consumer_fname);
 	}
 
 	/*
-	 * Create the consumer file
+	 * Create the consumer file(s) first
 	 */
-	fd = famfs_mkfile(consumer_fname, 0644, 0, 0, two_mb, 1);
-	if (fd < 0) {
-		fprintf(stderr, "%s: failed to create consumer file\n", __func__);
-		rc = -1;
-		goto out;
-	}
-	close(fd);
+	for (i = 0; i < nconsumer_files; i++) {
+		int rc;
 
-	/* Producer maps/creates consumer file first */
-	pcqc = famfs_mmap_whole_file(consumer_fname, 0 /* writable */, &csz);
-	if (!pcqc) {
-		fprintf(stderr, "%s: failed to create consumer file\n", __func__);
+		consumer_fname = pcq_consumer_fname(fname, i);
+		assert(consumer_fname);
+		rc = pcq_create_consumer_file(consumer_fname, csize, nbuckets, mpmc);
 		free(consumer_fname);
-		rc = -1;
-		goto out;
+		if (rc)
+			return -1;
 	}
 
-	pcqc->pcq_consumer_magic = PCQ_CONSUMER_MAGIC;
-	pcqc->consumer_index = 0;
-	pcqc->next_seq = 0;
-	pcqc->pcqc_size = csz;
-	flush_processor_cache(pcqc, sizeof(*pcqc));
-	munmap(pcqc, csz); /* We're the producer; will remap read-only */
-
 	/*
 	 * Create the producer file
 	 */
 	fd = famfs_mkfile(fname, 0644, 0, 0, size, 1);
 	if (fd < 0) {
 		fprintf(stderr, "%s: failed to create producer file\n", __func__);
-		rc = -1;
-		goto out;
+		return -1;
 	}
 	close(fd);
 
 	pcq = famfs_mmap_whole_file(fname, 0 /* writable */, &psz);
-	if (!pcq) {
-		rc = -1;
-		goto out;
-	}
+	if (!pcq)
+		return -1;
 
-	pcq->pcq_magic = PCQ_MAGIC;
+	pcq->pcq_magic = (mpmc) ? PCQ_MPMC_MAGIC : PCQ_MAGIC;
 	pcq->nbuckets = nbuckets;
 	pcq->bucket_size = bucket_size;
 	pcq->bucket_array_offset = two_mb;
 	pcq->producer_index = 0ULL;
+	pcq->nsubscribers = nsubscribers;
+	pcq->flags = (framed) ? PCQ_FLAG_FRAMED : 0;
+	if (nsubscribers)
+		pcq->flags |= PCQ_FLAG_BROADCAST;
+	pcq->csum_type = csum_type;
 	pcq->next_seq = 0;
 	pcq->pcq_size = psz;
 	flush_processor_cache(pcq, sizeof(*pcq));
+	for (i = 0; mpmc && i < nbuckets; i++) {
+		/* A zero sequence tag matches no ticket, so no bucket looks ready */
+		u64 *tagp = (u64 *)((u64)pcq_bucket_addr(pcq, i) + pcq_seq_offset(pcq));
+
+		*tagp = 0;
+		flush_processor_cache(tagp, sizeof(*tagp));
+	}
 
 	if (verbose) {
 		printf("%s: sizeof(crc)=%ld\n", __func__, sizeof(unsigned long));
+		printf("%s: csum=%s\n", __func__, mu_csum_name(csum_type));
+		printf("%s: framed=%d\n", __func__, framed);
+		printf("%s: nsubscribers=%lld\n", __func__, nsubscribers);
 		printf("%s: bucket_size=%lld\n", __func__, pcq->bucket_size);
 		printf("%s: payload_size=%ld\n", __func__, pcq_payload_size(pcq));
 	}
 	munmap(pcq, psz);
-	munmap(pcqc, csz);
 	printf("%s: Created queue %s\n", __func__, fname);
-out:
-	free(consumer_fname);
 	return 0;
 }
 
+/**
+ * pcq_close() - unmap a queue's files and free @pcqh
+ */
+void
+pcq_close(struct pcq_handle *pcqh)
+{
+	u64 i;
+
+	if (!pcqh)
+		return;
+	/* subscribers[0] is pcqc */
+	for (i = 1; i < pcqh->nsubscribers; i++)
+		munmap(pcqh->subscribers[i], pcqh->subscribers[i]->pcqc_size);
+	free(pcqh->subscribers);
+	for (i = 0; i < pcqh->ndoorbells; i++)
+		close(pcqh->doorbells[i].fd);
+	free(pcqh->doorbells);
+	munmap(pcqh->pcqc, pcqh->pcqc->pcqc_size);
+	munmap(pcqh->pcq, pcqh->pcq->pcq_size);
+	free(pcqh);
+}
+
+/**
+ * pcq_open_subscribers() - producer/info side: map the consumer file of every
+ *                          subscriber of a broadcast queue read-only
+ */
+static int
+pcq_open_subscribers(struct pcq_handle *pcqh, const char *fname)
+{
+	u64 nsubscribers = pcqh->pcq->nsubscribers;
+	u64 i;
 
-struct pcq_handle *
+	if (nsubscribers < 1 || nsubscribers > PCQ_MAX_SUBSCRIBERS) {
+		fprintf(stderr, "%s: queue %s has invalid nsubscribers %lld\n",
+			__func__, fname, nsubscribers);
+		return -1;
+	}
+	pcqh->subscribers = calloc(nsubscribers, sizeof(*pcqh->subscribers));
+	assert(pcqh->subscribers);
+	pcqh->subscribers[0] = pcqh->pcqc;
+	pcqh->nsubscribers = 1;
+
+	for (i = 1; i < nsubscribers; i++) {
+		char *consumer_fname = pcq_consumer_fname(fname, i);
+		size_t csz;
+
+		pcqh->subscribers[i] = famfs_mmap_whole_file(consumer_fname, 1, &csz);
+		if (!pcqh->subscribers[i]) {
+			fprintf(stderr, "%s: failed to map subscriber file %s\n",
+				__func__, consumer_fname);
+			free(consumer_fname);
+			return -1;
+		}
+		free(consumer_fname);
+		pcqh->nsubscribers++;
+	}
+	return 0;
+}
+
+/**
+ * pcq_read_consumer_index() - re-read the consumer_index that limits the producer
+ *
+ * On a broadcast queue this re-reads every subscriber's consumer_index and returns the
+ * one with the fewest free buckets after @put_index (i.e. the slowest subscriber).
+ */
+static u64
+pcq_read_consumer_index(struct pcq_handle *pcqh, u64 put_index, struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	u64 slowest, min_free;
+	u64 i;
+
+	if (!pcqh->subscribers) {
+		struct pcq_consumer *pcqc = pcqh->pcqc;
+
+		invalidate_processor_cache(&pcqc->consumer_index,
+					   sizeof(pcqc->consumer_index));
+		a->nindex_reads++;
+		return pcqc->consumer_index;
+	}
+
+	slowest = put_index;
+	min_free = pcq->nbuckets;
+	for (i = 0; i < pcqh->nsubscribers; i++) {
+		struct pcq_consumer *sub = pcqh->subscribers[i];
+		u64 cidx, nfree;
+
+		invalidate_processor_cache(&sub->consumer_index, sizeof(sub->consumer_index));
+		cidx = sub->consumer_index;
+		nfree = (cidx + pcq->nbuckets - put_index - 1) % pcq->nbuckets;
+		if (nfree < min_free) {
+			min_free = nfree;
+			slowest = cidx;
+		}
+	}
+	a->nindex_reads += pcqh->nsubscribers;
+	return slowest;
+}
+
+/**
+ * pcq_open() - map a queue's files for @role
+ *
+ * @subscriber: consumers of broadcast queues: the subscriber whose consumer file to use
+ */
+static struct pcq_handle *
 pcq_open(
 	const char *fname,
 	enum pcq_role role,
+	int subscriber,
 	int verbose)
 {
 	int rc;
@@ -254,11 +501,16 @@ pcq_open(
 	char *consumer_fname;
 	struct stat st;
 
-	consumer_fname = pcq_consumer_fname(fname);
+	consumer_fname = pcq_consumer_fname(fname, (role == CONSUMER) ? subscriber : 0);
 
 	rc = stat(consumer_fname, &st);
 	if (rc) {
-		fprintf(stderr, "%s: pcq files not found for queue %s\n", __func__, fname);
+		if (subscriber)
+			fprintf(stderr, "%s: queue %s has no subscriber %d\n",
+				__func__, fname, subscriber);
+		else
+			fprintf(stderr, "%s: pcq files not found for queue %s\n",
+				__func__, fname);
 		free(consumer_fname);
 		return NULL;
 	}
@@ -276,291 +528,1638 @@ pcq_open(
 		free(consumer_fname);
 		return NULL;
 	}
+	free(consumer_fname);
 
 	pcqh = calloc(1, sizeof(*pcqh));
 	pcqh->pcq = pcq;
 	pcqh->pcqc = pcqc;
 
+	if (pcq->csum_type >= MU_CSUM_MAX || (pcq->flags & ~PCQ_FLAGS_ALL)) {
+		fprintf(stderr, "%s: queue %s has unknown csum_type %lld or flags %llx\n",
+			__func__, fname, pcq->csum_type, pcq->flags);
+		pcq_close(pcqh);
+		return NULL;
+	}
+	if (subscriber && (!pcq_is_broadcast(pcq) || (u64)subscriber >= pcq->nsubscribers)) {
+		fprintf(stderr, "%s: queue %s has no subscriber %d\n",
+			__func__, fname, subscriber);
+		pcq_close(pcqh);
+		return NULL;
+	}
+	if (pcq_is_broadcast(pcq) && role != CONSUMER && pcq_open_subscribers(pcqh, fname)) {
+		pcq_close(pcqh);
+		return NULL;
+	}
+
+	pcqh->subscriber = (role == CONSUMER) ? subscriber : 0;
+	pcqh->cached_producer_index = pcq->producer_index;
+	if (role == CONSUMER) {
+		pcqh->cached_consumer_index = pcqc->consumer_index;
+	} else {
+		struct pcq_thread_arg a = { 0 };
+
+		/* The cached copy must not over-report free space, so on a broadcast queue
+		 * it starts as the slowest subscriber's consumer_index (not subscriber 0's)
+		 */
+		invalidate_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+		pcqh->cached_consumer_index = pcq_read_consumer_index(pcqh,
+								      pcq->producer_index, &a);
+	}
+
 	if (verbose) {
 		printf("%s: sizeof(crc)=%ld\n", __func__, sizeof(unsigned long));
+		printf("%s: csum=%s\n", __func__, mu_csum_name(pcq->csum_type));
 		printf("%s: bucket_size=%lld\n", __func__, pcq->bucket_size);
 		printf("%s: payload_size=%ld\n", __func__, pcq_payload_size(pcq));
+		if (pcq_is_broadcast(pcq))
+			printf("%s: nsubscribers=%lld\n", __func__, pcq->nsubscribers);
 	}
 
-	free(consumer_fname);
 	return pcqh;
 }
 
 struct pcq_handle *
 pcq_producer_open(const char *fname, int verbose)
 {
-	return pcq_open(fname, PRODUCER, verbose);
+	return pcq_open(fname, PRODUCER, 0, verbose);
 }
 
 struct pcq_handle *
 pcq_consumer_open(const char *fname, int verbose)
 {
-	return pcq_open(fname, CONSUMER, verbose);
+	return pcq_open(fname, CONSUMER, 0, verbose);
 }
 
-enum pcq_producer_status {
-	PCQ_PUT_GOOD,
-	PCQ_PUT_FULL_NOWAIT,
-	PCQ_PUT_STOPPED,
-};
+/**
+ * pcq_subscriber_open() - open a broadcast queue as consumer @subscriber
+ */
+struct pcq_handle *
+pcq_subscriber_open(const char *fname, int subscriber, int verbose)
+{
+	return pcq_open(fname, CONSUMER, subscriber, verbose);
+}
 
 /**
- * pcq_producer_put() - put an in a pcq
+ * pcq_bucket_range_op() - apply a cache operation to @n buckets starting at @index
  *
- * NOTE: this function must not be called re-entrantly for the same queue
+ * The buckets may wrap around the end of the bucket array, in which case this takes two
+ * calls to @op rather than one.
  */
-static enum pcq_producer_status
-pcq_producer_put(
-	struct pcq_handle *pcqh,
-	void  *entry,
-	struct pcq_thread_arg *a)
+static void
+pcq_bucket_range_op(
+	struct pcq *pcq,
+	u64         index,
+	u64         n,
+	void      (*op)(const void *addr, size_t len))
 {
-	unsigned long crc = crc32(0L, Z_NULL, 0);
-	struct pcq_consumer *pcqc = pcqh->pcqc;
-	struct pcq *pcq = pcqh->pcq;
-	u64 crc_offset, seq_offset;
-	unsigned long *crcp;
-	void *bucket_addr;
-	u64 put_index;
-	bool full = false;
-	u64 *seqp;
+	u64 n1 = MIN(n, pcq->nbuckets - index);
 
-	/* Bucket size is inclusive of sequence number and crc at the end
-	 * Compute pointers to those. We do this in the entry before we memcpy
-	 * it into the queue bucket.
-	 */
-	crc_offset = pcq_crc_offset(pcq);
-	seq_offset = pcq_seq_offset(pcq);
+	op(pcq_bucket_addr(pcq, index), n1 * pcq->bucket_size);
+	if (n > n1)
+		op(pcq_bucket_addr(pcq, 0), (n - n1) * pcq->bucket_size);
+}
 
-	/* crc and sequence pointers into the entry */
-	crcp = (unsigned long *)((u64)entry + crc_offset);
-	seqp = (u64 *)((u64)entry + seq_offset);
+/*
+ * Latency histograms
+ */
 
-	assert(pcq->pcq_magic == PCQ_MAGIC);
-	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+static inline u64
+pcq_hist_index(u64 val)
+{
+	int shift;
 
-	do {
-		put_index = pcq->producer_index;
+	if (val < (1ULL << PCQ_HIST_SUB_BITS))
+		return val;
 
-		if (((put_index + 1) % pcq->nbuckets ) != pcqc->consumer_index)
-			break; /* Not full - proceed */
+	shift = 63 - __builtin_clzll(val) - PCQ_HIST_SUB_BITS;
+	return ((u64)(shift + 1) << PCQ_HIST_SUB_BITS) +
+		((val >> shift) & ((1ULL << PCQ_HIST_SUB_BITS) - 1));
+}
 
-		/* Queue looks full */
-		if (!full) { /* Count full only once per call to this function */
-			full = true;
-			a->nfull++;
-		}
-		if (a->stop_now) {
-			return PCQ_PUT_STOPPED;
-		}
-		else if (a->wait) {
-			invalidate_processor_cache(&pcqc->consumer_index,
-						   sizeof(pcqc->consumer_index));
-			sched_yield();
-		} else {
-			fprintf(stderr, "%s: queue full no wait\n", __func__);
-			return PCQ_PUT_FULL_NOWAIT;
-		}
-	} while (true);
+/* Largest value that lands in bucket @index */
+static inline u64
+pcq_hist_bucket_max(u64 index)
+{
+	u64 sub = index & ((1ULL << PCQ_HIST_SUB_BITS) - 1);
+	int shift;
 
-	/* Set seq and crc in entry before we memcpy it into the bucket */
-	*seqp = pcq->next_seq++;
-	crc = crc32(crc, entry, pcq_payload_size(pcq) + sizeof(*seqp));
-	*crcp = crc;
+	if (index < (1ULL << PCQ_HIST_SUB_BITS))
+		return index;
 
-	if (a->verbose) {
-		printf("%s: put_index=%lld seq=%lld\n", __func__, put_index, *seqp);
-		if (a->verbose > 1) {
-			printf("%s: bucket_size=%lld seq_offset=%lld "
-			       "crc_offset=%lld crc %lx/%lx\n",
-			       __func__, pcq->bucket_size, seq_offset, crc_offset,
-			       crc, *crcp);
-		}
-	}
+	shift = (int)(index >> PCQ_HIST_SUB_BITS) - 1;
+	return (((1ULL << PCQ_HIST_SUB_BITS) + sub) << shift) + ((1ULL << shift) - 1);
+}
 
-	/*
-	 * Put entry into the queue
-	 */
-	bucket_addr = (void *)((u64)pcq + pcq->bucket_array_offset +
-			       (put_index * pcq->bucket_size));
-	memcpy(bucket_addr, entry, pcq->bucket_size);
-	flush_processor_cache(bucket_addr, pcq->bucket_size);
-	pcq->producer_index = (put_index + 1) % pcq->nbuckets;
-	flush_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+void
+pcq_hist_record(struct pcq_hist *h, u64 val)
+{
+	if (!h->count || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+	h->count++;
+	h->buckets[pcq_hist_index(val)]++;
+}
 
-	a->nsent++;
-	return 0;
+void
+pcq_hist_merge(struct pcq_hist *dst, const struct pcq_hist *src)
+{
+	int i;
+
+	if (!src->count)
+		return;
+	if (!dst->count || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	for (i = 0; i < PCQ_HIST_NBUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
 }
 
-enum pcq_consumer_status {
-	PCQ_GET_GOOD,
-	PCQ_GET_EMPTY,
-	PCQ_GET_STOPPED,
-	PCQ_GET_BAD_MSG,
-};
+/**
+ * pcq_hist_percentile()
+ *
+ * @h:   histogram
+ * @pct: percentile (0-100)
+ *
+ * Returns the upper bound of the bucket holding the @pct percentile value (clipped to
+ * the max recorded value), or 0 if the histogram is empty.
+ */
+u64
+pcq_hist_percentile(const struct pcq_hist *h, double pct)
+{
+	u64 rank, sum = 0;
+	int i;
 
-#define CONSUMER_NRETRIES 2
+	if (!h->count)
+		return 0;
+
+	rank = (u64)((pct / 100.0) * h->count + 0.5);
+	rank = MAX(rank, 1);
+	rank = MIN(rank, h->count);
+	for (i = 0; i < PCQ_HIST_NBUCKETS; i++) {
+		sum += h->buckets[i];
+		if (sum >= rank)
+			return MIN(pcq_hist_bucket_max(i), h->max);
+	}
+	return h->max;
+}
 
 /**
- * pcq_consumer_get() - get an element from a pcq
+ * pcq_hist_print_json() - print a histogram as a JSON object
  *
- * NOTE: this function must not be called re-entrantly for the same queue
+ * Percentiles and each non-empty bucket (as [upper bound, count]) are included.
  */
-static enum pcq_consumer_status
-pcq_consumer_get(
-	struct pcq_handle *pcqh,
-	void  *entry_out,
-	u64 *seq_out,
-	struct pcq_thread_arg *a)
+void
+pcq_hist_print_json(FILE *f, const struct pcq_hist *h)
 {
-	unsigned long crc;
-	struct pcq_consumer *pcqc = pcqh->pcqc;
-	int retries = CONSUMER_NRETRIES;
-	struct pcq *pcq = pcqh->pcq;
-	u64 crc_offset, seq_offset;
-	bool retry_counted = false;
-	bool good_crc = true;
-	unsigned long *crcp;
-	void *bucket_addr;
-	u64 seq_expect;
-	u64 get_index;
-	bool empty = false;
-	int errs = 0;
-	u64 *seqp;
+	bool first = true;
+	int i;
+
+	fprintf(f, "{\"count\": %lld, \"min\": %lld, \"max\": %lld, "
+		"\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p99.9\": %lld, "
+		"\"buckets\": [",
+		h->count, h->min, h->max,
+		pcq_hist_percentile(h, 50), pcq_hist_percentile(h, 90),
+		pcq_hist_percentile(h, 99), pcq_hist_percentile(h, 99.9));
+	for (i = 0; i < PCQ_HIST_NBUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		fprintf(f, "%s[%lld, %lld]", (first) ? "" : ", ",
+			pcq_hist_bucket_max(i), h->buckets[i]);
+		first = false;
+	}
+	fprintf(f, "]}");
+}
 
-	assert(pcq->pcq_magic == PCQ_MAGIC);
-	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+/*
+ * Wait policies
+ */
 
-	/* Wait until there is in a message to consume (breaking out if we get stopped) */
-	do {
-		get_index = pcqc->consumer_index;
+static const char *pcq_wait_policy_names[] = {
+	[PCQ_WAIT_YIELD]   = "yield",
+	[PCQ_WAIT_SPIN]    = "spin",
+	[PCQ_WAIT_BACKOFF] = "backoff",
+	[PCQ_WAIT_SLEEP]   = "sleep",
+};
+#define PCQ_NWAIT_POLICIES (sizeof(pcq_wait_policy_names) / sizeof(pcq_wait_policy_names[0]))
+
+const char *
+pcq_wait_policy_name(enum pcq_wait_policy policy)
+{
+	if ((unsigned int)policy >= PCQ_NWAIT_POLICIES)
+		return "unknown";
+	return pcq_wait_policy_names[policy];
+}
+
+int
+pcq_wait_policy_parse(const char *name, enum pcq_wait_policy *policy_out)
+{
+	unsigned int i;
+
+	for (i = 0; i < PCQ_NWAIT_POLICIES; i++) {
+		if (strcmp(name, pcq_wait_policy_names[i]) == 0) {
+			*policy_out = (enum pcq_wait_policy)i;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static inline u64
+pcq_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+pcq_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/**
+ * struct pcq_waiter - state of one wait for a full (empty) queue to become not full
+ *                     (not empty)
+ *
+ * @nwaits:  number of times pcq_wait() has been called
+ * @last_ns: when the queue was last found full (empty)
+ */
+struct pcq_waiter {
+	u64 nwaits;
+	u64 last_ns;
+};
+
+/**
+ * pcq_wait() - wait once, per @a->wait_policy, before the caller checks the queue again
+ */
+static void
+pcq_wait(struct pcq_thread_arg *a, struct pcq_waiter *w)
+{
+	u64 i, nspins, sleep_us, sleep_max_us;
+	struct timespec ts;
+
+	w->last_ns = pcq_now_ns();
+
+	switch (a->wait_policy) {
+	case PCQ_WAIT_SPIN:
+		pcq_cpu_relax();
+		break;
+
+	case PCQ_WAIT_BACKOFF:
+		nspins = (w->nwaits < 63) ? (1ULL << w->nwaits) : PCQ_BACKOFF_MAX_SPINS;
+		nspins = MIN(nspins, PCQ_BACKOFF_MAX_SPINS);
+		for (i = 0; i < nspins; i++)
+			pcq_cpu_relax();
+		if (nspins == PCQ_BACKOFF_MAX_SPINS)
+			sched_yield();
+		break;
+
+	case PCQ_WAIT_SLEEP:
+		sleep_max_us = (a->sleep_max_us) ? a->sleep_max_us : PCQ_SLEEP_MAX_US_DEFAULT;
+		sleep_us = (w->nwaits < 63) ? (1ULL << w->nwaits) : sleep_max_us;
+		sleep_us = MIN(sleep_us, sleep_max_us);
+		ts.tv_sec = sleep_us / 1000000;
+		ts.tv_nsec = (sleep_us % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+		break;
+
+	case PCQ_WAIT_YIELD:
+	default:
+		sched_yield();
+		break;
+	}
+	w->nwaits++;
+}
+
+/**
+ * pcq_wait_done() - the queue is no longer full (empty); record the wakeup latency
+ *
+ * The wakeup latency is the time from the last check that found the queue full (empty)
+ * to the check that didn't - an upper bound on how long it took the waiter to notice.
+ */
+static inline void
+pcq_wait_done(struct pcq_thread_arg *a, struct pcq_waiter *w)
+{
+	if (w->nwaits)
+		pcq_hist_record(&a->wakeup_hist, pcq_now_ns() - w->last_ns);
+}
+
+/**
+ * pcq_doorbell_fname() - get the doorbell FIFO name for @subscriber
+ *
+ * Caller must free the returned string
+ */
+static char *
+pcq_doorbell_fname(const char *path, u64 subscriber)
+{
+	char *fname = malloc(strlen(path) + 32);
+
+	if (!fname)
+		return NULL;
+	if (subscriber)
+		sprintf(fname, "%s.%lld", path, subscriber);
+	else
+		strcpy(fname, path);
+	return fname;
+}
+
+/**
+ * pcq_doorbell_open() - open (creating if necessary) one doorbell FIFO
+ *
+ * The FIFO is opened O_RDWR, which on Linux neither blocks nor fails when the other
+ * side has not opened it yet; both sides use it non-blocking.
+ */
+static int
+pcq_doorbell_open(const char *path, u64 subscriber)
+{
+	char *fname = pcq_doorbell_fname(path, subscriber);
+	struct stat st;
+	int fd;
+
+	assert(fname);
+	if (mkfifo(fname, 0666) && errno != EEXIST) {
+		fprintf(stderr, "%s: failed to create doorbell %s (errno %d)\n",
+			__func__, fname, errno);
+		free(fname);
+		return -1;
+	}
+	fd = open(fname, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) || !S_ISFIFO(st.st_mode)) {
+		fprintf(stderr, "%s: %s is not a usable doorbell FIFO\n", __func__, fname);
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	free(fname);
+	return fd;
+}
+
+/**
+ * pcq_doorbell_attach() - attach the doorbell at @path to a queue handle
+ *
+ * @role: PRODUCER to ring the doorbell(s) of all consumers after publishing, or
+ *        CONSUMER to block on this consumer's doorbell while the queue is empty
+ *
+ * Returns 0 on success
+ */
+int
+pcq_doorbell_attach(struct pcq_handle *pcqh, const char *path, enum pcq_role role)
+{
+	u64 i, n;
+
+	assert(!pcqh->doorbells);
+	if (pcq_is_mpmc(pcqh->pcq)) {
+		fprintf(stderr, "%s: doorbells are not supported on MPMC queues\n", __func__);
+		return -1;
+	}
+	if (role != PRODUCER && role != CONSUMER)
+		return -1;
+
+	n = (role == PRODUCER) ? MAX(pcqh->nsubscribers, 1) : 1;
+	pcqh->doorbells = calloc(n, sizeof(*pcqh->doorbells));
+	assert(pcqh->doorbells);
+	for (i = 0; i < n; i++) {
+		u64 subscriber = (role == PRODUCER) ? i : pcqh->subscriber;
+
+		pcqh->doorbells[i].fd = pcq_doorbell_open(path, subscriber);
+		if (pcqh->doorbells[i].fd < 0)
+			goto err;
+		pcqh->ndoorbells++;
+	}
+	return 0;
+
+err:
+	for (i = 0; i < pcqh->ndoorbells; i++)
+		close(pcqh->doorbells[i].fd);
+	free(pcqh->doorbells);
+	pcqh->doorbells = NULL;
+	pcqh->ndoorbells = 0;
+	return -1;
+}
+
+/**
+ * pcq_doorbell_fd() - consumer's doorbell fd (for poll/epoll), or -1 if none
+ */
+int
+pcq_doorbell_fd(struct pcq_handle *pcqh)
+{
+	return (pcqh->doorbells) ? pcqh->doorbells[0].fd : -1;
+}
+
+/**
+ * pcq_doorbell_arm() - ask the producer to ring this consumer's doorbell
+ *
+ * Returns true if the queue is still empty, in which case the caller may block until
+ * pcq_doorbell_fd() is readable; false if it is not (don't block). Either way, call
+ * pcq_doorbell_ack() before getting entries.
+ *
+ * The doorbell is only for consumers on the producer's host, so doorbell_gen is shared
+ * through the (coherent) cache without flushes or invalidates.
+ */
+bool
+pcq_doorbell_arm(struct pcq_handle *pcqh)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+
+	if (!(pcqc->doorbell_gen & 1)) /* else still armed from an unacked arm */
+		__atomic_store_n(&pcqc->doorbell_gen, pcqc->doorbell_gen + 1,
+				 __ATOMIC_RELAXED);
+	/* Order the flag store before the producer_index load (see pcq_doorbell_ring()) */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	pcqh->cached_producer_index = __atomic_load_n(&pcq->producer_index, __ATOMIC_RELAXED);
+	return pcqh->cached_producer_index == pcqc->consumer_index;
+}
+
+/**
+ * pcq_doorbell_ack() - drain this consumer's doorbell and disarm it
+ */
+void
+pcq_doorbell_ack(struct pcq_handle *pcqh)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	char buf[64];
+
+	if (pcqc->doorbell_gen & 1)
+		__atomic_store_n(&pcqc->doorbell_gen, pcqc->doorbell_gen + 1,
+				 __ATOMIC_RELAXED);
+	while (read(pcqh->doorbells[0].fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/**
+ * pcq_doorbell_ring() - producer: ring the doorbell of each consumer that is waiting
+ *
+ * Called after producer_index is published. Either this sees the consumer's odd
+ * doorbell_gen, or the consumer's pcq_doorbell_arm() sees the new producer_index, so no
+ * wakeup is lost. Each wait (generation) is rung at most once.
+ */
+static void
+pcq_doorbell_ring(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	const char one = 1;
+	u64 i;
+
+	if (!pcqh->doorbells)
+		return;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < pcqh->ndoorbells; i++) {
+		struct pcq_doorbell *db = &pcqh->doorbells[i];
+		struct pcq_consumer *pcqc = (pcqh->subscribers) ?
+			pcqh->subscribers[i] : pcqh->pcqc;
+		u64 gen = __atomic_load_n(&pcqc->doorbell_gen, __ATOMIC_RELAXED);
+
+		if (!(gen & 1) || gen == db->rung_gen)
+			continue;
+		/* A full FIFO (EAGAIN) has a wakeup pending already */
+		if (write(db->fd, &one, 1) == 1)
+			a->ndoorbells++;
+		db->rung_gen = gen;
+	}
+}
+
+/**
+ * pcq_doorbell_wait() - consumer: block on the doorbell (in place of pcq_wait())
+ */
+static void
+pcq_doorbell_wait(struct pcq_handle *pcqh, struct pcq_thread_arg *a, struct pcq_waiter *w)
+{
+	struct pollfd pfd = { .fd = pcq_doorbell_fd(pcqh), .events = POLLIN };
+
+	w->last_ns = pcq_now_ns();
+	if (pcq_doorbell_arm(pcqh)) {
+		poll(&pfd, 1, PCQ_DOORBELL_POLL_MS);
+		a->ndoorbells++;
+	}
+	pcq_doorbell_ack(pcqh);
+	w->nwaits++;
+}
+
+/**
+ * pcq_wait_for_space() - wait (per @a) until the queue has at least @need free buckets
+ *
+ * @need:      number of free buckets needed (1 unless a framed message spans buckets)
+ * @put_index: the producer_index
+ * @nfree:     number of free buckets starting at @put_index
+ *
+ * Free space is computed from the handle's cached copy of the consumer_index. A stale
+ * copy can only under-report free space, so the shared consumer_index line is only
+ * invalidated and re-read when the cached copy says the queue is full. On a broadcast
+ * queue the cached copy is the slowest subscriber's consumer_index, and all of the
+ * subscribers' lines are re-read at that point.
+ */
+static enum pcq_producer_status
+pcq_wait_for_space(
+	struct pcq_handle     *pcqh,
+	struct pcq_thread_arg *a,
+	u64                    need,
+	u64                   *put_index,
+	u64                   *nfree)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+	struct pcq_waiter w = { 0 };
+	bool full = false;
+
+	assert(pcq->pcq_magic == PCQ_MAGIC);
+	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+
+	do {
+		*put_index = pcq->producer_index;
+
+		/* One bucket is always left empty, so full is distinguishable from empty */
+		*nfree = (pcqh->cached_consumer_index + pcq->nbuckets - *put_index - 1) %
+			pcq->nbuckets;
+		if (*nfree >= need)
+			break; /* Not full - proceed */
+
+		/* Looks full per the cached copy; re-read the shared consumer_index */
+		pcqh->cached_consumer_index = pcq_read_consumer_index(pcqh, *put_index, a);
+
+		*nfree = (pcqh->cached_consumer_index + pcq->nbuckets - *put_index - 1) %
+			pcq->nbuckets;
+		if (*nfree >= need)
+			break;
+
+		/* Queue is full */
+		if (!full) { /* Count full only once per call to this function */
+			full = true;
+			a->nfull++;
+		}
+		if (a->stop_now) {
+			return PCQ_PUT_STOPPED;
+		}
+		else if (a->wait) {
+			pcq_wait(a, &w);
+		} else {
+			fprintf(stderr, "%s: queue full no wait\n", __func__);
+			return PCQ_PUT_FULL_NOWAIT;
+		}
+	} while (true);
+
+	pcq_wait_done(a, &w);
+	return PCQ_PUT_GOOD;
+}
+
+/**
+ * pcq_entry_crc() - crc of an entry's payload and seq, per the queue's csum_type
+ *
+ * In a framed queue the crc covers the frame header, the used part of the payload and
+ * the seq.
+ */
+static inline unsigned long
+pcq_entry_crc(struct pcq *pcq, const void *entry)
+{
+	enum mu_csum_type type = (enum mu_csum_type)pcq->csum_type;
+	const struct pcq_frame *frame = (const struct pcq_frame *)entry;
+	unsigned long crc;
+	u64 len;
+
+	if (!pcq_is_framed(pcq))
+		return mu_csum(type, entry, pcq_payload_size(pcq) + sizeof(u64));
+
+	/* A torn or corrupt len can't take us outside the bucket; the crc will fail */
+	len = MIN((u64)frame->len, pcq_frame_capacity(pcq));
+	crc = mu_csum(type, entry, sizeof(*frame) + len);
+	return mu_csum_update(type, crc, (void *)((u64)entry + pcq_seq_offset(pcq)),
+			      sizeof(u64));
+}
+
+/**
+ * pcq_seal_entry() - set the seq and crc at the end of an entry (or bucket)
+ */
+static void
+pcq_seal_entry(
+	struct pcq            *pcq,
+	void                  *entry,
+	u64                    index,
+	u64                    seq,
+	struct pcq_thread_arg *a)
+{
+	u64 crc_offset = pcq_crc_offset(pcq);
+	u64 seq_offset = pcq_seq_offset(pcq);
+	unsigned long *crcp = (unsigned long *)((u64)entry + crc_offset);
+	u64 *seqp = (u64 *)((u64)entry + seq_offset);
+	unsigned long crc;
+
+	*seqp = seq;
+	crc = pcq_entry_crc(pcq, entry);
+	*crcp = crc;
+
+	if (a->verbose) {
+		printf("%s: put_index=%lld seq=%lld\n", __func__, index, *seqp);
+		if (a->verbose > 1) {
+			printf("%s: bucket_size=%lld seq_offset=%lld "
+			       "crc_offset=%lld crc %lx/%lx\n",
+			       __func__, pcq->bucket_size, seq_offset, crc_offset,
+			       crc, *crcp);
+		}
+	}
+}
+
+/**
+ * pcq_publish() - write back @n filled buckets at @put_index and advance producer_index
+ *
+ * All of the buckets are written back before the producer_index is updated (once).
+ */
+static void
+pcq_publish(
+	struct pcq            *pcq,
+	u64                    put_index,
+	u64                    n)
+{
+	pcq_bucket_range_op(pcq, put_index, n, writeback_processor_cache);
+	pcq->producer_index = (put_index + n) % pcq->nbuckets;
+	writeback_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+}
+
+/**
+ * pcq_mpmc_put() - put one entry in an MPMC queue
+ *
+ * Claims the next ticket with compare-and-swap once its bucket has been released by the
+ * consumers, fills the bucket, and then sets the bucket's sequence tag to publish it.
+ * Safe to call concurrently from multiple threads (see PCQ_MPMC_MAGIC).
+ */
+static enum pcq_producer_status
+pcq_mpmc_put(
+	struct pcq_handle     *pcqh,
+	void                  *entry,
+	struct pcq_thread_arg *a)
+{
+	u64 *release = pcq_release_tags(pcqh->pcqc);
+	struct pcq *pcq = pcqh->pcq;
+	u64 seq_offset = pcq_seq_offset(pcq);
+	u64 crc_offset = pcq_crc_offset(pcq);
+	struct pcq_waiter w = { 0 };
+	bool full = false;
+	void *bucket_addr;
+	u64 *tagp;
+	u64 t, b;
+
+	assert(pcq_is_mpmc(pcq));
+
+	do {
+		t = __atomic_load_n(&pcq->producer_index, __ATOMIC_ACQUIRE);
+		b = t % pcq->nbuckets;
+
+		invalidate_processor_cache(&release[b], sizeof(release[b]));
+		if (__atomic_load_n(&release[b], __ATOMIC_ACQUIRE) == t / pcq->nbuckets) {
+			if (__atomic_compare_exchange_n(&pcq->producer_index, &t, t + 1, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				break; /* Claimed ticket t */
+			continue;      /* Another producer got it; try the next one */
+		}
+		if (__atomic_load_n(&pcq->producer_index, __ATOMIC_ACQUIRE) != t)
+			continue;      /* Stale ticket; not full */
+
+		/* Queue looks full */
+		if (!full) { /* Count full only once per call to this function */
+			full = true;
+			a->nfull++;
+		}
+		if (a->stop_now) {
+			return PCQ_PUT_STOPPED;
+		} else if (a->wait) {
+			pcq_wait(a, &w);
+		} else {
+			fprintf(stderr, "%s: queue full no wait\n", __func__);
+			return PCQ_PUT_FULL_NOWAIT;
+		}
+	} while (true);
+	pcq_wait_done(a, &w);
+
+	/* The sequence tag (seq) is t + 1, so a zeroed bucket never looks ready */
+	pcq_seal_entry(pcq, entry, b, t + 1, a);
+
+	/* Everything but the tag goes in first; then the tag publishes the entry */
+	bucket_addr = pcq_bucket_addr(pcq, b);
+	tagp = (u64 *)((u64)bucket_addr + seq_offset);
+	memcpy(bucket_addr, entry, seq_offset);
+	memcpy((void *)((u64)bucket_addr + crc_offset), (void *)((u64)entry + crc_offset),
+	       sizeof(unsigned long));
+	writeback_processor_cache(bucket_addr, pcq->bucket_size);
+	__atomic_store_n(tagp, t + 1, __ATOMIC_RELEASE);
+	writeback_processor_cache(tagp, sizeof(*tagp));
+
+	a->nsent++;
+	a->nbatches++;
+	return PCQ_PUT_GOOD;
+}
+
+/**
+ * pcq_put_batch() - put up to @nentries entries in a pcq
+ *
+ * @pcqh:     queue handle
+ * @entries:  @nentries contiguous entries, each pcq->bucket_size bytes; the seq and crc
+ *            at the end of each entry are filled in here
+ * @nentries: number of entries to put
+ * @nput:     number of entries actually put (the leading part of @entries)
+ * @a:        thread arg (wait/stop policy and counters)
+ *
+ * Waits (if @a->wait) until at least one bucket is free, then puts as many entries as
+ * there are free buckets (up to @nentries). The buckets are written back together, and
+ * the producer_index is published once for the whole batch.
+ *
+ * On an MPMC queue, this puts one entry per call.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue, unless the
+ * queue is MPMC
+ */
+enum pcq_producer_status
+pcq_put_batch(
+	struct pcq_handle     *pcqh,
+	void                  *entries,
+	u64                    nentries,
+	u64                   *nput,
+	struct pcq_thread_arg *a)
+{
+	enum pcq_producer_status pstat;
+	struct pcq *pcq = pcqh->pcq;
+	u64 put_index;
+	u64 nfree;
+	u64 i;
+
+	*nput = 0;
+	if (pcq_is_mpmc(pcq)) {
+		pstat = pcq_mpmc_put(pcqh, entries, a);
+		*nput = (pstat == PCQ_PUT_GOOD) ? 1 : 0;
+		return pstat;
+	}
+
+	pstat = pcq_wait_for_space(pcqh, a, 1, &put_index, &nfree);
+	if (pstat != PCQ_PUT_GOOD)
+		return pstat;
+
+	nentries = MIN(nentries, nfree);
+	for (i = 0; i < nentries; i++) {
+		u64 index = (put_index + i) % pcq->nbuckets;
+		void *entry = (void *)((u64)entries + i * pcq->bucket_size);
+
+		/* Set seq and crc in entry before we memcpy it into the bucket */
+		pcq_seal_entry(pcq, entry, index, pcq->next_seq++, a);
+
+		/*
+		 * Put entry into the queue
+		 */
+		memcpy(pcq_bucket_addr(pcq, index), entry, pcq->bucket_size);
+	}
+
+	pcq_publish(pcq, put_index, nentries);
+	pcq_doorbell_ring(pcqh, a);
+	a->nsent += nentries;
+	a->nbatches++;
+	*nput = nentries;
+	return PCQ_PUT_GOOD;
+}
+
+/**
+ * pcq_reserve() - reserve the next bucket so the producer can fill it in place
+ *
+ * @pcqh:       queue handle
+ * @bucket_out: the bucket; the caller may write pcq_payload_size() bytes of payload
+ * @a:          thread arg (wait/stop policy and counters)
+ *
+ * Waits (if @a->wait) for a free bucket. Nothing is visible to the consumer until
+ * pcq_commit(). Calling this again before pcq_commit() returns the same bucket.
+ * Not supported on MPMC queues.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_producer_status
+pcq_reserve(
+	struct pcq_handle     *pcqh,
+	void                 **bucket_out,
+	struct pcq_thread_arg *a)
+{
+	enum pcq_producer_status pstat;
+	u64 put_index;
+	u64 nfree;
+
+	assert(!pcq_is_mpmc(pcqh->pcq));
+	*bucket_out = NULL;
+	pstat = pcq_wait_for_space(pcqh, a, 1, &put_index, &nfree);
+	if (pstat != PCQ_PUT_GOOD)
+		return pstat;
+
+	*bucket_out = pcq_bucket_addr(pcqh->pcq, put_index);
+	return PCQ_PUT_GOOD;
+}
+
+/**
+ * pcq_commit() - seal and publish the bucket returned by pcq_reserve()
+ *
+ * The seq and crc are computed over the bucket in place, so there is no copy.
+ */
+void
+pcq_commit(
+	struct pcq_handle     *pcqh,
+	struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	u64 put_index = pcq->producer_index;
+
+	pcq_seal_entry(pcq, pcq_bucket_addr(pcq, put_index), put_index, pcq->next_seq++, a);
+	pcq_publish(pcq, put_index, 1);
+	pcq_doorbell_ring(pcqh, a);
+	a->nsent++;
+	a->nbatches++;
+}
+
+#define CONSUMER_NRETRIES 2
+
+/**
+ * pcq_wait_for_entries() - wait (per @a) until the queue has at least one entry
+ *
+ * @get_index: the consumer_index
+ * @navail:    number of entries starting at @get_index
+ *
+ * As with pcq_wait_for_space(), the shared producer_index line is only invalidated and
+ * re-read when the handle's cached copy says the queue is empty.
+ */
+static enum pcq_consumer_status
+pcq_wait_for_entries(
+	struct pcq_handle     *pcqh,
+	struct pcq_thread_arg *a,
+	u64                   *get_index,
+	u64                   *navail)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+	struct pcq_waiter w = { 0 };
+	bool empty = false;
+
+	assert(pcq->pcq_magic == PCQ_MAGIC);
+	assert(pcqc->pcq_consumer_magic == PCQ_CONSUMER_MAGIC);
+
+	/* Wait until there is in a message to consume (breaking out if we get stopped) */
+	do {
+		*get_index = pcqc->consumer_index;
+
+		*navail = (pcqh->cached_producer_index + pcq->nbuckets - *get_index) %
+			pcq->nbuckets;
+		if (*navail)
+			break;
+
+		/* Looks empty per the cached copy; re-read the shared producer_index */
+		invalidate_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+		pcqh->cached_producer_index = pcq->producer_index;
+		a->nindex_reads++;
+
+		*navail = (pcqh->cached_producer_index + pcq->nbuckets - *get_index) %
+			pcq->nbuckets;
+		if (*navail)
+			break;
+
+		/* Queue is empty */
+		if (!empty) {
+			/* count empty only once per call to this function */
+			empty = true;
+			a->nempty++;
+		}
+		if (a->stop_now)
+			return PCQ_GET_STOPPED;
+		else if (a->wait && pcqh->doorbells)
+			pcq_doorbell_wait(pcqh, a, &w);
+		else if (a->wait)
+			pcq_wait(a, &w);
+		else {
+			if (a->verbose > 1)
+				printf("%s: queue empty\n", __func__);
+			return PCQ_GET_EMPTY;
+		}
+	} while (true);
+
+	pcq_wait_done(a, &w);
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_read_entry() - validate the entry in a bucket whose cache lines were invalidated
+ *
+ * @bucket_addr:   the bucket
+ * @entry_out:     copy the entry here, or NULL to validate it in place
+ * @seq_expect:    expected seq
+ * @retry_counted: a retry has already been counted by the caller's current call
+ *
+ * Although we know there is an entry to retrieve, we might see a cache-incoherent
+ * entry. If the crc is bad, invalidate the cache for the entry and retry
+ */
+static enum pcq_consumer_status
+pcq_read_entry(
+	struct pcq            *pcq,
+	void                  *bucket_addr,
+	void                  *entry_out,
+	u64                    index,
+	u64                    seq_expect,
+	bool                  *retry_counted,
+	struct pcq_thread_arg *a)
+{
+	void *entry = (entry_out) ? entry_out : bucket_addr;
+	unsigned long *crcp = (unsigned long *)((u64)entry + pcq_crc_offset(pcq));
+	u64 *seqp = (u64 *)((u64)entry + pcq_seq_offset(pcq));
+	int retries = CONSUMER_NRETRIES;
+	bool good_crc = true;
+	int errs = 0;
+
+	while (true) {
+		unsigned long crc;
+
+		if (entry_out)
+			memcpy(entry_out, bucket_addr, pcq->bucket_size);
+
+		/* Check crc and seq number */
+		crc = pcq_entry_crc(pcq, entry);
+
+		if (crc == *crcp) /* Good crc, good entry */
+			break;
+
+		if (!*retry_counted) {
+			/* count only one retry each time per call to this func */
+			*retry_counted = true;
+			a->retries++;
+		}
+		if (!retries--) {
+			/* Out of retries; continue with bad crc */
+			good_crc = false;
+			break;
+		}
+		invalidate_processor_cache(bucket_addr, pcq->bucket_size);
+	}
+
+	/* Only look at seq if crc is good */
+	if (good_crc && (*seqp != seq_expect)) {
+		fprintf(stderr, "%s: seq mismatch %lld / %lld\n",
+			__func__, *seqp, seq_expect);
+		errs++;
+	}
+
+	if (errs) {
+		/* This is fatal */
+		fprintf(stderr, "%s: bad msg after %d retries. cache coherency suspicious\n",
+			__func__, CONSUMER_NRETRIES);
+		fprintf(stderr, "%s: seq=%lld\n", __func__, seq_expect);
+		a->stop_now = true;
+		a->nerrors++;
+		exit(-1); /* force a hard exit so we can investigate */
+		return PCQ_GET_BAD_MSG;
+	}
+
+	if (a->verbose) {
+		printf("%s: bucket=%lld seq=%lld\n", __func__, index, *seqp);
+	}
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_consume() - advance and publish the consumer_index past @n entries
+ */
+static void
+pcq_consume(
+	struct pcq_handle     *pcqh,
+	u64                    get_index,
+	u64                    n)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+
+	pcqc->consumer_index = (get_index + n) % pcqh->pcq->nbuckets;
+	writeback_processor_cache(&pcqc->consumer_index, sizeof(pcqc->consumer_index));
+}
+
+/**
+ * pcq_mpmc_get() - get one entry from an MPMC queue
+ *
+ * Claims the next ticket with compare-and-swap once its bucket's sequence tag shows
+ * that it has been filled, copies the entry out, and then releases the bucket to the
+ * producers. Safe to call concurrently from multiple threads (see PCQ_MPMC_MAGIC).
+ */
+static enum pcq_consumer_status
+pcq_mpmc_get(
+	struct pcq_handle     *pcqh,
+	void                  *entry_out,
+	u64                   *seq_out,
+	struct pcq_thread_arg *a)
+{
+	u64 *release = pcq_release_tags(pcqh->pcqc);
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	enum pcq_consumer_status cstat;
+	struct pcq *pcq = pcqh->pcq;
+	u64 seq_offset = pcq_seq_offset(pcq);
+	struct pcq_waiter w = { 0 };
+	bool retry_counted = false;
+	bool empty = false;
+	void *bucket_addr;
+	u64 *tagp;
+	u64 t, b;
+
+	assert(pcq_is_mpmc(pcq));
+
+	do {
+		t = __atomic_load_n(&pcqc->consumer_index, __ATOMIC_ACQUIRE);
+		b = t % pcq->nbuckets;
+		bucket_addr = pcq_bucket_addr(pcq, b);
+		tagp = (u64 *)((u64)bucket_addr + seq_offset);
+
+		invalidate_processor_cache(tagp, sizeof(*tagp));
+		if (__atomic_load_n(tagp, __ATOMIC_ACQUIRE) == t + 1) {
+			if (__atomic_compare_exchange_n(&pcqc->consumer_index, &t, t + 1, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				break; /* Claimed ticket t */
+			continue;      /* Another consumer got it; try the next one */
+		}
+		if (__atomic_load_n(&pcqc->consumer_index, __ATOMIC_ACQUIRE) != t)
+			continue;      /* Stale ticket; not empty */
+
+		/* Queue looks empty */
+		if (!empty) {
+			/* count empty only once per call to this function */
+			empty = true;
+			a->nempty++;
+		}
+		if (a->stop_now)
+			return PCQ_GET_STOPPED;
+		else if (a->wait)
+			pcq_wait(a, &w);
+		else {
+			if (a->verbose > 1)
+				printf("%s: queue empty\n", __func__);
+			return PCQ_GET_EMPTY;
+		}
+	} while (true);
+	pcq_wait_done(a, &w);
+
+	invalidate_processor_cache(bucket_addr, pcq->bucket_size);
+	cstat = pcq_read_entry(pcq, bucket_addr, entry_out, b, t + 1, &retry_counted, a);
+	if (cstat != PCQ_GET_GOOD)
+		return cstat;
+
+	/* Done with the bucket; the producer that gets ticket t + nbuckets may reuse it */
+	__atomic_store_n(&release[b], t / pcq->nbuckets + 1, __ATOMIC_RELEASE);
+	writeback_processor_cache(&release[b], sizeof(release[b]));
+
+	a->nreceived++;
+	a->nbatches++;
+	*seq_out = t;
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_get_batch() - get up to @nentries entries from a pcq
+ *
+ * @pcqh:      queue handle
+ * @entries:   buffer for @nentries entries, each pcq->bucket_size bytes
+ * @nentries:  maximum number of entries to get
+ * @ngot:      number of entries actually retrieved
+ * @first_seq: seq of the first entry retrieved (the rest are consecutive)
+ * @a:         thread arg (wait/stop policy and counters)
+ *
+ * Waits (if @a->wait) until at least one entry is available, then gets as many entries
+ * as are available (up to @nentries). The buckets are invalidated together, and the
+ * consumer_index is published once for the whole batch.
+ *
+ * On an MPMC queue, this gets one entry per call.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue, unless the
+ * queue is MPMC
+ */
+enum pcq_consumer_status
+pcq_get_batch(
+	struct pcq_handle     *pcqh,
+	void                  *entries,
+	u64                    nentries,
+	u64                   *ngot,
+	u64                   *first_seq,
+	struct pcq_thread_arg *a)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	enum pcq_consumer_status cstat;
+	struct pcq *pcq = pcqh->pcq;
+	bool retry_counted = false;
+	u64 get_index;
+	u64 navail;
+	u64 i;
+
+	*ngot = 0;
+	if (pcq_is_mpmc(pcq)) {
+		cstat = pcq_mpmc_get(pcqh, entries, first_seq, a);
+		*ngot = (cstat == PCQ_GET_GOOD) ? 1 : 0;
+		return cstat;
+	}
+
+	cstat = pcq_wait_for_entries(pcqh, a, &get_index, &navail);
+	if (cstat != PCQ_GET_GOOD)
+		return cstat;
+
+	nentries = MIN(nentries, navail);
+
+	/* Get entries from queue */
+	pcq_bucket_range_op(pcq, get_index, nentries, invalidate_processor_cache);
+	*first_seq = pcqc->next_seq;
+	for (i = 0; i < nentries; i++) {
+		u64 index = (get_index + i) % pcq->nbuckets;
+
+		cstat = pcq_read_entry(pcq, pcq_bucket_addr(pcq, index),
+				       (void *)((u64)entries + i * pcq->bucket_size),
+				       index, pcqc->next_seq++, &retry_counted, a);
+		if (cstat != PCQ_GET_GOOD)
+			return cstat;
+	}
+
+	/* Update queue metadata */
+	pcq_consume(pcqh, get_index, nentries);
+	a->nreceived += nentries;
+	a->nbatches++;
+	*ngot = nentries;
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_peek() - validate the next entry in place and return a pointer to it
+ *
+ * @pcqh:       queue handle
+ * @bucket_out: the entry, which remains valid until pcq_release()
+ * @seq_out:    seq of the entry
+ * @a:          thread arg (wait/stop policy and counters)
+ *
+ * The crc and seq are checked in the bucket itself, so there is no copy. The entry is
+ * not consumed (the producer cannot reuse its bucket) until pcq_release(). Calling this
+ * again before pcq_release() re-validates the same entry. Not supported on MPMC queues.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_consumer_status
+pcq_peek(
+	struct pcq_handle     *pcqh,
+	const void           **bucket_out,
+	u64                   *seq_out,
+	struct pcq_thread_arg *a)
+{
+	enum pcq_consumer_status cstat;
+	struct pcq *pcq = pcqh->pcq;
+	bool retry_counted = false;
+	void *bucket_addr;
+	u64 get_index;
+	u64 navail;
+
+	assert(!pcq_is_mpmc(pcqh->pcq));
+	*bucket_out = NULL;
+	cstat = pcq_wait_for_entries(pcqh, a, &get_index, &navail);
+	if (cstat != PCQ_GET_GOOD)
+		return cstat;
+
+	bucket_addr = pcq_bucket_addr(pcq, get_index);
+	invalidate_processor_cache(bucket_addr, pcq->bucket_size);
+	cstat = pcq_read_entry(pcq, bucket_addr, NULL, get_index, pcqh->pcqc->next_seq,
+			       &retry_counted, a);
+	if (cstat != PCQ_GET_GOOD)
+		return cstat;
+
+	*bucket_out = bucket_addr;
+	*seq_out = pcqh->pcqc->next_seq;
+	return PCQ_GET_GOOD;
+}
+
+/**
+ * pcq_release() - consume the entry returned by pcq_peek()
+ *
+ * After this the producer may overwrite the bucket, so the caller must be done with it.
+ */
+void
+pcq_release(
+	struct pcq_handle     *pcqh,
+	struct pcq_thread_arg *a)
+{
+	pcqh->pcqc->next_seq++;
+	pcq_consume(pcqh, pcqh->pcqc->consumer_index, 1);
+	a->nreceived++;
+	a->nbatches++;
+}
+
+/**
+ * pcq_frame_cache_op() - apply @op to the used part of a framed bucket
+ *
+ * That is the frame header and @len bytes of message, and the seq and crc at the end.
+ */
+static inline void
+pcq_frame_cache_op(
+	struct pcq *pcq,
+	void       *bucket_addr,
+	u64         len,
+	void      (*op)(const void *addr, size_t len))
+{
+	op(bucket_addr, sizeof(struct pcq_frame) + len);
+	op((void *)((u64)bucket_addr + pcq_seq_offset(pcq)), sizeof(u64) + sizeof(unsigned long));
+}
+
+/**
+ * pcq_put_msg() - put a message in a framed queue
+ *
+ * @pcqh: queue handle
+ * @msg:  the message
+ * @len:  message length; up to pcq_max_msg_size()
+ * @a:    thread arg (wait/stop policy and counters)
+ *
+ * Waits (if @a->wait) until there are enough free buckets for the whole message, fills
+ * them in place (only the used bytes are checksummed and written back), and publishes
+ * them with one producer_index update.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_producer_status
+pcq_put_msg(
+	struct pcq_handle     *pcqh,
+	const void            *msg,
+	u64                    len,
+	struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	u64 cap = pcq_frame_capacity(pcq);
+	enum pcq_producer_status pstat;
+	u64 nfrags = MAX((len + cap - 1) / cap, 1);
+	u64 put_index;
+	u64 nfree;
+	u64 i;
 
-		invalidate_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
-		if (get_index != pcq->producer_index)
-			break;
-		else {
-			/* Queue looks empty */
-			if (!empty) {
-				/* count empty only once per call to this function */
-				empty = true;
-				a->nempty++;
-			}
-			if (a->stop_now)
-				return PCQ_GET_STOPPED;
-			else if (a->wait)
-				sched_yield();
-			else {
-				if (a->verbose > 1)
-					printf("%s: queue empty\n", __func__);
-				return PCQ_GET_EMPTY;
+	assert(pcq_is_framed(pcq));
+	if (len > pcq_max_msg_size(pcq)) {
+		fprintf(stderr, "%s: message length %lld exceeds max %lld\n",
+			__func__, len, pcq_max_msg_size(pcq));
+		return PCQ_PUT_TOO_BIG;
+	}
+
+	pstat = pcq_wait_for_space(pcqh, a, nfrags, &put_index, &nfree);
+	if (pstat != PCQ_PUT_GOOD)
+		return pstat;
+
+	for (i = 0; i < nfrags; i++) {
+		u64 index = (put_index + i) % pcq->nbuckets;
+		void *bucket_addr = pcq_bucket_addr(pcq, index);
+		struct pcq_frame *frame = (struct pcq_frame *)bucket_addr;
+		u64 flen = MIN(len - i * cap, cap);
+
+		frame->len = flen;
+		frame->nfrags_left = nfrags - i - 1;
+		memcpy(&frame[1], (void *)((u64)msg + i * cap), flen);
+		pcq_seal_entry(pcq, bucket_addr, index, pcq->next_seq++, a);
+		pcq_frame_cache_op(pcq, bucket_addr, flen, writeback_processor_cache);
+	}
+
+	/* The used parts of the buckets were written back above; now publish them */
+	pcq->producer_index = (put_index + nfrags) % pcq->nbuckets;
+	writeback_processor_cache(&pcq->producer_index, sizeof(pcq->producer_index));
+	pcq_doorbell_ring(pcqh, a);
+
+	a->nsent++;
+	a->nbatches++;
+	a->nbytes += len;
+	return PCQ_PUT_GOOD;
+}
+
+/**
+ * pcq_get_msg() - get a message from a framed queue
+ *
+ * @pcqh:    queue handle
+ * @buf:     buffer for the message
+ * @buflen:  size of @buf
+ * @len_out: message length
+ * @a:       thread arg (wait/stop policy and counters)
+ *
+ * Waits (if @a->wait) for a message. Only the used bytes of each bucket are invalidated
+ * and checksummed. If the message is larger than @buflen, returns PCQ_GET_TOO_BIG with
+ * the message length in @len_out and leaves the message in the queue.
+ *
+ * NOTE: this function must not be called re-entrantly for the same queue
+ */
+enum pcq_consumer_status
+pcq_get_msg(
+	struct pcq_handle     *pcqh,
+	void                  *buf,
+	u64                    buflen,
+	u64                   *len_out,
+	struct pcq_thread_arg *a)
+{
+	struct pcq_consumer *pcqc = pcqh->pcqc;
+	struct pcq *pcq = pcqh->pcq;
+	u64 cap = pcq_frame_capacity(pcq);
+	enum pcq_consumer_status cstat;
+	bool retry_counted = false;
+	struct pcq_frame *frame;
+	u64 get_index, navail;
+	u64 nfrags = 1;
+	u64 len = 0;
+	u64 ofs, i;
+
+	assert(pcq_is_framed(pcq));
+	*len_out = 0;
+	cstat = pcq_wait_for_entries(pcqh, a, &get_index, &navail);
+	if (cstat != PCQ_GET_GOOD)
+		return cstat;
+
+	/* Validate all of the message's buckets in place before copying anything out */
+	for (i = 0; i < nfrags; i++) {
+		u64 index = (get_index + i) % pcq->nbuckets;
+		void *bucket_addr = pcq_bucket_addr(pcq, index);
+
+		frame = (struct pcq_frame *)bucket_addr;
+
+		/* Invalidate the header and tail first, then the used bytes */
+		pcq_frame_cache_op(pcq, bucket_addr, 0, invalidate_processor_cache);
+		invalidate_processor_cache(&frame[1], MIN((u64)frame->len, cap));
+		cstat = pcq_read_entry(pcq, bucket_addr, NULL, index, pcqc->next_seq + i,
+				       &retry_counted, a);
+		if (cstat != PCQ_GET_GOOD)
+			return cstat;
+
+		if (i == 0) {
+			/* A message is published all at once, so all of its buckets are here */
+			nfrags = frame->nfrags_left + 1;
+			if (nfrags > navail) {
+				fprintf(stderr, "%s: message of %lld buckets but only %lld "
+					"available\n", __func__, nfrags, navail);
+				a->nerrors++;
+				return PCQ_GET_BAD_MSG;
 			}
+		} else if (frame->nfrags_left != nfrags - i - 1) {
+			fprintf(stderr, "%s: bad frame %lld of %lld\n", __func__, i, nfrags);
+			a->nerrors++;
+			return PCQ_GET_BAD_MSG;
 		}
-	} while (true);
+		len += frame->len;
+	}
 
-	/* Get entry from queue */
-	bucket_addr = (void *)((u64)pcq + pcq->bucket_array_offset +
-			       (get_index * pcq->bucket_size));
-	seq_expect = pcqc->next_seq++;
+	*len_out = len;
+	if (len > buflen)
+		return PCQ_GET_TOO_BIG;
 
+	for (i = 0, ofs = 0; i < nfrags; i++) {
+		frame = (struct pcq_frame *)pcq_bucket_addr(pcq, (get_index + i) % pcq->nbuckets);
+		memcpy((void *)((u64)buf + ofs), &frame[1], frame->len);
+		ofs += frame->len;
+	}
 
-	/*
-	 * Although we know there is an entry to retrieve, we might see a cache-incoherent
-	 * entry. If the crc is bad, invalidate the cache for the entry and retry
-	 */
-	while (true) {
-		crc = crc32(0L, Z_NULL, 0);
-		invalidate_processor_cache(bucket_addr, pcq->bucket_size);
-		memcpy(entry_out, bucket_addr, pcq->bucket_size);
+	pcqc->next_seq += nfrags;
+	pcq_consume(pcqh, get_index, nfrags);
+	a->nreceived++;
+	a->nbatches++;
+	a->nbytes += len;
+	return PCQ_GET_GOOD;
+}
 
-		/* Check crc and seq number */
-		crc_offset = pcq_crc_offset(pcq);
-		seq_offset = pcq_seq_offset(pcq);
-		crcp = (unsigned long *)((u64)entry_out + crc_offset);
-		seqp = (u64 *)((u64)entry_out + seq_offset);
+static inline u64
+pcq_realtime_ns(void)
+{
+	struct timespec ts;
 
-		crc = crc32(crc, entry_out, pcq_payload_size(pcq) + sizeof(*seqp));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-		if (crc == *crcp) /* Good crc, good entry */
-			break;
+/**
+ * pcq_fill_payload() - fill a message payload for the test producer
+ *
+ * With @a->latency, the first PCQ_TIMESTAMP_SIZE bytes of the payload carry the send
+ * time (CLOCK_REALTIME, so producer and consumer nodes need synchronized clocks), and
+ * the seed pattern fills the rest.
+ */
+static void
+pcq_fill_payload(struct pcq_thread_arg *a, void *payload, u64 len)
+{
+	u64 ofs = (a->latency) ? PCQ_TIMESTAMP_SIZE : 0;
+	u64 now;
+
+	if (a->seed)
+		randomize_buffer((void *)((u64)payload + ofs), len - ofs, a->seed);
+	if (a->latency) {
+		now = pcq_realtime_ns();
+		memcpy(payload, &now, sizeof(now));
+	}
+}
 
-		if (!retry_counted) {
-			/* count only one retry each time per call to this func */
-			retry_counted = true;
-			a->retries++;
-		}
-		if (!retries--) {
-			/* Out of retries; continue with bad crc */
-			good_crc = false;
-			break;
+/**
+ * pcq_check_payload() - validate (per @a->seed) a received payload, and record its
+ *                       latency if @a->latency
+ */
+static void
+pcq_check_payload(
+	struct pcq_thread_arg *a,
+	const void            *payload,
+	u64                    len,
+	u64                    seq)
+{
+	u64 ofs = (a->latency) ? PCQ_TIMESTAMP_SIZE : 0;
+	u64 sent, now;
+	int64_t mis;
+
+	if (a->latency) {
+		now = pcq_realtime_ns();
+		memcpy(&sent, payload, sizeof(sent));
+		pcq_hist_record(&a->latency_hist, (now > sent) ? now - sent : 0);
+	}
+	if (a->seed) {
+		mis = validate_random_buffer((void *)((u64)payload + ofs), len - ofs, a->seed);
+		if (mis != -1) {
+			fprintf(stderr, "%s: miscompare seq=%lld ofs=%lld\n",
+				__func__, seq, (long long)(mis + ofs));
+			a->nerrors++;
 		}
 	}
+}
 
-	/* Only look at seq if crc is good */
-	if (good_crc && (*seqp != seq_expect)) {
-		fprintf(stderr, "%s: seq mismatch %lld / %lld\n",
-			__func__, *seqp, seq_expect);
-		errs++;
+/**
+ * pcq_check_latency_arg() - the timestamp must fit in the payload
+ */
+static int
+pcq_check_latency_arg(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	if (a->latency && pcq_payload_size(pcqh->pcq) < (int64_t)PCQ_TIMESTAMP_SIZE) {
+		fprintf(stderr, "%s: payload too small for a timestamp\n", __func__);
+		a->nerrors++;
+		return -1;
 	}
+	return 0;
+}
 
-	if (errs) {
-		/* This is fatal */
-		fprintf(stderr, "%s: bad msg after %d retries. cache coherency suspicious\n",
-			__func__, CONSUMER_NRETRIES);
-		fprintf(stderr, "%s: seq=%lld\n", __func__, seq_expect);
-		a->stop_now = true;
+/**
+ * pcq_check_run_args() - reject thread args that the queue type doesn't support
+ */
+static int
+pcq_check_run_args(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+
+	if (a->shared && !pcq_is_mpmc(pcq)) {
+		fprintf(stderr, "%s: multiple threads require an MPMC queue\n", __func__);
 		a->nerrors++;
-		exit(-1); /* force a hard exit so we can investigate */
-		return PCQ_GET_BAD_MSG;
+		return -1;
+	}
+	if ((pcq_is_mpmc(pcq) || pcq_is_framed(pcq)) && (a->zerocopy || a->batch > 1)) {
+		fprintf(stderr, "%s: --zerocopy and --batch are not supported on MPMC or "
+			"framed queues\n", __func__);
+		a->nerrors++;
+		return -1;
+	}
+	return pcq_check_latency_arg(pcqh, a);
+}
+
+/**
+ * run_producer_framed() - producer loop for a framed queue, using pcq_put_msg()
+ *
+ * Message lengths are spread uniformly up to @a->max_msg (default: 4 buckets' worth).
+ */
+static int
+run_producer_framed(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	struct pcq *pcq = pcqh->pcq;
+	u64 min_len = (a->latency) ? PCQ_TIMESTAMP_SIZE : 4;
+	u64 max_len = (a->max_msg) ? a->max_msg : 4 * pcq_frame_capacity(pcq);
+	enum pcq_producer_status pstat;
+	u64 rng = (a->seed) ? a->seed : 1;
+	u64 len;
+	void *msg;
+
+	max_len = MIN(max_len, pcq_max_msg_size(pcq));
+	if (max_len < min_len) {
+		fprintf(stderr, "%s: max message size %lld is too small\n", __func__, max_len);
+		a->nerrors++;
+		return -1;
 	}
+	msg = malloc(max_len);
+	assert(msg);
 
-	if (a->verbose) {
-		printf("%s: bucket=%lld seq=%lld\n", __func__, get_index, *seqp);
+	while (true) {
+		if (a->stop_mode == NMESSAGES && a->nsent >= a->nmessages)
+			break;
+		if (a->stop_now)
+			break;
+
+		/* xorshift64 */
+		rng ^= rng << 13;
+		rng ^= rng >> 7;
+		rng ^= rng << 17;
+		len = min_len + rng % (max_len - min_len + 1);
+		len = MAX(len & ~3ULL, min_len); /* randomize_buffer() works in 4 byte words */
+
+		pcq_fill_payload(a, msg, len);
+		pstat = pcq_put_msg(pcqh, msg, len, a);
+		if (pstat == PCQ_PUT_STOPPED)
+			break;
+		if (pstat != PCQ_PUT_GOOD) {
+			a->nerrors++;
+			free(msg);
+			return -1;
+		}
 	}
+	free(msg);
+	return 0;
+}
 
-	/* Update queue metadata */
-	pcqc->consumer_index = (pcqc->consumer_index + 1) % pcq->nbuckets;
-	flush_processor_cache(&pcqc->consumer_index, sizeof(pcqc->consumer_index));
-	a->nreceived++;
+/**
+ * run_producer_zerocopy() - producer loop using pcq_reserve()/pcq_commit()
+ */
+static int
+run_producer_zerocopy(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	enum pcq_producer_status pstat;
+	void *bucket;
 
-	*seq_out = *seqp;
-	return PCQ_GET_GOOD;
+	while (true) {
+		pstat = pcq_reserve(pcqh, &bucket, a);
+		if (pstat == PCQ_PUT_FULL_NOWAIT) {
+			a->nerrors++;
+			return -1;
+		}
+		if (pstat == PCQ_PUT_STOPPED)
+			return 0;
+
+		assert(pstat == PCQ_PUT_GOOD);
+		pcq_fill_payload(a, bucket, pcq_payload_size(pcqh->pcq));
+		pcq_commit(pcqh, a);
+
+		if (a->stop_mode == NMESSAGES && a->nsent >= a->nmessages)
+			return 0;
+
+		if (a->stop_now)
+			return 0;
+	}
 }
 
 int
 run_producer(struct pcq_thread_arg *a)
 {
 	enum pcq_producer_status pstat;
+	u64 batch = MAX(a->batch, 1);
 	struct pcq_handle *pcqh;
-	struct pcq_entry *entry;
+	struct pcq_entry *entries;
+	u64 bucket_size;
 	int rc = 0;
+	u64 i;
 
 	pcqh = pcq_producer_open(a->basename, a->verbose);
 
 	if (!pcqh)
 		return -1;
 
-	entry = pcq_alloc_entry(pcqh);
-	assert(entry);
+	if (pcq_check_run_args(pcqh, a) ||
+	    (a->doorbell && pcq_doorbell_attach(pcqh, a->doorbell, PRODUCER))) {
+		rc = -1;
+		entries = NULL;
+		goto out;
+	}
+	if (pcq_is_framed(pcqh->pcq)) {
+		rc = run_producer_framed(pcqh, a);
+		entries = NULL;
+		goto out;
+	}
+	if (a->zerocopy) {
+		rc = run_producer_zerocopy(pcqh, a);
+		entries = NULL;
+		goto out;
+	}
+
+	bucket_size = pcqh->pcq->bucket_size;
+	entries = calloc(batch, bucket_size);
+	assert(entries);
 
 	while (true) {
-		if (a->seed)
-			randomize_buffer(entry, pcq_payload_size(pcqh->pcq), a->seed);
-		pstat = pcq_producer_put(pcqh, entry, a);
-		if (pstat == PCQ_PUT_FULL_NOWAIT) {
-			a->nerrors++;
-			rc = -1;
-			goto out;
-		}
+		u64 n = batch;
+		u64 done = 0;
 
-		if (pstat == PCQ_PUT_STOPPED)
-			goto out;
+		if (a->stop_mode == NMESSAGES)
+			n = MIN(n, a->nmessages - a->nsent);
 
-		assert(pstat == PCQ_PUT_GOOD);
+		for (i = 0; i < n; i++)
+			pcq_fill_payload(a, (void *)((u64)entries + i * bucket_size),
+					 pcq_payload_size(pcqh->pcq));
+
+		while (done < n) {
+			u64 nput;
+
+			pstat = pcq_put_batch(pcqh, (void *)((u64)entries + done * bucket_size),
+					      n - done, &nput, a);
+			if (pstat == PCQ_PUT_FULL_NOWAIT) {
+				a->nerrors++;
+				rc = -1;
+				goto out;
+			}
+
+			if (pstat == PCQ_PUT_STOPPED)
+				goto out;
+
+			assert(pstat == PCQ_PUT_GOOD);
+			done += nput;
+		}
 
 		if (a->stop_mode == NMESSAGES && a->nsent >= a->nmessages)
 			goto out;
@@ -569,49 +2168,134 @@ run_producer(struct pcq_thread_arg *a)
 			goto out;
 	}
 out:
-	munmap(pcqh->pcq, pcqh->pcq->pcq_size);
-	munmap(pcqh->pcqc, pcqh->pcqc->pcqc_size);
-	free(pcqh);
-	free(entry);
+	pcq_close(pcqh);
+	free(entries);
+	return rc;
+}
+
+/**
+ * run_consumer_framed() - consumer loop for a framed queue, using pcq_get_msg()
+ *
+ * The message buffer starts at one bucket's worth and grows when a message is too big.
+ */
+static int
+run_consumer_framed(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	u64 buflen = pcq_frame_capacity(pcqh->pcq);
+	enum pcq_consumer_status cstat;
+	void *buf = malloc(buflen);
+	int rc = 0;
+	u64 len;
+
+	assert(buf);
+	while (true) {
+		if (a->stop_now)
+			break;
+		if (a->stop_mode == NMESSAGES && a->nreceived >= a->nmessages)
+			break;
+
+		cstat = pcq_get_msg(pcqh, buf, buflen, &len, a);
+		if (cstat == PCQ_GET_TOO_BIG) {
+			buflen = len;
+			buf = realloc(buf, buflen);
+			assert(buf);
+			continue;
+		}
+		if (cstat == PCQ_GET_EMPTY && a->stop_mode == EMPTY)
+			break;
+		if (cstat == PCQ_GET_BAD_MSG) {
+			rc = -1;
+			break;
+		}
+		if (cstat == PCQ_GET_GOOD)
+			pcq_check_payload(a, buf, len, a->nreceived - 1);
+	}
+	free(buf);
 	return rc;
 }
 
+/**
+ * run_consumer_zerocopy() - consumer loop using pcq_peek()/pcq_release()
+ */
+static int
+run_consumer_zerocopy(struct pcq_handle *pcqh, struct pcq_thread_arg *a)
+{
+	enum pcq_consumer_status cstat;
+	const void *bucket;
+	u64 seqnum;
+
+	while (true) {
+		cstat = pcq_peek(pcqh, &bucket, &seqnum, a);
+		if (cstat == PCQ_GET_EMPTY && a->stop_mode == EMPTY)
+			return 0;
+
+		if (cstat == PCQ_GET_GOOD) {
+			pcq_check_payload(a, bucket, pcq_payload_size(pcqh->pcq), seqnum);
+			pcq_release(pcqh, a);
+		}
+
+		if (a->stop_now)
+			return 0;
+		if (a->stop_mode == NMESSAGES && a->nreceived >= a->nmessages)
+			return 0;
+	}
+}
+
 int
 run_consumer(struct pcq_thread_arg *a)
 {
 	enum pcq_consumer_status cstat;
-	struct pcq_entry *entry_out;
+	u64 batch = MAX(a->batch, 1);
+	struct pcq_entry *entries;
 	struct pcq_handle *pcqh;
-	int64_t ofs;
+	u64 bucket_size;
 	u64 seqnum;
+	u64 ngot;
 	int rc = 0;
+	u64 i;
 
 	if (a->stop_mode == EMPTY)
 		assert(a->wait == 0);
 
-	pcqh = pcq_consumer_open(a->basename, a->verbose);
+	pcqh = pcq_subscriber_open(a->basename, a->subscriber, a->verbose);
 	if (!pcqh)
 		return -1;
 
-	entry_out = pcq_alloc_entry(pcqh);
+	if (pcq_check_run_args(pcqh, a) ||
+	    (a->doorbell && pcq_doorbell_attach(pcqh, a->doorbell, CONSUMER))) {
+		rc = -1;
+		entries = NULL;
+		goto out;
+	}
+	if (pcq_is_framed(pcqh->pcq)) {
+		rc = run_consumer_framed(pcqh, a);
+		entries = NULL;
+		goto out;
+	}
+	if (a->zerocopy) {
+		rc = run_consumer_zerocopy(pcqh, a);
+		entries = NULL;
+		goto out;
+	}
+
+	bucket_size = pcqh->pcq->bucket_size;
+	entries = calloc(batch, bucket_size);
+	assert(entries);
 
 	while (true) {
-		cstat = pcq_consumer_get(pcqh, entry_out, &seqnum, a);
+		u64 n = batch;
+
+		if (a->stop_mode == NMESSAGES)
+			n = MIN(n, a->nmessages - a->nreceived);
+
+		cstat = pcq_get_batch(pcqh, entries, n, &ngot, &seqnum, a);
 		if (cstat == PCQ_GET_EMPTY && a->stop_mode == EMPTY)
 			goto out;
 
 		if (cstat == PCQ_GET_GOOD) {
-			if (a->seed) {
-				ofs = validate_random_buffer(entry_out,
-							     pcq_payload_size(pcqh->pcq),
-							     a->seed);
-				if (ofs != -1) {
-					fprintf(stderr, "%s: miscompare seq=%lld ofs=%ld\n",
-						__func__, seqnum, ofs);
-					a->nerrors++;
-					continue;
-				}
-			}
+			for (i = 0; i < ngot; i++)
+				pcq_check_payload(a, (void *)((u64)entries + i * bucket_size),
+						  pcq_payload_size(pcqh->pcq), seqnum + i);
 		}
 
 		if (a->stop_now)
@@ -621,10 +2305,8 @@ run_consumer(struct pcq_thread_arg *a)
 
 	}
 out:
-	munmap(pcqh->pcq, pcqh->pcq->pcq_size);
-	munmap(pcqh->pcqc, pcqh->pcqc->pcqc_size);
-	free(pcqh);
-	free(entry_out);
+	pcq_close(pcqh);
+	free(entries);
 	return rc;
 }
 
@@ -656,23 +2338,46 @@ void *status_worker(void *arg)
 	if (!a->interval)
 		return NULL;
 
-	assert(a->p && a->c);
-
 	for (i = 1; ; i++) {
+		struct pcq_thread_arg p = { 0 };
+		struct pcq_thread_arg c = { 0 };
+		struct pcq_hist lat = { 0 };
 		struct tm *local_now;
 		char time_str[80];
 		time_t now;
+		int j;
 
 		sleep(a->interval);
 
+		/* Sum the counters across all producer and consumer threads */
+		for (j = 0; j < a->np; j++) {
+			p.nsent += a->p[j].nsent;
+			p.nfull += a->p[j].nfull;
+			p.nerrors += a->p[j].nerrors;
+		}
+		for (j = 0; j < a->nc; j++) {
+			c.nreceived += a->c[j].nreceived;
+			c.nempty += a->c[j].nempty;
+			c.retries += a->c[j].retries;
+			c.nerrors += a->c[j].nerrors;
+			if (a->c[j].latency)
+				pcq_hist_merge(&lat, &a->c[j].latency_hist);
+		}
+
 		now = time(NULL);
 		local_now = localtime(&now);
 		strftime(time_str, sizeof(time_str), "%m-%d %H:%M:%S", local_now);
 
 		printf("%s pcq=%s prod(nsent=%lld nfull=%lld) cons(nrcvd=%lld nempty=%lld "
 		       "nretries= %lld nerrors=%lld)\n", time_str,
-		       a->basename, a->p->nsent, a->p->nfull, a->c->nreceived, a->c->nempty,
-		       a->p->nerrors + a->c->retries, a->c->nerrors);
+		       a->basename, p.nsent, p.nfull, c.nreceived, c.nempty,
+		       p.nerrors + c.retries, c.nerrors);
+		if (lat.count)
+			printf("%s pcq=%s latency(n=%lld p50=%lldns p90=%lldns p99=%lldns "
+			       "p99.9=%lldns max=%lldns)\n", time_str, a->basename, lat.count,
+			       pcq_hist_percentile(&lat, 50), pcq_hist_percentile(&lat, 90),
+			       pcq_hist_percentile(&lat, 99), pcq_hist_percentile(&lat, 99.9),
+			       lat.max);
 
 		if (a->stop_now)
 			return NULL;
@@ -687,7 +2392,7 @@ get_queue_info(const char *fname, FILE *statusfile, int verbose)
 	s64 nmessages = -1;
 	int rc = 0;
 
-	pcqh = pcq_open(fname, READONLY, verbose);
+	pcqh = pcq_open(fname, READONLY, 0, verbose);
 
 	if (!pcqh)
 		return -1;
@@ -700,57 +2405,84 @@ get_queue_info(const char *fname, FILE *statusfile, int verbose)
 	nmessages = pcq_nmessages(pcqh);
 	printf("%s: queue %s contains %lld messages p next_seq %lld c next_seq %lld\n",
 	       __func__, fname, nmessages, pcqh->pcq->next_seq, pcqh->pcqc->next_seq);
-
+	printf("%s: csum %s%s\n", __func__,
+	       mu_csum_name((enum mu_csum_type)pcqh->pcq->csum_type),
+	       pcq_is_framed(pcqh->pcq) ? " framed (message count is in buckets)" : "");
+	if (pcq_is_broadcast(pcqh->pcq)) {
+		u64 i;
+
+		printf("%s: broadcast queue with %lld subscribers\n", __func__,
+		       pcqh->nsubscribers);
+		for (i = 0; i < pcqh->nsubscribers; i++) {
+			struct pcq_consumer *sub = pcqh->subscribers[i];
+
+			printf("%s: subscriber %lld: consumer_index %lld next_seq %lld "
+			       "lag %lld\n", __func__, i, sub->consumer_index, sub->next_seq,
+			       pcq_lag(pcqh->pcq, pcqh->pcq->producer_index,
+				       sub->consumer_index));
+		}
+	}
 
 out:
-	free(pcqh);
+	pcq_close(pcqh);
 	if (statusfile)
 		fprintf(statusfile, "%lld", nmessages);
 	return rc;
 }
 
+/**
+ * pcq_set_perm() - set the permissions of the producer and consumer file(s) for @role
+ *
+ * On a broadcast queue, all of the subscribers' consumer files get the same permissions.
+ */
 int
 pcq_set_perm(const char *filename, enum pcq_perm role)
 {
-	char *consumer_fname = pcq_consumer_fname(filename);
+	mode_t pmode, cmode;
 	struct stat st;
-	int rc = 0;
+	u64 i;
+	int rc;
 
-	assert(consumer_fname);
 	if (stat(filename, &st)) {
 		fprintf(stderr, "Queue file %s not found\n", filename);
-		rc = -1;
-		goto out;
+		return -1;
 	}
 	switch (role) {
 	case pcq_perm_none:
-		rc = chmod(filename, 0444);
-		assert(rc == 0);
-		rc = chmod(consumer_fname, 0444);
-		assert(rc == 0);
+		pmode = 0444;
+		cmode = 0444;
 		break;
 	case pcq_perm_both:
-		rc = chmod(filename, 0644);
-		assert(rc == 0);
-		rc = chmod(consumer_fname, 0644);
-		assert(rc == 0);
+		pmode = 0644;
+		cmode = 0644;
 		break;
 	case pcq_perm_producer:
-		rc = chmod(filename, 0644);
-		assert(rc == 0);
-		rc = chmod(consumer_fname, 0444);
-		assert(rc == 0);
+		pmode = 0644;
+		cmode = 0444;
 		break;
 	case pcq_perm_consumer:
-		rc = chmod(filename, 0444);
-		assert(rc == 0);
-		rc = chmod(consumer_fname, 0644);
-		assert(rc == 0);
+		pmode = 0444;
+		cmode = 0644;
 		break;
 	default:
 		fprintf(stderr, "Bad role\n");
+		return 0;
+	}
+
+	rc = chmod(filename, pmode);
+	assert(rc == 0);
+	for (i = 0; ; i++) {
+		char *consumer_fname = pcq_consumer_fname(filename, i);
+
+		assert(consumer_fname);
+		if (i > 0 && stat(consumer_fname, &st)) {
+			/* No more subscribers */
+			free(consumer_fname);
+			break;
+		}
+		rc = chmod(consumer_fname, cmode);
+		assert(rc == 0);
+		free(consumer_fname);
 	}
-out:
-	free(consumer_fname);
 	return rc;
 }
@@ -10,6 +10,7 @@ extern "C" {
 #include <linux/limits.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <stdlib.h>
 
@@ -17,6 +18,9 @@ extern "C" {
 #include "famfs_lib.h"
 #include "famfs_lib_internal.h"
 #include "famfs_meta.h"
+#include "bitmap.h"
+#include "mu_mem.h"
+#include "mu_crc.h"
 #include "xrand.h"
 #include "random_buffer.h"
 #include "famfs_unit.h"
@@ -346,6 +350,7 @@ TEST(famfs, mmap_whole_file)
 
 TEST(famfs, __famfs_cp)
 {
+	int fd, lowfd;
 	int rc;
 	u64 device_size = 1024 * 1024 * 256;
 	struct famfs_locked_log ll;
@@ -409,10 +414,14 @@ TEST(famfs, __famfs_cp)
 	system("rm /tmp/src");
 	ASSERT_NE(rc, 0);
 
-	/* fail mmap of dest file*/
+	/* fail mmap of dest file (without leaking the fds: the lowest free fd is the same
+	 * before and after)
+	 */
 	system("dd if=/dev/random of=/tmp/src bs=4096 count=1");
 	mock_kmod = 1;
 	mock_failure = MOCK_FAIL_MMAP;
+	lowfd = dup(0);
+	close(lowfd);
 	rc = __famfs_cp(&ll,
 			"/tmp/src",
 			"/tmp/famfs/dest",
@@ -421,6 +430,9 @@ TEST(famfs, __famfs_cp)
 	mock_failure = MOCK_FAIL_NONE;
 	mock_kmod = 0;
 	ASSERT_NE(rc, 0);
+	fd = dup(0);
+	close(fd);
+	ASSERT_EQ(fd, lowfd);
 
 	/* fail srcfile read */
 	system("dd if=/dev/random of=/tmp/src bs=4096 count=1");
@@ -476,29 +488,29 @@ TEST(famfs, famfs_log)
 		rc = __famfs_mkdir(&ll, dirname, 0, 0, 0, 0);
 		ASSERT_EQ(rc, 0);
 	}
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 3);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 3);
 	ASSERT_EQ(rc, 0);
 
 	/* fail sb sanity check */
-	rc = __famfs_logplay(logp, "/tmp/famfs1", 0, 0, 4);
+	rc = __famfs_logplay(logp, "/tmp/famfs1", 0, 0, 0, 0, 4);
 	ASSERT_NE(rc, 0);
 
 	/* fail famfs_check_super */
 	sb->ts_magic = 420;
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 4);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 4);
 	ASSERT_NE(rc, 0);
 	sb->ts_magic = FAMFS_SUPER_MAGIC;
 
 	/* fail FAMFS_LOG_MAGIC check */
 	logp->famfs_log_magic = 420;
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 4);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 4);
 	ASSERT_NE(rc, 0);
 	logp->famfs_log_magic = FAMFS_LOG_MAGIC;
 
 	/* fail famfs_validate_log_entry() */
 	tmp = logp->entries[0].famfs_log_entry_seqnum;
 	logp->entries[0].famfs_log_entry_seqnum = 420;
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 4);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 4);
 	ASSERT_NE(rc, 0);
 	logp->entries[0].famfs_log_entry_seqnum = tmp;
 
@@ -506,7 +518,7 @@ TEST(famfs, famfs_log)
 	mock_path = 1;
 	tmp = logp->entries[0].famfs_log_entry_type;
 	logp->entries[0].famfs_log_entry_type = FAMFS_LOG_FILE;
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 0);
 	ASSERT_NE(rc, 0);
 	mock_path = 0;
 	logp->entries[0].famfs_log_entry_type = tmp;
@@ -515,7 +527,7 @@ TEST(famfs, famfs_log)
 	mock_failure = MOCK_FAIL_GENERIC;
 	tmp = logp->entries[0].famfs_log_entry_type;
 	logp->entries[0].famfs_log_entry_type = FAMFS_LOG_ACCESS;
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 1);
 	ASSERT_EQ(rc, 0);
 	mock_failure = MOCK_FAIL_NONE;
 	logp->entries[0].famfs_log_entry_type = tmp;
@@ -525,7 +537,7 @@ TEST(famfs, famfs_log)
 	mock_failure = MOCK_FAIL_LOG_MKDIR;
 	tmp = logp->entries[0].famfs_log_entry_type;
 	logp->entries[0].famfs_log_entry_type = FAMFS_LOG_MKDIR;
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 0);
 	ASSERT_NE(rc, 0);
 	mock_failure = MOCK_FAIL_NONE;
 	logp->entries[0].famfs_log_entry_type = tmp;
@@ -655,6 +667,1394 @@ TEST(famfs, famfs_log)
 
 }
 
+TEST(famfs, famfs_logplay_cursor)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	unsigned long crc;
+	u64 tmp;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	for (i = 0; i < 10; i++) {
+		sprintf(filename, "/tmp/famfs/%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	for (i = 0; i < 5; i++) {
+		sprintf(filename, "/tmp/famfs/dir%04d", i);
+		rc = __famfs_mkdir(&ll, filename, 0, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+	}
+
+	/* No cursor yet for this (new) file system */
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1), 0);
+
+	/* Dry run does not advance the cursor */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 1, 0, 1, 0, 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1), 0);
+
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 0, 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1),
+		  (s64)logp->famfs_log_next_index);
+
+	/* Entries behind the cursor are not re-validated by an incremental logplay */
+	tmp = logp->entries[0].famfs_log_entry_seqnum;
+	logp->entries[0].famfs_log_entry_seqnum = 420;
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 0, 1);
+	ASSERT_EQ(rc, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 1); /* full replay */
+	ASSERT_NE(rc, 0);
+	logp->entries[0].famfs_log_entry_seqnum = tmp;
+
+	/* New entries are played and the cursor advances */
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/newfile", 0, 0, 0, 1048576, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1),
+		  (s64)logp->famfs_log_next_index - 1);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 1, 0, 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1),
+		  (s64)logp->famfs_log_next_index);
+
+	/* Broken seqnum chain at the cursor forces a full replay */
+	crc = logp->entries[logp->famfs_log_next_index - 1].famfs_log_entry_crc;
+	logp->entries[logp->famfs_log_next_index - 1].famfs_log_entry_crc++;
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1), 0);
+	logp->entries[logp->famfs_log_next_index - 1].famfs_log_entry_crc = crc;
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1),
+		  (s64)logp->famfs_log_next_index);
+
+	/* A different mount instance (new .meta dir) forces a full replay */
+	system("touch /tmp/famfs/.meta/.newmount");
+	ASSERT_EQ(famfs_logplay_cursor_start(logp, "/tmp/famfs", 1), 0);
+	unlink("/tmp/famfs/.meta/.newmount");
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	mock_kmod = 0;
+}
+
+TEST(famfs, famfs_logplay_parallel)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char filename[64];
+	struct stat st;
+	u64 tmp;
+	int rc;
+	int fd;
+	int i, j;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	for (i = 0; i < 8; i++) {
+		sprintf(filename, "/tmp/famfs/dir%d", i);
+		rc = __famfs_mkdir(&ll, filename, 0, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+		sprintf(filename, "/tmp/famfs/dir%d/sub", i);
+		rc = __famfs_mkdir(&ll, filename, 0, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+		for (j = 0; j < 10; j++) {
+			sprintf(filename, "/tmp/famfs/dir%d/%s%d", i, (j & 1) ? "sub/" : "", j);
+			fd = __famfs_mkfile(&ll, filename, 0, 0, 0, 1048576, 0);
+			ASSERT_GT(fd, 0);
+			close(fd);
+		}
+	}
+
+	/* Wipe the namespace (but not the log); parallel logplay must rebuild it */
+	system("rm -rf /tmp/famfs/dir*");
+
+	/* An invalid entry fails the whole replay before any files are created */
+	tmp = logp->entries[logp->famfs_log_next_index - 1].famfs_log_entry_seqnum;
+	logp->entries[logp->famfs_log_next_index - 1].famfs_log_entry_seqnum = 420;
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 4, 1);
+	ASSERT_EQ(rc, -1);
+	ASSERT_NE(stat("/tmp/famfs/dir0/0", &st), 0);
+	logp->entries[logp->famfs_log_next_index - 1].famfs_log_entry_seqnum = tmp;
+
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 4, 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 10; j++) {
+			sprintf(filename, "/tmp/famfs/dir%d/%s%d", i, (j & 1) ? "sub/" : "", j);
+			ASSERT_EQ(stat(filename, &st), 0);
+			ASSERT_TRUE(S_ISREG(st.st_mode));
+		}
+	}
+
+	/* Replay again: everything exists; more threads than shards with files */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 64, 2);
+	ASSERT_EQ(rc, 0);
+
+	/* Dry run */
+	rc = __famfs_logplay(logp, "/tmp/famfs", 1, 0, 0, 3, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	mock_kmod = 0;
+}
+
+/* Per-bit reference for the bitmap range operations */
+static u64
+ref_find_next(u8 *bitmap, u64 nbits, u64 start, int want_zero)
+{
+	for (; start < nbits; start++)
+		if (mu_bitmap_test(bitmap, start) != want_zero)
+			return start;
+	return nbits;
+}
+
+TEST(famfs, mu_bitmap_range_ops)
+{
+	u64 sizes[] = { 1, 7, 8, 63, 64, 65, 255, 256, 257, 1000, 4096, 10007 };
+	struct xrand xr;
+	u64 n, i, k;
+	int simd;
+
+	xrand_init(&xr, 42);
+
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		u64 nbits = sizes[n];
+		u64 nbytes = mu_bitmap_size(nbits);
+		u8 *bitmap = (u8 *)calloc(1, nbytes);
+		u8 *ref = (u8 *)calloc(1, nbytes);
+
+		ASSERT_NE(bitmap, nullptr);
+		ASSERT_NE(ref, nullptr);
+
+		/* Empty bitmap, then long runs (to exercise the 256-bit skips), then random */
+		for (k = 0; k < 3; k++) {
+			if (k == 1) {
+				mu_bitmap_set_range(bitmap, 0, nbits);
+				for (i = 0; i < nbits; i++)
+					ASSERT_EQ(mu_bitmap_test(bitmap, i), 1);
+				mu_bitmap_test_and_clear(bitmap, nbits - 1);
+				mu_bitmap_test_and_clear(bitmap, nbits / 2);
+			} else if (k == 2) {
+				for (i = 0; i < nbytes; i++)
+					bitmap[i] = xrand64(&xr) & xrand64(&xr);
+			}
+
+			for (simd = 0; simd < 2; simd++) {
+				for (i = 0; i <= nbits; i += (nbits > 300) ? 17 : 1) {
+					ASSERT_EQ(__mu_bitmap_find_next(bitmap, nbits, i, 1, simd),
+						  ref_find_next(bitmap, nbits, i, 1));
+					ASSERT_EQ(__mu_bitmap_find_next(bitmap, nbits, i, 0, simd),
+						  ref_find_next(bitmap, nbits, i, 0));
+				}
+			}
+			ASSERT_EQ(mu_bitmap_find_first_zero(bitmap, nbits),
+				  ref_find_next(bitmap, nbits, 0, 1));
+
+			/* find_zero_run agrees with a per-bit search */
+			for (i = 1; i < 140; i += (i < 12) ? 1 : 31) {
+				u64 from;
+
+				for (from = 0; from < nbits; from += (nbits / 5) + 1) {
+					s64 expect = -1;
+					u64 j, run = 0;
+
+					for (j = from; j < nbits; j++) {
+						run = mu_bitmap_test(bitmap, j) ? 0 : run + 1;
+						if (run == i) {
+							expect = j + 1 - i;
+							break;
+						}
+					}
+					for (simd = 0; simd < 2; simd++)
+						ASSERT_EQ(__mu_bitmap_find_zero_run(bitmap, nbits,
+										    from, i, simd),
+							  expect);
+				}
+			}
+		}
+
+		/* test_and_set_range counts collisions and sets every bit in the range */
+		for (k = 0; k < 50; k++) {
+			u64 start = xrand_range64(&xr, 0, nbits);
+			u64 len = xrand_range64(&xr, 0, nbits - start + 1);
+			u64 expect = 0;
+
+			for (i = 0; i < nbytes; i++)
+				ref[i] = bitmap[i] = xrand64(&xr);
+			for (i = start; i < start + len; i++)
+				expect += !mu_bitmap_test_and_set(ref, i);
+
+			ASSERT_EQ(mu_bitmap_test_and_set_range(bitmap, start, len), expect);
+			ASSERT_EQ(memcmp(bitmap, ref, nbytes), 0);
+
+			for (i = 0; i < nbytes; i++)
+				ref[i] = bitmap[i] = xrand64(&xr);
+			for (i = start; i < start + len; i++)
+				mu_bitmap_set(ref, i);
+			mu_bitmap_set_range(bitmap, start, len);
+			ASSERT_EQ(memcmp(bitmap, ref, nbytes), 0);
+		}
+		free(bitmap);
+		free(ref);
+	}
+}
+
+TEST(famfs, famfs_append_log_flush)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	u64 max_lines_per_append = (sizeof(struct famfs_log_entry) / 64) + 2 + 1;
+	extern unsigned long long flushed_cache_lines;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_flush;
+	extern int mock_kmod;
+	int save_mock_flush = mock_flush;
+	unsigned long long lines;
+	char filename[64];
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	/* Allocate the bitmap first, so only log appends are measured */
+	fd = __famfs_mkfile(&ll, "/tmp/famfs/first", 0, 0, 0, 1048576, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+
+	mock_flush = 0;
+	count_flush = 1;
+	flushed_cache_lines = 0;
+	for (i = 0; i < 100; i++) {
+		sprintf(filename, "/tmp/famfs/f%04d", i);
+		fd = __famfs_mkfile(&ll, filename, 0, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	for (i = 0; i < 20; i++) {
+		sprintf(filename, "/tmp/famfs/d%04d", i);
+		rc = __famfs_mkdir(&ll, filename, 0, 0, 0, 0);
+		ASSERT_EQ(rc, 0);
+	}
+	lines = flushed_cache_lines;
+	count_flush = 0;
+	mock_flush = save_mock_flush;
+
+	printf("famfs_append_log_flush: %llu lines flushed for 120 appends "
+	       "(flushing the whole log would be %llu)\n",
+	       lines, 120ULL * (logp->famfs_log_len / 64));
+	ASSERT_GT(lines, 0);
+	ASSERT_LE(lines, 120 * max_lines_per_append);
+
+	/* The entries and header are intact */
+	ASSERT_EQ(logp->famfs_log_next_index, 121);
+	rc = famfs_fsck_scan(sb, logp, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	mock_kmod = 0;
+}
+
+TEST(famfs, famfs_log_txn)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	extern unsigned long long flushed_cache_lines;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log_txn txn, txn2;
+	struct famfs_log *logp;
+	extern int mock_flush;
+	extern int mock_kmod;
+	int save_mock_flush = mock_flush;
+	char filename[64];
+	u64 start_index;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+	ASSERT_EQ(rc, 0);
+
+	/* Staged entries are not visible until commit */
+	start_index = logp->famfs_log_next_index;
+	famfs_log_txn_begin(&txn, &ll);
+	ll.txn = &txn;
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/txndir", 0, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < 10; i++) {
+		sprintf(filename, "/tmp/famfs/txndir/f%d", i);
+		fd = __famfs_mkfile(&ll, filename, 0, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	ASSERT_EQ(txn.nentries, 11);
+	ASSERT_EQ(logp->famfs_log_next_index, start_index);
+
+	mock_flush = 0;
+	count_flush = 1;
+	flushed_cache_lines = 0;
+	ASSERT_EQ(famfs_log_txn_commit(&txn), 11);
+	count_flush = 0;
+	mock_flush = save_mock_flush;
+	ll.txn = NULL;
+
+	/* One flush of the contiguous entries, plus the header */
+	ASSERT_LE(flushed_cache_lines, (11 * sizeof(struct famfs_log_entry)) / 64 + 2 + 1);
+	ASSERT_EQ(logp->famfs_log_next_index, start_index + 11);
+	ASSERT_EQ(logp->famfs_log_next_seqnum, start_index + 11);
+	for (i = 0; i < 11; i++) {
+		ASSERT_EQ(famfs_validate_log_entry(&logp->entries[start_index + i],
+						   start_index + i), 0);
+	}
+
+	/* Committing an empty txn is a no-op */
+	ASSERT_EQ(famfs_log_txn_commit(&txn), 0);
+	ASSERT_EQ(logp->famfs_log_next_index, start_index + 11);
+
+	/* Hold some entries in a deferred txn while another txn fills the log */
+	famfs_log_txn_begin(&txn2, &ll);
+	famfs_log_txn_defer(&txn2);
+	for (i = 0; i < 3; i++) {
+		struct famfs_log_entry le;
+
+		memset(&le, 0, sizeof(le));
+		le.famfs_log_entry_type = FAMFS_LOG_FILE;
+		sprintf((char *)le.famfs_fc.famfs_relpath, "txnheld%d", i);
+		ASSERT_EQ(famfs_log_txn_append(&txn2, &le), 0);
+	}
+
+	/* A txn that overflows the log stages what fits, and commit publishes it */
+	famfs_log_txn_begin(&txn, &ll);
+	for (i = 0; ; i++) {
+		struct famfs_log_entry le;
+
+		memset(&le, 0, sizeof(le));
+		le.famfs_log_entry_type = FAMFS_LOG_MKDIR;
+		sprintf((char *)le.famfs_md.famfs_relpath, "txnfill%d", i);
+		if (famfs_log_txn_append(&txn, &le))
+			break;
+	}
+	ASSERT_EQ(famfs_log_txn_commit(&txn), logp->famfs_log_last_index + 1 - start_index - 11);
+	ASSERT_EQ(logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
+
+	/* A deferred txn that no longer fits publishes none of its entries, and keeps them */
+	ASSERT_EQ(famfs_log_txn_commit(&txn2), 0);
+	ASSERT_EQ(txn2.nentries, 3);
+	ASSERT_EQ(logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
+	famfs_log_txn_discard(&txn2);
+
+	rc = famfs_fsck_scan(sb, logp, 1, 0);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+	mock_kmod = 0;
+}
+
+TEST(famfs, famfs_log_txn_deferred)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_reservation rv[4];
+	struct famfs_locked_log ll, ll2;
+	struct famfs_superblock *sb;
+	struct famfs_log_txn txn, txn2;
+	struct famfs_log_entry le;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char resvpath[PATH_MAX];
+	char filename[64];
+	u64 hdr[2];
+	u64 start_index, other, other_index;
+	pid_t pid;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	famfs_reservation_path(&sb->ts_uuid, resvpath);
+	unlink(resvpath);
+
+	/* Phase 1: allocate and create under the lock; the file entries are only held,
+	 * but the directory is published right away
+	 */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ll.nresv, 0);
+	start_index = logp->famfs_log_next_index;
+	famfs_log_txn_begin(&txn, &ll);
+	famfs_log_txn_defer(&txn);
+	ll.txn = &txn;
+	rc = __famfs_mkdir(&ll, "/tmp/famfs/defdir", 0, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(logp->famfs_log_next_index, start_index + 1);
+	ASSERT_EQ(logp->entries[start_index].famfs_log_entry_type, FAMFS_LOG_MKDIR);
+	for (i = 0; i < 5; i++) {
+		sprintf(filename, "/tmp/famfs/defdir/f%d", i);
+		fd = __famfs_mkfile(&ll, filename, 0, 0, 0, 1048576, 0);
+		ASSERT_GT(fd, 0);
+		close(fd);
+	}
+	ASSERT_EQ(txn.nentries, 5);
+	ASSERT_EQ(logp->famfs_log_next_index, start_index + 1);
+	ll.txn = NULL;
+
+	/* An abandoned entry is dropped, and its file unlinked */
+	rc = famfs_log_txn_abandon(&txn, ll.mpt, 2);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(txn.nentries, 4);
+	ASSERT_NE(access("/tmp/famfs/defdir/f2", F_OK), 0);
+	ASSERT_STREQ((char *)txn.entries[2].famfs_fc.famfs_relpath, "defdir/f3");
+	start_index++;
+	rc = famfs_reservation_save(&ll, &txn);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	/* Phase 2: another writer sees the reservations, and allocates around them */
+	rc = famfs_init_locked_log(&ll2, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ll2.nresv, 4);
+	ASSERT_EQ(ll2.resv_slots, 4);
+	fd = __famfs_mkfile(&ll2, "/tmp/famfs/other", 0, 0, 0, 1048576, 0);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	ASSERT_EQ(logp->famfs_log_next_index, start_index + 1);
+	other_index = start_index;
+	other = logp->entries[other_index].famfs_fc.famfs_ext_list[0].se.famfs_extent_offset;
+	for (i = 0; i < 4; i++)
+		ASSERT_NE(other, txn.entries[i].famfs_fc.famfs_ext_list[0].se.famfs_extent_offset);
+
+	/* ...and its own deferred txn leaves the reserved log slots free */
+	famfs_log_txn_begin(&txn2, &ll2);
+	famfs_log_txn_defer(&txn2);
+	memset(&le, 0, sizeof(le));
+	le.famfs_log_entry_type = FAMFS_LOG_FILE;
+	while (famfs_log_txn_append(&txn2, &le) == 0)
+		;
+	ASSERT_EQ(txn2.nentries, logp->famfs_log_last_index + 1 - (start_index + 1) - 4);
+	famfs_log_txn_discard(&txn2);
+
+	/* ...and so do writers that publish right away */
+	famfs_log_txn_begin(&txn2, &ll2);
+	le.famfs_log_entry_type = FAMFS_LOG_MKDIR;
+	while (famfs_log_txn_append(&txn2, &le) == 0)
+		;
+	ASSERT_EQ(famfs_log_txn_commit(&txn2),
+		  logp->famfs_log_last_index + 1 - (start_index + 1) - 4);
+	ASSERT_EQ(logp->famfs_log_next_index, logp->famfs_log_last_index + 1 - 4);
+	rc = __famfs_mkdir(&ll2, "/tmp/famfs/nodir", 0, 0, 0, 0);
+	ASSERT_NE(rc, 0);
+	fd = __famfs_mkfile(&ll2, "/tmp/famfs/nofile", 0, 0, 0, 1048576, 0);
+	ASSERT_LT(fd, 0);
+	rc = famfs_release_locked_log(&ll2);
+	ASSERT_EQ(rc, 0);
+
+	/* Phase 3: publish under the lock again, in the reserved slots at the end of the log */
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ll.nresv, 4);
+	txn.logp = ll.logp;
+
+	/* Saving again replaces this process's records rather than adding to them */
+	rc = famfs_reservation_save(&ll, &txn);
+	ASSERT_EQ(rc, 0);
+	fd = open(resvpath, O_RDONLY);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(read(fd, hdr, sizeof(hdr)), (ssize_t)sizeof(hdr));
+	close(fd);
+	ASSERT_EQ(hdr[1], 4ULL);
+
+	start_index = logp->famfs_log_next_index;
+	ASSERT_EQ(famfs_log_txn_commit(&txn), 4);
+	ASSERT_EQ(logp->famfs_log_next_index, logp->famfs_log_last_index + 1);
+	for (i = 0; i < 4; i++) {
+		ASSERT_EQ(famfs_validate_log_entry(&logp->entries[start_index + i],
+						   start_index + i), 0);
+	}
+	rc = famfs_reservation_release(&ll);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ll.nresv, 0);
+	ASSERT_NE(access(resvpath, F_OK), 0);
+	rc = famfs_fsck_scan(sb, logp, 1, 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	/* The reservations of a writer that exited are recovered: an entry that reached
+	 * the log is just dropped, the file of an unpublished one is unlinked, and a record
+	 * whose file can't be unlinked is kept. A record whose pid now belongs to another
+	 * process (with a different start time) is recovered too
+	 */
+	pid = fork();
+	ASSERT_GE(pid, 0);
+	if (pid == 0)
+		_exit(0);
+	waitpid(pid, NULL, 0);
+	fd = open("/tmp/famfs/orphan", O_RDWR | O_CREAT, 0644);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	fd = open("/tmp/famfs/reused", O_RDWR | O_CREAT, 0644);
+	ASSERT_GT(fd, 0);
+	close(fd);
+	hdr[0] = FAMFS_RESERVATION_MAGIC;
+	hdr[1] = 4;
+	memset(rv, 0, sizeof(rv));
+	for (i = 0; i < 4; i++) {
+		rv[i].rv_pid = pid;
+		rv[i].rv_log_index = other_index;
+		rv[i].rv_entry.famfs_log_entry_type = FAMFS_LOG_FILE;
+	}
+	memcpy(&rv[0].rv_entry, &logp->entries[other_index], sizeof(rv[0].rv_entry));
+	strcpy((char *)rv[1].rv_entry.famfs_fc.famfs_relpath, "orphan");
+	rv[1].rv_entry.famfs_fc.famfs_nextents = 1;
+	rv[1].rv_entry.famfs_fc.famfs_ext_list[0].se.famfs_extent_offset = other;
+	rv[1].rv_entry.famfs_fc.famfs_ext_list[0].se.famfs_extent_len = 1048576;
+	strcpy((char *)rv[2].rv_entry.famfs_fc.famfs_relpath, "defdir");
+	rv[3].rv_pid = getppid();
+	rv[3].rv_start = 1;
+	strcpy((char *)rv[3].rv_entry.famfs_fc.famfs_relpath, "reused");
+	fd = open(resvpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(write(fd, hdr, sizeof(hdr)), (ssize_t)sizeof(hdr));
+	ASSERT_EQ(write(fd, rv, sizeof(rv)), (ssize_t)sizeof(rv));
+	close(fd);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ll.nresv, 1);
+	ASSERT_EQ(ll.resv_slots, 1);
+	ASSERT_STREQ((char *)ll.resv[0].rv_entry.famfs_fc.famfs_relpath, "defdir");
+	ASSERT_EQ(access("/tmp/famfs/other", F_OK), 0);
+	ASSERT_NE(access("/tmp/famfs/orphan", F_OK), 0);
+	ASSERT_NE(access("/tmp/famfs/reused", F_OK), 0);
+	rc = famfs_release_locked_log(&ll);
+	ASSERT_EQ(rc, 0);
+
+	/* The recovered records are gone from the file too */
+	fd = open(resvpath, O_RDONLY);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(read(fd, hdr, sizeof(hdr)), (ssize_t)sizeof(hdr));
+	close(fd);
+	ASSERT_EQ(hdr[1], 1ULL);
+
+	/* A corrupt reservation file fails the lock rather than risking double allocation */
+	fd = open(resvpath, O_WRONLY | O_TRUNC);
+	ASSERT_GT(fd, 0);
+	ASSERT_EQ(write(fd, hdr, sizeof(hdr)), (ssize_t)sizeof(hdr));
+	close(fd);
+	rc = famfs_init_locked_log(&ll, "/tmp/famfs", 0);
+	ASSERT_NE(rc, 0);
+
+	unlink(resvpath);
+	mock_kmod = 0;
+}
+
+TEST(famfs, famfs_bitmap_snapshot)
+{
+	u64 device_size = 1024 * 1024 * 1024;
+	struct famfs_bitmap_snapshot bs;
+	struct famfs_locked_log ll;
+	struct famfs_superblock *sb;
+	struct famfs_log *logp;
+	extern int mock_kmod;
+	char snappath[PATH_MAX];
+	char filename[64];
+	u64 nfiles = 0;
+	int session;
+	int rc;
+	int fd;
+	int i;
+
+	mock_kmod = 1;
+	rc = create_mock_famfs_instance("/tmp/famfs", device_size, &sb, &logp);
+	ASSERT_EQ(rc, 0);
+	famfs_bitmap_snapshot_path(&sb->ts_uuid, snappath);
+	unlink(snappath);
+
+	for (session = 0; session < 4; session++) {
+		u64 start_index = logp->famfs_log_next_index;
+
+		if (session == 2) {
+			/* Corrupt snapshot: must fall back to a full rebuild */
+			fd = open(snappath, O_WRONLY);
+			ASSERT_GT(fd, 0);
+			ASSERT_EQ(pwrite(fd, "garbage", 7, 16), 7);
+			close(fd);
+		} else if (session == 3) {
+			/* Truncated snapshot */
+			ASSERT_EQ(truncate(snappath, sizeof(bs) + 3), 0);
+		}
+
+		rc = famfs_init_locked_log(&ll, "/tmp/famfs", 1);
+		ASSERT_EQ(rc, 0);
+		for (i = 0; i < 10; i++) {
+			sprintf(filename, "/tmp/famfs/snap%04lld", nfiles++);
+			fd = __famfs_mkfile(&ll, filename, 0, 0, 0, 2 * 1048576, 1);
+			ASSERT_GT(fd, 0);
+			close(fd);
+		}
+		rc = famfs_release_locked_log(&ll);
+		ASSERT_EQ(rc, 0);
+
+		/* Snapshot was brought up to date before this session's allocations */
+		fd = open(snappath, O_RDONLY);
+		ASSERT_GT(fd, 0);
+		ASSERT_EQ(read(fd, &bs, sizeof(bs)), (ssize_t)sizeof(bs));
+		close(fd);
+		ASSERT_EQ(bs.bs_magic, FAMFS_BITMAP_SNAPSHOT_MAGIC);
+		ASSERT_EQ(bs.bs_next_index, start_index);
+
+		/* No double allocations, whether the snapshot was used or not */
+		rc = famfs_fsck_scan(sb, logp, 1, 0);
+		ASSERT_EQ(rc, 0);
+	}
+
+	unlink(snappath);
+	mock_kmod = 0;
+}
+
+TEST(famfs, famfs_free_index)
+{
+	struct famfs_free_index fi;
+	u64 nbits = 4096;
+	u8 *bitmap_scan;
+	u8 *bitmap_idx;
+	s64 off_scan;
+	s64 start;
+	u64 i;
+	int rc;
+
+	bitmap_scan = (u8 *)calloc(1, nbits / 8);
+	bitmap_idx = (u8 *)calloc(1, nbits / 8);
+	ASSERT_NE(bitmap_scan, nullptr);
+	ASSERT_NE(bitmap_idx, nullptr);
+
+	/* Fragment the bitmap with runs of varying lengths */
+	for (i = 0; i < nbits; i++)
+		if ((i % 7) == 0 || (i % 13) == 0 || (i > 3000 && i < 3100))
+			mu_bitmap_set(bitmap_scan, i);
+	memcpy(bitmap_idx, bitmap_scan, nbits / 8);
+
+	rc = famfs_free_index_build(&fi, bitmap_idx, nbits);
+	ASSERT_EQ(rc, 0);
+	ASSERT_GT(fi.nruns, 0);
+
+	/* First-fit from the index must match the bitmap scan, until both run out */
+	for (i = 0; ; i++) {
+		u64 nalloc = (i % 11) + 1;
+
+		off_scan = bitmap_alloc_contiguous(bitmap_scan, nbits, nalloc * FAMFS_ALLOC_UNIT);
+		start = famfs_free_index_alloc(&fi, nalloc);
+		if (off_scan < 0) {
+			ASSERT_LT(start, 0);
+			break;
+		}
+		ASSERT_EQ(off_scan, start * (s64)FAMFS_ALLOC_UNIT);
+	}
+
+	/* Single units should still fill the remaining holes identically */
+	for (;;) {
+		off_scan = bitmap_alloc_contiguous(bitmap_scan, nbits, 1);
+		start = famfs_free_index_alloc(&fi, 1);
+		if (off_scan < 0) {
+			ASSERT_LT(start, 0);
+			break;
+		}
+		ASSERT_EQ(off_scan, start * (s64)FAMFS_ALLOC_UNIT);
+	}
+	ASSERT_EQ(famfs_free_index_alloc(&fi, 0), -1);
+
+	famfs_free_index_free(&fi);
+
+	/* Fully allocated bitmap: no runs */
+	memset(bitmap_idx, 0xff, nbits / 8);
+	rc = famfs_free_index_build(&fi, bitmap_idx, nbits);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(fi.nruns, 0);
+	ASSERT_EQ(famfs_free_index_alloc(&fi, 1), -1);
+	famfs_free_index_free(&fi);
+
+	free(bitmap_scan);
+	free(bitmap_idx);
+}
+
+static double
+ts_elapsed(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Benchmark: allocate thousands of files on a simulated, fragmented 4 TiB device */
+TEST(famfs, famfs_free_index_bench)
+{
+	u64 dev_size = 4ULL * 1024 * 1024 * 1024 * 1024;
+	u64 nbits = (dev_size - FAMFS_SUPERBLOCK_SIZE - FAMFS_LOG_LEN) / FAMFS_ALLOC_UNIT;
+	u64 nbytes = (nbits + 7) / 8;
+	u64 frag_bits = nbits / 32; /* first 128 GiB is fragmented into 1-unit holes */
+	int nfiles = 2000;
+	struct timespec t0, t1, t2, t3;
+	struct famfs_free_index fi;
+	s64 *off_scan;
+	s64 *off_idx;
+	u8 *bitmap_scan;
+	u8 *bitmap_idx;
+	u64 i;
+	int rc;
+
+	bitmap_scan = (u8 *)calloc(1, nbytes);
+	bitmap_idx = (u8 *)calloc(1, nbytes);
+	off_scan = (s64 *)calloc(nfiles, sizeof(*off_scan));
+	off_idx = (s64 *)calloc(nfiles, sizeof(*off_idx));
+	ASSERT_NE(bitmap_scan, nullptr);
+	ASSERT_NE(bitmap_idx, nullptr);
+	ASSERT_NE(off_scan, nullptr);
+	ASSERT_NE(off_idx, nullptr);
+
+	for (i = 0; i < frag_bits; i += 2)
+		mu_bitmap_set(bitmap_scan, i);
+	memcpy(bitmap_idx, bitmap_scan, nbytes);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < (u64)nfiles; i++)
+		off_scan[i] = bitmap_alloc_contiguous(bitmap_scan, nbits,
+						      ((i % 4) + 2) * FAMFS_ALLOC_UNIT);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	rc = famfs_free_index_build(&fi, bitmap_idx, nbits);
+	ASSERT_EQ(rc, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	for (i = 0; i < (u64)nfiles; i++) {
+		s64 start = famfs_free_index_alloc(&fi, (i % 4) + 2);
+
+		off_idx[i] = (start < 0) ? -1 : start * (s64)FAMFS_ALLOC_UNIT;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t3);
+
+	for (i = 0; i < (u64)nfiles; i++) {
+		ASSERT_GT(off_scan[i], 0);
+		ASSERT_EQ(off_scan[i], off_idx[i]);
+	}
+
+	printf("famfs_free_index_bench: %d allocs on %lld-bit bitmap (%lld free runs)\n",
+	       nfiles, nbits, fi.nruns);
+	printf("\tbitmap scan:       %.6f sec\n", ts_elapsed(&t0, &t1));
+	printf("\tfree index build:  %.6f sec\n", ts_elapsed(&t1, &t2));
+	printf("\tfree index allocs: %.6f sec\n", ts_elapsed(&t2, &t3));
+
+	famfs_free_index_free(&fi);
+	free(bitmap_scan);
+	free(bitmap_idx);
+	free(off_scan);
+	free(off_idx);
+}
+
+TEST(famfs, famfs_flush_backend_bench)
+{
+	enum mu_flush_backend backends[] = {
+		MU_FLUSH_CLFLUSH, MU_FLUSH_CLFLUSHOPT, MU_FLUSH_CLWB };
+	const char *fname = "/tmp/famfs_flush_bench";
+	size_t len = 64ULL * 1024 * 1024;
+	int save_mock_flush = mock_flush;
+	unsigned long long lines;
+	struct timespec t0, t1;
+	size_t i;
+	char *buf;
+	int fd;
+	int rc;
+
+	fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	ASSERT_GT(fd, 0);
+	rc = ftruncate(fd, len);
+	ASSERT_EQ(rc, 0);
+	buf = (char *)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ASSERT_NE(buf, MAP_FAILED);
+
+	mock_flush = 0;
+
+	/* An unaligned range touches one extra line at each end */
+	count_flush = 1;
+	lines = flushed_cache_lines;
+	flush_processor_cache(buf + 1, 2 * CL_SIZE);
+	ASSERT_EQ(flushed_cache_lines - lines, 3);
+	count_flush = 0;
+
+	/* clwb never invalidates, so it must not be used for invalidation */
+	mu_flush_backend = MU_FLUSH_CLWB;
+	ASSERT_NE(mu_invalidate_backend(), MU_FLUSH_CLWB);
+
+	printf("famfs_flush_backend_bench: %zu MiB file-backed buffer\n", len >> 20);
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		enum mu_flush_backend be = backends[i];
+		double wb_sec, inv_sec;
+
+		if (!mu_flush_backend_supported(be)) {
+			printf("\t%-10s not supported by this cpu\n", mu_flush_backend_name(be));
+			continue;
+		}
+		mu_flush_backend = be;
+
+		memset(buf, (int)i + 1, len);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		writeback_processor_cache(buf, len);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		wb_sec = ts_elapsed(&t0, &t1);
+		ASSERT_EQ(mu_writeback_backend(), be);
+
+		memset(buf, (int)i + 2, len);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		hard_flush_processor_cache(buf, len);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		inv_sec = ts_elapsed(&t0, &t1);
+
+		printf("\t%-10s writeback %6.2f GB/s; invalidate (%s) %6.2f GB/s\n",
+		       mu_flush_backend_name(be), len / wb_sec / 1e9,
+		       mu_flush_backend_name(mu_invalidate_backend()), len / inv_sec / 1e9);
+		ASSERT_EQ(buf[len - 1], (char)(i + 2));
+	}
+
+	mu_flush_backend = MU_FLUSH_AUTO;
+	mock_flush = save_mock_flush;
+	munmap(buf, len);
+	close(fd);
+	unlink(fname);
+}
+
+TEST(famfs, famfs_memcpy_nt_bench)
+{
+	size_t offsets[] = { 0, 1, 17, 63, 64, 100 };
+	size_t lens[] = { 0, 1, 63, 64, 65, 127, 4096 + 3, 1048576 + 5 };
+	size_t len = 64ULL * 1024 * 1024;
+	int save_mock_flush = mock_flush;
+	struct timespec t0, t1;
+	double cached_sec;
+	char *src, *dst;
+	size_t i, j, k;
+	int sse2;
+
+	src = (char *)malloc(len);
+	dst = (char *)aligned_alloc(4096, len + 4096);
+	ASSERT_NE(src, nullptr);
+	ASSERT_NE(dst, nullptr);
+	randomize_buffer(src, len, 11);
+	mock_flush = 0;
+
+	/* Every alignment and length, with both store widths; nothing outside the range
+	 * is touched
+	 */
+	for (sse2 = 0; sse2 < 2; sse2++) {
+		mu_memcpy_nt_force_sse2 = sse2;
+		for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+			for (j = 0; j < sizeof(lens) / sizeof(lens[0]); j++) {
+				size_t ofs = offsets[i], n = lens[j];
+
+				memset(dst, 0xa5, n + 2 * 4096);
+				mu_memcpy_nt(dst + 4096 + ofs, src, n);
+				ASSERT_EQ(memcmp(dst + 4096 + ofs, src, n), 0);
+				ASSERT_EQ(dst[4096 + ofs - 1], (char)0xa5);
+				ASSERT_EQ(dst[4096 + ofs + n], (char)0xa5);
+
+				mu_memzero_nt(dst + 4096 + ofs, n);
+				for (k = 0; k < n; k++)
+					ASSERT_EQ(dst[4096 + ofs + k], 0);
+				ASSERT_EQ(dst[4096 + ofs - 1], (char)0xa5);
+				ASSERT_EQ(dst[4096 + ofs + n], (char)0xa5);
+			}
+		}
+	}
+	mu_memcpy_nt_force_sse2 = 0;
+
+	printf("famfs_memcpy_nt_bench: %zu MiB (avx %s)\n", len >> 20,
+	       (mu_avx_supported()) ? "yes" : "no");
+	memset(dst, 0, len);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	memcpy(dst, src, len);
+	flush_processor_cache(dst, len);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	cached_sec = ts_elapsed(&t0, &t1);
+	printf("\tmemcpy + flush      %6.2f GB/s\n", len / cached_sec / 1e9);
+
+	for (sse2 = 0; sse2 < 2; sse2++) {
+		mu_memcpy_nt_force_sse2 = sse2;
+		memset(dst, 0, len);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		mu_memcpy_nt(dst, src, len);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("\tnon-temporal (%s) %6.2f GB/s\n", (sse2) ? "sse2" : "avx ",
+		       len / ts_elapsed(&t0, &t1) / 1e9);
+		ASSERT_EQ(memcmp(dst, src, len), 0);
+	}
+
+	mu_memcpy_nt_force_sse2 = 0;
+	mock_flush = save_mock_flush;
+	free(src);
+	free(dst);
+}
+
+TEST(famfs, famfs_csum_bench)
+{
+	const char *check = "123456789";
+	size_t maxlen = 1024 * 1024;
+	struct timespec t0, t1;
+	unsigned long crc;
+	u8 *buf;
+	size_t len, i;
+	int save_force_sw = mu_crc32c_force_sw;
+
+	/* Standard check values */
+	ASSERT_EQ(mu_csum(MU_CSUM_CRC32, check, 9), 0xcbf43926);
+	ASSERT_EQ(mu_csum(MU_CSUM_CRC32C, check, 9), 0xe3069283);
+	mu_crc32c_force_sw = 1;
+	ASSERT_EQ(mu_csum(MU_CSUM_CRC32C, check, 9), 0xe3069283);
+	mu_crc32c_force_sw = save_force_sw;
+
+	buf = (u8 *)malloc(maxlen + 8);
+	ASSERT_NE(buf, nullptr);
+	randomize_buffer(buf, maxlen + 8, 42);
+
+	/* Hardware and software CRC32C must agree for any length and alignment */
+	for (len = 0; len < 100; len++) {
+		for (i = 0; i < 8; i++) {
+			crc = mu_crc32c(0, buf + i, len);
+			mu_crc32c_force_sw = 1;
+			ASSERT_EQ(crc, mu_crc32c(0, buf + i, len));
+			mu_crc32c_force_sw = save_force_sw;
+		}
+	}
+	/* ...and continuing a crc must match doing it in one call */
+	ASSERT_EQ(mu_crc32c(mu_crc32c(0, buf, 1000), buf + 1000, 3000),
+		  mu_crc32c(0, buf, 4000));
+
+	printf("famfs_csum_bench: crc32c hardware %s\n",
+	       mu_crc32c_hw_supported() ? "supported" : "not supported");
+	printf("\t%8s %16s %16s %16s\n", "size", "crc32 (zlib)", "crc32c (sw)", "crc32c");
+	for (len = 64; len <= maxlen; len *= 4) {
+		size_t niter = MAX((64ULL * 1024 * 1024) / len, 16);
+		double gbps[3];
+		int k;
+
+		for (k = 0; k < 3; k++) {
+			enum mu_csum_type type = (k == 0) ? MU_CSUM_CRC32 : MU_CSUM_CRC32C;
+			unsigned long sum = 0;
+
+			mu_crc32c_force_sw = (k == 1);
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (i = 0; i < niter; i++)
+				sum += mu_csum(type, buf, len);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			gbps[k] = (double)len * niter / ts_elapsed(&t0, &t1) / 1e9;
+			ASSERT_NE(sum, 0);
+		}
+		mu_crc32c_force_sw = save_force_sw;
+		printf("\t%8zu %11.2f GB/s %11.2f GB/s %11.2f GB/s\n",
+		       len, gbps[0], gbps[1], gbps[2]);
+	}
+	free(buf);
+}
+
+static u64
+flush_test_file(const char *path, u64 size)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || ftruncate(fd, size))
+		return 0;
+	close(fd);
+	return (size + CL_SIZE - 1) / CL_SIZE;
+}
+
+TEST(famfs, famfs_flush_files)
+{
+	const char *files[] = { "/tmp/famfs_flush/a", "/tmp/famfs_flush/sub/b",
+				"/tmp/famfs_flush/sub/c", "/tmp/famfs_flush/sub/empty" };
+	u64 sizes[] = { 1, 2 * FAMFS_FLUSH_CHUNK_SIZE + 4097, 4096, 0 };
+	char *args[] = { (char *)"/tmp/famfs_flush" };
+	char *file_args[] = { (char *)files[0], (char *)files[1] };
+	char *link_args[] = { (char *)"/tmp/famfs_flush/blink" };
+	int save_mock_flush = mock_flush;
+	unsigned long long lines;
+	u64 expect = 0;
+	u32 i;
+	int rc;
+
+	system("rm -rf /tmp/famfs_flush");
+	rc = mkdir("/tmp/famfs_flush", 0755);
+	ASSERT_EQ(rc, 0);
+	rc = mkdir("/tmp/famfs_flush/sub", 0755);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		u64 nlines = flush_test_file(files[i], sizes[i]);
+
+		ASSERT_EQ(nlines, (sizes[i] + CL_SIZE - 1) / CL_SIZE);
+		expect += nlines;
+	}
+
+	mock_flush = 0;
+	count_flush = 1;
+
+	/* A directory is an error unless recursive */
+	rc = famfs_flush_files(1, args, 0, FAMFS_FLUSH_HARD, 4, 0);
+	ASSERT_EQ(rc, 1);
+
+	/* Symlinks found while recursing are not followed (here, a loop and a second name
+	 * for a file), so every cache line of every file is flushed exactly once,
+	 * regardless of threads
+	 */
+	rc = symlink("/tmp/famfs_flush", "/tmp/famfs_flush/sub/loop");
+	ASSERT_EQ(rc, 0);
+	rc = symlink("sub/b", "/tmp/famfs_flush/blink");
+	ASSERT_EQ(rc, 0);
+	lines = flushed_cache_lines;
+	rc = famfs_flush_files(1, args, 1, FAMFS_FLUSH_HARD, 1, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines, expect);
+
+	lines = flushed_cache_lines;
+	rc = famfs_flush_files(1, args, 1, FAMFS_FLUSH_HARD, 8, 1);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines, expect);
+
+	lines = flushed_cache_lines;
+	rc = famfs_flush_files(2, file_args, 0, FAMFS_FLUSH_HARD, 3, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines,
+		  1 + (sizes[1] + CL_SIZE - 1) / CL_SIZE);
+
+	/* A symlink that is named explicitly is followed */
+	lines = flushed_cache_lines;
+	rc = famfs_flush_files(1, link_args, 0, FAMFS_FLUSH_HARD, 1, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines, (sizes[1] + CL_SIZE - 1) / CL_SIZE);
+
+	/* Bogus files are counted as errors, but the rest are still flushed */
+	file_args[1] = (char *)"/tmp/famfs_flush/bogus";
+	lines = flushed_cache_lines;
+	rc = famfs_flush_files(2, file_args, 0, FAMFS_FLUSH_HARD, 2, 0);
+	ASSERT_EQ(rc, 1);
+	ASSERT_EQ(flushed_cache_lines - lines, 1);
+
+	/* Ranges: only the cache lines that overlap the range are flushed */
+	lines = flushed_cache_lines;
+	rc = famfs_flush_range(files[1], 100, 200, FAMFS_FLUSH_WRITEBACK);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines, 4); /* [64, 320) */
+
+	lines = flushed_cache_lines;
+	rc = famfs_flush_range(files[1], FAMFS_FLUSH_CHUNK_SIZE + 4095, 2,
+			       FAMFS_FLUSH_INVALIDATE);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines, 2); /* straddles a page boundary */
+
+	lines = flushed_cache_lines;
+	rc = famfs_flush_range(files[1], sizes[1] - 4097, 0, FAMFS_FLUSH_HARD);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(flushed_cache_lines - lines, 65); /* len 0: through end of file */
+
+	rc = famfs_flush_range(files[1], sizes[1] - 1, 2, FAMFS_FLUSH_HARD);
+	ASSERT_NE(rc, 0);
+	rc = famfs_flush_range(files[1], sizes[1] + 1, 0, FAMFS_FLUSH_HARD);
+	ASSERT_NE(rc, 0);
+	rc = famfs_flush_range("/tmp/famfs_flush/sub", 0, 0, FAMFS_FLUSH_HARD);
+	ASSERT_NE(rc, 0);
+
+	count_flush = 0;
+	mock_flush = save_mock_flush;
+	system("rm -rf /tmp/famfs_flush");
+}
+
+/* Map a new /tmp file as a copy destination, and open a random source file of @size */
+static char *
+cp_engine_test_files(const char *src, const char *dest, u64 size, unsigned int seed,
+		     int *srcfd_out, int *destfd_out)
+{
+	u64 bufsize = (size + 3) & ~3ULL; /* randomize_buffer() needs a multiple of 4 */
+	char *buf = (char *)malloc(bufsize);
+	char *destp = NULL;
+	ssize_t resid;
+	int srcfd, destfd;
+	int rc;
+
+	if (!buf)
+		return NULL;
+	randomize_buffer(buf, bufsize, seed);
+	srcfd = open(src, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	resid = (srcfd >= 0) ? pwrite(srcfd, buf, size, 0) : -1;
+	free(buf);
+	if (resid != (ssize_t)size)
+		return NULL;
+
+	destfd = open(dest, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (destfd < 0)
+		return NULL;
+	rc = ftruncate(destfd, size);
+	if (!rc)
+		destp = (char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, destfd, 0);
+	if (!destp || destp == MAP_FAILED)
+		return NULL;
+
+	*srcfd_out = srcfd;
+	*destfd_out = destfd;
+	return destp;
+}
+
+static int
+cp_engine_test_cmp(const char *a, const char *b)
+{
+	char cmd[PATH * 2];
+
+	snprintf(cmd, sizeof(cmd), "cmp -s %s %s", a, b);
+	return system(cmd);
+}
+
+TEST(famfs, famfs_cp_engine)
+{
+	/* One file that spans many ranges, one with a partial last range, and small ones */
+	u64 sizes[] = { 5 * 1048576 + 17, 1048576 + 1, 4096, 1, 100, 8191 };
+	int nfiles = sizeof(sizes) / sizeof(sizes[0]);
+	struct famfs_cp_engine ce;
+	char src[PATH], dest[PATH];
+	extern int mock_failure;
+	int srcfd, destfd;
+	u64 total = 0;
+	u64 ndirect, id;
+	char *destp;
+	int i, rc;
+
+	system("rm -rf /tmp/famfs_cp_engine");
+	rc = mkdir("/tmp/famfs_cp_engine", 0755);
+	ASSERT_EQ(rc, 0);
+
+	rc = famfs_cp_engine_start(&ce, 4, 1048576, 0, 0);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(src, sizeof(src), "/tmp/famfs_cp_engine/src%d", i);
+		snprintf(dest, sizeof(dest), "/tmp/famfs_cp_engine/dest%d", i);
+		destp = cp_engine_test_files(src, dest, sizes[i], i + 1, &srcfd, &destfd);
+		ASSERT_NE(destp, nullptr);
+		rc = famfs_cp_engine_queue(&ce, srcfd, -1, destfd, destp, sizes[i], dest, 0);
+		ASSERT_EQ(rc, 0);
+		total += sizes[i];
+	}
+	rc = famfs_cp_engine_finish(&ce);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ce.nfiles, (u64)nfiles);
+	ASSERT_EQ(ce.nbytes, total);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(src, sizeof(src), "/tmp/famfs_cp_engine/src%d", i);
+		snprintf(dest, sizeof(dest), "/tmp/famfs_cp_engine/dest%d", i);
+		ASSERT_EQ(cp_engine_test_cmp(src, dest), 0);
+	}
+
+	/* Default chunk size, single worker */
+	rc = famfs_cp_engine_start(&ce, 1, 0, 0, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ce.chunk, FAMFS_CP_CHUNK_DEFAULT);
+	destp = cp_engine_test_files("/tmp/famfs_cp_engine/src0", "/tmp/famfs_cp_engine/dest0",
+				     sizes[0], 42, &srcfd, &destfd);
+	ASSERT_NE(destp, nullptr);
+	rc = famfs_cp_engine_queue(&ce, srcfd, -1, destfd, destp, sizes[0], "dest0", 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_cp_engine_finish(&ce);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(cp_engine_test_cmp("/tmp/famfs_cp_engine/src0",
+				     "/tmp/famfs_cp_engine/dest0"), 0);
+
+	/* A source that is shorter than the destination is an error; the rest still copy */
+	rc = famfs_cp_engine_start(&ce, 3, 65536, 0, 0);
+	ASSERT_EQ(rc, 0);
+	destp = cp_engine_test_files("/tmp/famfs_cp_engine/src1", "/tmp/famfs_cp_engine/dest1",
+				     sizes[1], 7, &srcfd, &destfd);
+	ASSERT_NE(destp, nullptr);
+	rc = ftruncate(srcfd, sizes[1] - 4096);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_cp_engine_queue(&ce, srcfd, -1, destfd, destp, sizes[1], "dest1", 11);
+	ASSERT_EQ(rc, 0);
+	destp = cp_engine_test_files("/tmp/famfs_cp_engine/src2", "/tmp/famfs_cp_engine/dest2",
+				     sizes[2], 8, &srcfd, &destfd);
+	ASSERT_NE(destp, nullptr);
+	famfs_cp_engine_queue(&ce, srcfd, -1, destfd, destp, sizes[2], "dest2", 12);
+	rc = famfs_cp_engine_finish(&ce);
+	ASSERT_LT(rc, 0);
+	ASSERT_EQ(ce.nfiles, 2ULL);
+	/* Only the failed file is reported, and only once */
+	ASSERT_EQ(famfs_cp_engine_failed(&ce, &id), 1);
+	ASSERT_EQ(id, 11ULL);
+	ASSERT_EQ(famfs_cp_engine_failed(&ce, &id), 0);
+	ASSERT_EQ(cp_engine_test_cmp("/tmp/famfs_cp_engine/src2",
+				     "/tmp/famfs_cp_engine/dest2"), 0);
+
+	/* O_DIRECT source reads (where the file system supports them); the chunk size is
+	 * rounded up to the O_DIRECT alignment
+	 */
+	rc = famfs_cp_engine_start(&ce, 2, 100000, 1, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ce.chunk, roundup(100000ULL, FAMFS_CP_DIRECT_ALIGN));
+	ndirect = 0;
+	for (i = 0; i < nfiles; i++) {
+		int dsrcfd;
+
+		snprintf(src, sizeof(src), "/tmp/famfs_cp_engine/src%d", i);
+		snprintf(dest, sizeof(dest), "/tmp/famfs_cp_engine/dest%d", i);
+		destp = cp_engine_test_files(src, dest, sizes[i], i + 100, &srcfd, &destfd);
+		ASSERT_NE(destp, nullptr);
+		dsrcfd = open(src, O_RDONLY | O_DIRECT);
+		if (dsrcfd >= 0)
+			ndirect += sizes[i];
+		rc = famfs_cp_engine_queue(&ce, srcfd, dsrcfd, destfd, destp, sizes[i], dest, 0);
+		ASSERT_EQ(rc, 0);
+	}
+	rc = famfs_cp_engine_finish(&ce);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ce.nbytes, total);
+	ASSERT_EQ(ce.nbytes_direct, ndirect);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(src, sizeof(src), "/tmp/famfs_cp_engine/src%d", i);
+		snprintf(dest, sizeof(dest), "/tmp/famfs_cp_engine/dest%d", i);
+		ASSERT_EQ(cp_engine_test_cmp(src, dest), 0);
+	}
+
+	/* A short O_DIRECT read in a range larger than the ring's queue depth falls back
+	 * (rather than waiting forever for completions that will never come), and the
+	 * buffered re-read reports the short source
+	 */
+	rc = famfs_cp_engine_start(&ce, 1, 32 * 1048576, 1, 0);
+	ASSERT_EQ(rc, 0);
+	ASSERT_GT(ce.chunk, (u64)FAMFS_CP_DIRECT_QDEPTH * FAMFS_CP_IO_SIZE);
+	destp = cp_engine_test_files("/tmp/famfs_cp_engine/src0", "/tmp/famfs_cp_engine/dest0",
+				     20 * 1048576, 9, &srcfd, &destfd);
+	ASSERT_NE(destp, nullptr);
+	rc = ftruncate(srcfd, 1048576);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_cp_engine_queue(&ce, srcfd,
+				   open("/tmp/famfs_cp_engine/src0", O_RDONLY | O_DIRECT),
+				   destfd, destp, 20 * 1048576, "dest0", 5);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_cp_engine_finish(&ce);
+	ASSERT_LT(rc, 0);
+	ASSERT_EQ(ce.nbytes_direct, 0ULL);
+	ASSERT_EQ(famfs_cp_engine_failed(&ce, &id), 1);
+	ASSERT_EQ(id, 5ULL);
+
+	/* If the ring fails with reads in flight, they are reaped before the range is
+	 * re-read through the page cache, and the copy is still complete
+	 */
+	rc = famfs_cp_engine_start(&ce, 1, 32 * 1048576, 1, 0);
+	ASSERT_EQ(rc, 0);
+	destp = cp_engine_test_files("/tmp/famfs_cp_engine/src0", "/tmp/famfs_cp_engine/dest0",
+				     20 * 1048576, 10, &srcfd, &destfd);
+	ASSERT_NE(destp, nullptr);
+	mock_failure = MOCK_FAIL_URING_ENTER;
+	rc = famfs_cp_engine_queue(&ce, srcfd,
+				   open("/tmp/famfs_cp_engine/src0", O_RDONLY | O_DIRECT),
+				   destfd, destp, 20 * 1048576, "dest0", 0);
+	ASSERT_EQ(rc, 0);
+	rc = famfs_cp_engine_finish(&ce);
+	mock_failure = MOCK_FAIL_NONE;
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ce.nbytes_direct, 0ULL);
+	ASSERT_EQ(cp_engine_test_cmp("/tmp/famfs_cp_engine/src0",
+				     "/tmp/famfs_cp_engine/dest0"), 0);
+
+	/* Non-temporal stores from a bounce buffer */
+	rc = famfs_cp_engine_start(&ce, 3, 1048576, 0, 1);
+	ASSERT_EQ(rc, 0);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(src, sizeof(src), "/tmp/famfs_cp_engine/src%d", i);
+		snprintf(dest, sizeof(dest), "/tmp/famfs_cp_engine/dest%d", i);
+		destp = cp_engine_test_files(src, dest, sizes[i], i + 200, &srcfd, &destfd);
+		ASSERT_NE(destp, nullptr);
+		rc = famfs_cp_engine_queue(&ce, srcfd, -1, destfd, destp, sizes[i], dest, 0);
+		ASSERT_EQ(rc, 0);
+	}
+	rc = famfs_cp_engine_finish(&ce);
+	ASSERT_EQ(rc, 0);
+	ASSERT_EQ(ce.nbytes, total);
+	for (i = 0; i < nfiles; i++) {
+		snprintf(src, sizeof(src), "/tmp/famfs_cp_engine/src%d", i);
+		snprintf(dest, sizeof(dest), "/tmp/famfs_cp_engine/dest%d", i);
+		ASSERT_EQ(cp_engine_test_cmp(src, dest), 0);
+	}
+
+	/* Sparse source: only the data extents are read, and the holes are zeroed over
+	 * stale destination contents (with and without non-temporal stores)
+	 */
+	for (i = 0; i < 2; i++) {
+		u64 size = 6 * 1048576 + 33;
+		u64 data_ofs[] = { 0, 3 * 1048576, size - 100 };
+		char buf[4096];
+		int j, sparse;
+
+		rc = famfs_cp_engine_start(&ce, 3, 1048576, 0, i);
+		ASSERT_EQ(rc, 0);
+		srcfd = open("/tmp/famfs_cp_engine/sparse", O_RDWR | O_CREAT | O_TRUNC, 0644);
+		ASSERT_GE(srcfd, 0);
+		destfd = open("/tmp/famfs_cp_engine/dsparse", O_RDWR | O_CREAT | O_TRUNC, 0644);
+		ASSERT_GE(destfd, 0);
+		rc = ftruncate(srcfd, size);
+		ASSERT_EQ(rc, 0);
+		rc = ftruncate(destfd, size);
+		ASSERT_EQ(rc, 0);
+		randomize_buffer(buf, sizeof(buf), 300 + i);
+		for (j = 0; j < 3; j++)
+			ASSERT_EQ(pwrite(srcfd, buf, MIN(sizeof(buf), size - data_ofs[j]),
+					 data_ofs[j]), (ssize_t)MIN(sizeof(buf), size - data_ofs[j]));
+		sparse = (lseek(srcfd, 0, SEEK_HOLE) < (off_t)size);
+		destp = (char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, destfd, 0);
+		ASSERT_NE(destp, MAP_FAILED);
+		memset(destp, 0xff, size);
+
+		rc = famfs_cp_engine_queue(&ce, srcfd, -1, destfd, destp, size,
+					   "/tmp/famfs_cp_engine/dsparse", 0);
+		ASSERT_EQ(rc, 0);
+		rc = famfs_cp_engine_finish(&ce);
+		ASSERT_EQ(rc, 0);
+		ASSERT_EQ(ce.nbytes, size);
+		if (sparse) {
+			ASSERT_GE(ce.nbytes_holes, 4 * 1048576ULL);
+		}
+		ASSERT_LT(ce.nbytes_holes, size);
+		ASSERT_EQ(cp_engine_test_cmp("/tmp/famfs_cp_engine/sparse",
+					     "/tmp/famfs_cp_engine/dsparse"), 0);
+	}
+
+	/* At least one thread */
+	rc = famfs_cp_engine_start(&ce, 0, 0, 0, 0);
+	ASSERT_NE(rc, 0);
+
+	system("rm -rf /tmp/famfs_cp_engine");
+}
+
 TEST(famfs, famfs_log_overflow_mkdir_p)
 {
 	u64 device_size = 64ULL * 1024ULL * 1024ULL * 1024ULL;
@@ -702,7 +2102,7 @@ TEST(famfs, famfs_log_overflow_mkdir_p)
 	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
 	ASSERT_EQ(rc, 0);
 
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 0);
 	ASSERT_EQ(rc, 0);
 	//famfs_print_log_stats("famfs_log test", )
 
@@ -845,7 +2245,7 @@ TEST(famfs, famfs_log_overflow_files)
 	rc = famfs_fsck("/tmp/famfs/.meta/.superblock", 0 /* read */, 1, 1);
 	ASSERT_EQ(rc, 0);
 
-	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0);
+	rc = __famfs_logplay(logp, "/tmp/famfs", 0, 0, 0, 0, 0);
 	ASSERT_EQ(rc, 0);
 
 	rc = famfs_fsck_scan(sb, logp, 1, 3);